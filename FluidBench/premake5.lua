@@ -0,0 +1,86 @@
+project "FluidBench"
+	kind "ConsoleApp"
+	language "C++"
+	cppdialect "C++17"
+	staticruntime "off"
+
+	targetdir ("%{wks.location}/bin/" .. outputdir .. "/%{prj.name}")
+	objdir ("%{wks.location}/bin-int/" .. outputdir .. "/%{prj.name}")
+
+	-- Headless build of the simulation code, without the engine, GLFW or ImGui
+	files
+	{
+		"src/**.h",
+		"src/**.cpp",
+
+		"%{wks.location}/FluidSim/src/NavierStokesFluid.h",
+		"%{wks.location}/FluidSim/src/NavierStokesFluid.cpp",
+		"%{wks.location}/FluidSim/src/NeighbourList.h",
+		"%{wks.location}/FluidSim/src/NeighbourList.cpp",
+		"%{wks.location}/FluidSim/src/ParticleFluid.h",
+		"%{wks.location}/FluidSim/src/ParticleFluid.cpp",
+		"%{wks.location}/FluidSim/src/PhaseTimings.h",
+		"%{wks.location}/FluidSim/src/PhaseTimings.cpp",
+		"%{wks.location}/FluidSim/src/SIMD.h",
+		"%{wks.location}/FluidSim/src/Simulation.h",
+		"%{wks.location}/FluidSim/src/SnapshotFormat.h",
+		"%{wks.location}/FluidSim/src/SnapshotReader.h",
+		"%{wks.location}/FluidSim/src/SnapshotReader.cpp",
+		"%{wks.location}/FluidSim/src/SnapshotWriter.h",
+		"%{wks.location}/FluidSim/src/SnapshotWriter.cpp",
+		"%{wks.location}/FluidSim/src/SpatialLookup.h",
+		"%{wks.location}/FluidSim/src/SpatialLookup.cpp",
+		"%{wks.location}/FluidSim/src/ThreadPool.h",
+		"%{wks.location}/FluidSim/src/ThreadPool.cpp",
+		"%{wks.location}/FluidSim/src/VerletIntegration.h",
+		"%{wks.location}/FluidSim/src/VerletIntegration.cpp"
+	}
+
+	defines
+	{
+		"FLUID_HEADLESS"
+	}
+
+	includedirs
+	{
+		"%{wks.location}/FluidSim/src",
+		"%{wks.location}/Stengine/src",
+		"%{IncludeDir.glm}"
+	}
+
+--[[ --------------------- Linux --------------------- ]]--
+
+	filter "system:linux"
+		systemversion "latest"
+		defines { "ST_PLATFORM_LINUX" }
+
+		links
+		{
+			"pthread"
+		}
+
+--[[ -------------------- Windows -------------------- ]]--
+
+	filter "system:windows"
+		systemversion "latest"
+		defines { "ST_PLATFORM_WINDOWS" }
+
+--[[ ------------------ Configurations ------------------ ]]--
+
+	filter "configurations:Debug"
+		defines "ST_DEBUG"
+		runtime "Debug"
+		symbols "On"
+
+	filter "configurations:Release"
+		defines "ST_RELEASE"
+		runtime "Release"
+		optimize "On"
+
+	filter "configurations:Dist"
+		defines "ST_DIST"
+		runtime "Release"
+		optimize "On"
+
+	filter "options:avx2"
+		vectorextensions "AVX2"
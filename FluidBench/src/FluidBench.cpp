@@ -0,0 +1,564 @@
+#include "LookupBenchmark.h"
+#include "NavierStokesFluid.h"
+#include "ParticleFluid.h"
+#include "PhaseTimings.h"
+#include "SIMD.h"
+#include "SnapshotReader.h"
+#include "VerletIntegration.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+// Every heap allocation of the process, so the benchmarks can check that stepping doesn't allocate
+static std::atomic<uint64_t> s_Allocations = 0;
+
+void* operator new(size_t size)
+{
+	s_Allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* pointer = std::malloc(size))
+		return pointer;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+	std::free(pointer);
+}
+
+struct ScenarioResult
+{
+	std::string Name;
+	std::string Solver;
+	int Elements = 0;	// Particles, objects or grid cells
+	int Steps = 0;
+	int Substeps = 0;	// Solver steps taken, particle fluid steps can be split up by the adaptive timestep
+	double TotalMillis = 0.0;
+	uint64_t Allocations = 0;	// Heap allocations during the timed steps
+	std::vector<PhaseTimings::Phase> Phases;
+
+	// Particle fluids only, how far the density ends up above the rest density
+	bool HasDensityStats = false;
+	DensityStats Density;
+
+	// DFSPH only, pressure solver iterations summed over all substeps
+	bool HasPressureStats = false;
+	int64_t DensityIterations = 0;
+	int64_t DivergenceIterations = 0;
+
+	// Sleeping and adaptive resolution only, particles that were still simulated after the last step
+	bool HasActivityStats = false;
+	int ActiveElements = 0;
+
+	// Recording only, frames the snapshot writer kept up with and the ones it had to drop
+	bool HasRecordingStats = false;
+	uint32_t RecordedFrames = 0;
+	uint32_t DroppedFrames = 0;
+	uint64_t RecordedBytes = 0;
+
+	// NavierStokes only, linear solver iterations summed over all steps, the steps with a solve that ran out of
+	// iterations and the residuals the last ones ended with. Gauss-Seidel runs a fixed number of sweeps and computes
+	// no residual, so those are null for the solves it does
+	bool HasSolverStats = false;
+	PressureSolver NavierStokesSolver = PressureSolver::GaussSeidel;
+	int64_t PressureIterations = 0;
+	int64_t DiffusionIterations = 0;
+	int UnconvergedPressureSteps = 0;
+	int UnconvergedDiffusionSteps = 0;
+	SolverStats LastSolves;
+};
+
+struct Scenario
+{
+	const char* Name;
+	const char* Description;
+	int DefaultSteps;
+	std::function<ScenarioResult(int steps, bool multithreaded)> Run;
+};
+
+// Times steps calls of step, with the phase timings of only those steps
+template<typename Func>
+static ScenarioResult RunSteps(const char* name, const char* solver, int elements, int steps, Func&& step)
+{
+	PhaseTimings::Reset();
+
+	uint64_t allocations = s_Allocations.load();
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < steps; i++)
+		step();
+	auto end = std::chrono::steady_clock::now();
+	allocations = s_Allocations.load() - allocations;
+
+	ScenarioResult result;
+	result.Name = name;
+	result.Solver = solver;
+	result.Elements = elements;
+	result.Steps = steps;
+	result.Substeps = steps;
+	result.TotalMillis = std::chrono::duration<double, std::milli>(end - start).count();
+	result.Allocations = allocations;
+	for (const PhaseTimings::Phase& phase : PhaseTimings::GetPhases())
+	{
+		if (phase.Calls > 0)
+			result.Phases.push_back(phase);
+	}
+	return result;
+}
+
+// A square block of particles dropped into a box, the box is sized so the fluid can spread out
+static ScenarioResult RunParticleBlock(const char* name, int particleCount, int steps, bool multithreaded)
+{
+	const float spacing = 7.0f;
+	int side = (int)std::round(std::sqrt((float)particleCount));
+	float blockSize = side * spacing;
+
+	ParticleFluid2D fluid;
+	fluid.SetMultithreaded(multithreaded);
+	fluid.ClearParticles();
+	fluid.SetBounds({ blockSize * 2.0f, blockSize * 1.5f });
+	fluid.GenerateParticleGrid({ side, side }, spacing);
+
+	int substeps = 0;
+	ScenarioResult result = RunSteps(name, "ParticleFluid", fluid.GetParticleCount(), steps, [&]()
+	{
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+		substeps += fluid.GetTimestepStats().Substeps;
+	});
+	result.Substeps = substeps;
+	result.HasDensityStats = true;
+	result.Density = fluid.CalculateDensityStats();
+	return result;
+}
+
+// The particle block, streamed to a snapshot file after every step. The file is read back afterwards, so a
+// frame count that doesn't match the written frames shows up as an error
+static ScenarioResult RunRecording(const char* name, int particleCount, bool quantised, int steps, bool multithreaded)
+{
+	const float spacing = 7.0f;
+	const char* path = "FluidBench.fsnap";
+	int side = (int)std::round(std::sqrt((float)particleCount));
+	float blockSize = side * spacing;
+
+	ParticleFluid2D fluid;
+	fluid.SetMultithreaded(multithreaded);
+	fluid.ClearParticles();
+	fluid.SetBounds({ blockSize * 2.0f, blockSize * 1.5f });
+	fluid.GenerateParticleGrid({ side, side }, spacing);
+	if (!fluid.StartRecording(path, quantised))
+		fprintf(stderr, "Can't create %s\n", path);
+
+	ScenarioResult result = RunSteps(name, quantised ? "ParticleFluid (quantised recording)" : "ParticleFluid (recording)",
+		fluid.GetParticleCount(), steps, [&]()
+	{
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+	});
+
+	// Closing waits for the frames still in the ring buffer
+	fluid.StopRecording();
+	const SnapshotWriter& recorder = fluid.GetRecorder();
+	result.HasRecordingStats = true;
+	result.RecordedFrames = recorder.GetWrittenFrames();
+	result.DroppedFrames = recorder.GetDroppedFrames();
+	result.RecordedBytes = recorder.GetWrittenBytes();
+
+	SnapshotReader reader;
+	if (recorder.HasFailed() || !reader.Open(path) || reader.GetFrameCount() != (int)result.RecordedFrames)
+		fprintf(stderr, "Recording to %s failed\n", path);
+	reader.Close();
+	std::remove(path);
+	return result;
+}
+
+// A column of fluid in the corner of the window sized box, that collapses and runs across the floor
+static ScenarioResult RunDamBreak(const char* name, ParticleSolver solver, int steps, bool multithreaded, bool adaptive = false)
+{
+	const float spacing = 7.0f;
+	const glm::vec2 bounds = { 1920.0f, 1080.0f };
+	int columns = 60, rows = 150;
+
+	ParticleFluid2D fluid;
+	fluid.SetMultithreaded(multithreaded);
+	fluid.SetSolver(solver);
+	fluid.SetAdaptiveResolution(adaptive);
+	fluid.ClearParticles();
+	fluid.SetBounds(bounds);
+	glm::vec2 center = -bounds / 2.0f + glm::vec2{ columns, rows } * spacing / 2.0f + spacing;
+	fluid.GenerateParticleGrid({ columns, rows }, spacing, center);
+
+	const char* solverName = adaptive ? "ParticleFluid (adaptive)" : "ParticleFluid";
+	if (solver == ParticleSolver::PBF)
+		solverName = "ParticleFluid (PBF)";
+	else if (solver == ParticleSolver::DFSPH)
+		solverName = "ParticleFluid (DFSPH)";
+
+	int substeps = 0;
+	int64_t densityIterations = 0, divergenceIterations = 0;
+	ScenarioResult result = RunSteps(name, solverName, fluid.GetParticleCount(), steps, [&]()
+	{
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+		substeps += fluid.GetTimestepStats().Substeps;
+		densityIterations += fluid.GetPressureSolverStats().DensityIterations;
+		divergenceIterations += fluid.GetPressureSolverStats().DivergenceIterations;
+	});
+	result.Substeps = substeps;
+	result.HasDensityStats = true;
+	result.Density = fluid.CalculateDensityStats();
+	result.HasPressureStats = solver == ParticleSolver::DFSPH;
+	result.DensityIterations = densityIterations;
+	result.DivergenceIterations = divergenceIterations;
+	result.HasActivityStats = adaptive;
+	result.ActiveElements = fluid.GetParticleCount();
+	return result;
+}
+
+// An emitter that keeps pouring into a box with a sink on the floor, timed once the particle count has settled.
+// The pool is sized below what the emitter would fill, so it also runs while the pool is full
+static ScenarioResult RunEmitterSink(const char* name, int steps, bool multithreaded)
+{
+	const glm::vec2 bounds = { 1920.0f, 1080.0f };
+
+	ParticleFluid2D fluid;
+	fluid.SetMultithreaded(multithreaded);
+	fluid.ClearParticles();
+	fluid.SetBounds(bounds);
+	fluid.SetCapacity(5000);
+
+	ParticleEmitter<2> emitter;
+	emitter.Position = { -bounds.x * 0.4f, bounds.y * 0.3f };
+	emitter.Direction = { 1.0f, -0.3f };
+	emitter.Speed = 300.0f;
+	emitter.Radius = 70.0f;
+	fluid.AddEmitter(emitter);
+
+	ParticleSink<2> sink;
+	sink.Position = { bounds.x * 0.45f, -bounds.y / 2.0f };
+	sink.Radius = 100.0f;
+	fluid.AddSink(sink);
+
+	for (int i = 0; i < 1200; i++)
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+
+	int substeps = 0;
+	ScenarioResult result = RunSteps(name, "ParticleFluid", fluid.GetParticleCount(), steps, [&]()
+	{
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+		substeps += fluid.GetTimestepStats().Substeps;
+	});
+	result.Substeps = substeps;
+	result.HasDensityStats = true;
+	result.Density = fluid.CalculateDensityStats();
+	return result;
+}
+
+// A shallow pool at the bottom of a box, timed once it has come to rest. It settles with sleeping either way,
+// which is a lot faster than without, and both versions then start from the same state
+static ScenarioResult RunRestingPool(const char* name, bool sleeping, int steps, bool multithreaded)
+{
+	const float spacing = 7.0f;
+	const glm::vec2 bounds = { 1280.0f, 720.0f };
+	int columns = 150, rows = 40;
+
+	ParticleFluid2D fluid;
+	fluid.SetMultithreaded(multithreaded);
+	fluid.SetSleeping(true);
+	fluid.ClearParticles();
+	fluid.SetBounds(bounds);
+	glm::vec2 center = { 0.0f, -bounds.y / 2.0f + rows * spacing / 2.0f + spacing };
+	fluid.GenerateParticleGrid({ columns, rows }, spacing, center);
+
+	for (int i = 0; i < 2100; i++)
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+	fluid.SetSleeping(sleeping);
+
+	int substeps = 0;
+	ScenarioResult result = RunSteps(name, "ParticleFluid", fluid.GetParticleCount(), steps, [&]()
+	{
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+		substeps += fluid.GetTimestepStats().Substeps;
+	});
+	result.Substeps = substeps;
+	result.HasDensityStats = true;
+	result.Density = fluid.CalculateDensityStats();
+	result.HasActivityStats = sleeping;
+	result.ActiveElements = fluid.GetActiveCount();
+	return result;
+}
+
+// A block of fluid dropped into the corner of a box, the 3D counterpart of the dam break
+static ScenarioResult RunVolume(const char* name, int steps, bool multithreaded)
+{
+	const float spacing = 7.0f;
+	const glm::vec3 bounds = { 480.0f, 320.0f, 240.0f };
+	glm::ivec3 counts = { 30, 40, 15 };
+
+	// DFSPH, the explicit solver's constants are tuned to the 2D kernel
+	ParticleFluid3D fluid;
+	fluid.SetMultithreaded(multithreaded);
+	fluid.SetSolver(ParticleSolver::DFSPH);
+	fluid.ClearParticles();
+	fluid.SetBounds(bounds);
+	glm::vec3 center = -bounds / 2.0f + glm::vec3(counts) * spacing / 2.0f + spacing;
+	fluid.GenerateParticleGrid(counts, spacing, center);
+
+	int substeps = 0;
+	int64_t densityIterations = 0, divergenceIterations = 0;
+	ScenarioResult result = RunSteps(name, "ParticleFluid3D (DFSPH)", fluid.GetParticleCount(), steps, [&]()
+	{
+		fluid.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+		substeps += fluid.GetTimestepStats().Substeps;
+		densityIterations += fluid.GetPressureSolverStats().DensityIterations;
+		divergenceIterations += fluid.GetPressureSolverStats().DivergenceIterations;
+	});
+	result.Substeps = substeps;
+	result.HasDensityStats = true;
+	result.Density = fluid.CalculateDensityStats();
+	result.HasPressureStats = true;
+	result.DensityIterations = densityIterations;
+	result.DivergenceIterations = divergenceIterations;
+	return result;
+}
+
+// Same setup as the interactive simulation, with a source of density and velocity near the bottom that grows with the grid
+static ScenarioResult RunNavierStokes(const char* name, int size, PressureSolver solver, int steps, bool multithreaded)
+{
+	NavierStokesFluid fluid(size, size, 3, 0, 0.0000001f, 1);
+	fluid.SetMultithreaded(multithreaded);
+	fluid.SetPressureSolver(solver);
+	int radius = std::max(size / 256, 1);
+
+	const char* solverNames[] = { "NavierStokesFluid", "NavierStokesFluid (multigrid)", "NavierStokesFluid (conjugate gradient)" };
+	int64_t pressureIterations = 0, diffusionIterations = 0;
+	int unconvergedPressureSteps = 0, unconvergedDiffusionSteps = 0;
+	ScenarioResult result = RunSteps(name, solverNames[(int)solver], size * size, steps, [&]()
+	{
+		fluid.AddDensity(size / 2, size / 4, 5 * radius, 5.0f);
+		fluid.AddVelocity(size / 2, size / 4, 10 * radius, 0.0f, 2.0f);
+		fluid.Step(1.0f / 60.0f);
+		pressureIterations += fluid.GetSolverStats().PressureIterations;
+		diffusionIterations += fluid.GetSolverStats().DiffusionIterations;
+		unconvergedPressureSteps += !fluid.GetSolverStats().PressureConverged;
+		unconvergedDiffusionSteps += !fluid.GetSolverStats().DiffusionConverged;
+	});
+	result.HasSolverStats = true;
+	result.NavierStokesSolver = solver;
+	result.PressureIterations = pressureIterations;
+	result.DiffusionIterations = diffusionIterations;
+	result.UnconvergedPressureSteps = unconvergedPressureSteps;
+	result.UnconvergedDiffusionSteps = unconvergedDiffusionSteps;
+	result.LastSolves = fluid.GetSolverStats();
+	return result;
+}
+
+// Verlet has no parallel passes, it always runs on the calling thread
+static ScenarioResult RunVerlet(int steps, bool /*multithreaded*/)
+{
+	VerletIntegration verlet;
+
+	return RunSteps("verlet_1600", "VerletIntegration", 40 * 40, steps, [&]()
+	{
+		verlet.Step(Sten::InputState{}, { 0.0f, 0.0f }, { 0.0f, 0.0f }, 1.0f / 60.0f);
+	});
+}
+
+static std::vector<Scenario> GetScenarios()
+{
+	return {
+		{ "dam_break", "9k particle column collapsing in a 1920x1080 box", 300, [](int steps, bool multithreaded) { return RunDamBreak("dam_break", ParticleSolver::SPH, steps, multithreaded); } },
+		{ "dam_break_pbf", "Same dam break with the Position Based Fluids solver", 300, [](int steps, bool multithreaded) { return RunDamBreak("dam_break_pbf", ParticleSolver::PBF, steps, multithreaded); } },
+		{ "dam_break_dfsph", "Same dam break with the divergence-free SPH solver", 300, [](int steps, bool multithreaded) { return RunDamBreak("dam_break_dfsph", ParticleSolver::DFSPH, steps, multithreaded); } },
+		{ "dam_break_adaptive", "Same dam break with adaptive resolution, merging the particles far from the surface", 300, [](int steps, bool multithreaded) { return RunDamBreak("dam_break_adaptive", ParticleSolver::SPH, steps, multithreaded, true); } },
+		{ "emitter_sink", "Emitter pouring into a box with a sink, up to 5k particles", 300, [](int steps, bool multithreaded) { return RunEmitterSink("emitter_sink", steps, multithreaded); } },
+		{ "resting_pool", "6k particle pool at rest in a 1280x720 box", 300, [](int steps, bool multithreaded) { return RunRestingPool("resting_pool", false, steps, multithreaded); } },
+		{ "resting_pool_sleeping", "Same pool with sleeping, only the awake particles are simulated", 300, [](int steps, bool multithreaded) { return RunRestingPool("resting_pool_sleeping", true, steps, multithreaded); } },
+		{ "volume_3d", "18k particle block collapsing in a 3D box, with DFSPH", 200, [](int steps, bool multithreaded) { return RunVolume("volume_3d", steps, multithreaded); } },
+		{ "particles_10k", "10k particle block", 200, [](int steps, bool multithreaded) { return RunParticleBlock("particles_10k", 10000, steps, multithreaded); } },
+		{ "particles_100k", "100k particle block", 50, [](int steps, bool multithreaded) { return RunParticleBlock("particles_100k", 100000, steps, multithreaded); } },
+		{ "particles_1m", "1M particle block", 10, [](int steps, bool multithreaded) { return RunParticleBlock("particles_1m", 1000000, steps, multithreaded); } },
+		{ "recording_100k", "100k particle block, recorded to a snapshot file every step", 50, [](int steps, bool multithreaded) { return RunRecording("recording_100k", 100000, false, steps, multithreaded); } },
+		{ "recording_1m_quantised", "1M particle block, recorded every step with 16 bit quantisation", 10, [](int steps, bool multithreaded) { return RunRecording("recording_1m_quantised", 1000000, true, steps, multithreaded); } },
+		{ "navier_stokes_256", "256x256 grid with a constant source", 200, [](int steps, bool multithreaded) { return RunNavierStokes("navier_stokes_256", 256, PressureSolver::GaussSeidel, steps, multithreaded); } },
+		{ "navier_stokes_512", "Same source on a 512x512 grid", 50, [](int steps, bool multithreaded) { return RunNavierStokes("navier_stokes_512", 512, PressureSolver::GaussSeidel, steps, multithreaded); } },
+		{ "navier_stokes_2048", "Same source on a 2048x2048 grid", 5, [](int steps, bool multithreaded) { return RunNavierStokes("navier_stokes_2048", 2048, PressureSolver::GaussSeidel, steps, multithreaded); } },
+		{ "navier_stokes_512_multigrid", "512x512 grid, with the pressure solved by multigrid", 50, [](int steps, bool multithreaded) { return RunNavierStokes("navier_stokes_512_multigrid", 512, PressureSolver::Multigrid, steps, multithreaded); } },
+		{ "navier_stokes_2048_multigrid", "2048x2048 grid, with the pressure solved by multigrid", 5, [](int steps, bool multithreaded) { return RunNavierStokes("navier_stokes_2048_multigrid", 2048, PressureSolver::Multigrid, steps, multithreaded); } },
+		{ "navier_stokes_512_cg", "512x512 grid, with the pressure and diffusion solved by conjugate gradient", 20, [](int steps, bool multithreaded) { return RunNavierStokes("navier_stokes_512_cg", 512, PressureSolver::ConjugateGradient, steps, multithreaded); } },
+		{ "verlet_1600", "Default Verlet scene, always single threaded", 100, RunVerlet },
+	};
+}
+
+static std::string EscapeJson(const std::string& text)
+{
+	std::string escaped;
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		escaped += c;
+	}
+	return escaped;
+}
+
+static void PrintJson(const std::vector<ScenarioResult>& results)
+{
+	// Which of the SIMD.h paths the kernels were built with, premake's --avx2 option picks the 8 wide one
+	printf("{\n  \"simd\": \"%s\",\n", SIMD::Width == 8 ? "AVX2" : "SSE2");
+	printf("  \"scenarios\": [");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const ScenarioResult& result = results[i];
+
+		printf("%s\n    {\n", i == 0 ? "" : ",");
+		printf("      \"name\": \"%s\",\n", EscapeJson(result.Name).c_str());
+		printf("      \"solver\": \"%s\",\n", EscapeJson(result.Solver).c_str());
+		printf("      \"elements\": %d,\n", result.Elements);
+		printf("      \"steps\": %d,\n", result.Steps);
+		printf("      \"substeps\": %d,\n", result.Substeps);
+		printf("      \"total_ms\": %.3f,\n", result.TotalMillis);
+		printf("      \"steps_per_second\": %.3f,\n", result.Steps * 1000.0 / result.TotalMillis);
+		printf("      \"ns_per_element_step\": %.3f,\n", result.TotalMillis * 1e6 / ((double)result.Elements * result.Steps));
+		printf("      \"allocations_per_step\": %.3f,\n", (double)result.Allocations / result.Steps);
+		if (result.HasDensityStats)
+		{
+			printf("      \"average_compression\": %.5f,\n", result.Density.AverageCompression);
+			printf("      \"max_compression\": %.5f,\n", result.Density.MaxCompression);
+		}
+		if (result.HasPressureStats)
+		{
+			printf("      \"density_iterations_per_substep\": %.3f,\n", (double)result.DensityIterations / std::max(result.Substeps, 1));
+			printf("      \"divergence_iterations_per_substep\": %.3f,\n", (double)result.DivergenceIterations / std::max(result.Substeps, 1));
+		}
+		if (result.HasActivityStats)
+			printf("      \"active_elements\": %d,\n", result.ActiveElements);
+		if (result.HasRecordingStats)
+		{
+			printf("      \"recorded_frames\": %u,\n", result.RecordedFrames);
+			printf("      \"dropped_frames\": %u,\n", result.DroppedFrames);
+			printf("      \"recorded_mb\": %.3f,\n", result.RecordedBytes / (1024.0 * 1024.0));
+		}
+		if (result.HasSolverStats)
+		{
+			printf("      \"pressure_iterations_per_step\": %.3f,\n", (double)result.PressureIterations / result.Steps);
+			if (result.NavierStokesSolver != PressureSolver::GaussSeidel)
+			{
+				printf("      \"pressure_residual\": %g,\n", result.LastSolves.PressureResidual);
+				printf("      \"pressure_unconverged_steps\": %d,\n", result.UnconvergedPressureSteps);
+			}
+			else
+			{
+				printf("      \"pressure_residual\": null,\n");
+				printf("      \"pressure_unconverged_steps\": null,\n");
+			}
+			printf("      \"diffusion_iterations_per_step\": %.3f,\n", (double)result.DiffusionIterations / result.Steps);
+			if (result.NavierStokesSolver == PressureSolver::ConjugateGradient)
+			{
+				printf("      \"diffusion_residual\": %g,\n", result.LastSolves.DiffusionResidual);
+				printf("      \"diffusion_unconverged_steps\": %d,\n", result.UnconvergedDiffusionSteps);
+			}
+			else
+			{
+				printf("      \"diffusion_residual\": null,\n");
+				printf("      \"diffusion_unconverged_steps\": null,\n");
+			}
+		}
+		printf("      \"phases\": [");
+		for (size_t j = 0; j < result.Phases.size(); j++)
+		{
+			const PhaseTimings::Phase& phase = result.Phases[j];
+			printf("%s\n        { \"name\": \"%s\", \"calls\": %llu, \"total_ms\": %.3f, \"ms_per_step\": %.4f }",
+				j == 0 ? "" : ",", EscapeJson(phase.Name).c_str(), (unsigned long long)phase.Calls,
+				phase.TotalMillis, phase.TotalMillis / result.Steps);
+		}
+		printf("\n      ]\n    }");
+	}
+	printf("\n  ]\n}\n");
+}
+
+static void PrintUsage(const std::vector<Scenario>& scenarios)
+{
+	fprintf(stderr, "Usage: FluidBench [scenario...] [--steps N] [--single-threaded] [--lookup]\n\n");
+	fprintf(stderr, "Runs the scenarios (all of them by default) and prints the results as JSON to stdout.\n");
+	fprintf(stderr, "  --steps N           Overrides the number of steps of every scenario\n");
+	fprintf(stderr, "  --single-threaded   Runs the particle passes on the calling thread only\n");
+	fprintf(stderr, "  --lookup            Runs the spatial lookup micro benchmarks instead\n\n");
+	fprintf(stderr, "Scenarios:\n");
+	for (const Scenario& scenario : scenarios)
+		fprintf(stderr, "  %-20s %s (%d steps)\n", scenario.Name, scenario.Description, scenario.DefaultSteps);
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<Scenario> scenarios = GetScenarios();
+	std::vector<const Scenario*> selected;
+	int steps = 0;
+	bool multithreaded = true;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+		{
+			steps = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--single-threaded") == 0)
+		{
+			multithreaded = false;
+		}
+		else if (strcmp(argv[i], "--lookup") == 0)
+		{
+			RunLookupBenchmarks();
+			return 0;
+		}
+		else
+		{
+			const Scenario* found = nullptr;
+			for (const Scenario& scenario : scenarios)
+			{
+				if (strcmp(argv[i], scenario.Name) == 0)
+					found = &scenario;
+			}
+
+			if (!found)
+			{
+				PrintUsage(scenarios);
+				return 1;
+			}
+			selected.push_back(found);
+		}
+	}
+
+	if (selected.empty())
+	{
+		for (const Scenario& scenario : scenarios)
+			selected.push_back(&scenario);
+	}
+
+	// Progress goes to stderr, so stdout only holds the JSON
+	std::vector<ScenarioResult> results;
+	for (const Scenario* scenario : selected)
+	{
+		int scenarioSteps = steps > 0 ? steps : scenario->DefaultSteps;
+		fprintf(stderr, "%-20s ", scenario->Name);
+
+		ScenarioResult result = scenario->Run(scenarioSteps, multithreaded);
+		fprintf(stderr, "%9d elements | %9.2f steps/s | %9.2f ns/element/step\n", result.Elements,
+			result.Steps * 1000.0 / result.TotalMillis, result.TotalMillis * 1e6 / ((double)result.Elements * result.Steps));
+
+		results.push_back(std::move(result));
+	}
+
+	PrintJson(results);
+	return 0;
+}
@@ -0,0 +1,244 @@
+#include "LookupBenchmark.h"
+#include "SpatialLookup.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Average wall clock time of func in milliseconds, after one warm up run
+template<typename Func>
+static double MeasureMillis(int iterations, Func&& func)
+{
+	func();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < iterations; i++)
+		func();
+	auto end = std::chrono::high_resolution_clock::now();
+
+	return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+// Hardware cache miss counter for the calling thread, reads -1 when the counter isn't available
+// (other platforms, containers without perf access, ...)
+class CacheMissCounter
+{
+public:
+	CacheMissCounter()
+	{
+#if defined(__linux__)
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		m_File = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+
+	~CacheMissCounter()
+	{
+#if defined(__linux__)
+		if (m_File >= 0)
+			close(m_File);
+#endif
+	}
+
+	void Start()
+	{
+#if defined(__linux__)
+		if (m_File >= 0)
+		{
+			ioctl(m_File, PERF_EVENT_IOC_RESET, 0);
+			ioctl(m_File, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	int64_t Stop()
+	{
+#if defined(__linux__)
+		int64_t count = 0;
+		if (m_File >= 0)
+		{
+			ioctl(m_File, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(m_File, &count, sizeof(count)) == sizeof(count))
+				return count;
+		}
+#endif
+		return -1;
+	}
+private:
+	int m_File = -1;
+};
+
+// Particles scattered uniformly over a square, with the density picked so that every cell of the
+// simulation's cell size holds about as many particles as the resting fluid does (~2.5)
+static void GenerateParticles(int particleCount, float cellSize, std::vector<float>& positionX, std::vector<float>& positionY)
+{
+	const float particlesPerCell = 2.5f;
+	float side = std::sqrt(particleCount / particlesPerCell) * cellSize;
+
+	std::mt19937 random(1337);
+	std::uniform_real_distribution<float> distribution(-side / 2.0f, side / 2.0f);
+
+	positionX.resize(particleCount);
+	positionY.resize(particleCount);
+	for (int i = 0; i < particleCount; i++)
+	{
+		positionX[i] = distribution(random);
+		positionY[i] = distribution(random);
+	}
+}
+
+static void BenchmarkSpatialLookup(int particleCount)
+{
+	const float cellSize = 11.0f;
+	std::vector<float> positionX, positionY;
+	GenerateParticles(particleCount, cellSize, positionX, positionY);
+
+	int iterations = std::max(3, 2000000 / particleCount);
+	SpatialLookup<2> lookup;
+
+	double stdSort = MeasureMillis(iterations, [&]()
+	{
+		lookup.Build({ positionX.data(), positionY.data() }, particleCount, cellSize, SpatialSortMethod::StdSort);
+	});
+	double countingSort = MeasureMillis(iterations, [&]()
+	{
+		lookup.Build({ positionX.data(), positionY.data() }, particleCount, cellSize, SpatialSortMethod::CountingSort);
+	});
+
+	printf("%10d | %12.3f | %14.3f | %7.2fx\n", particleCount, stdSort, countingSort, stdSort / countingSort);
+}
+
+// Same access pattern as the density pass: every particle reads the positions of all the particles
+// in the 3x3 cells around it. Counts the distinct 64 byte lines of positionX that every particle touches.
+static float NeighbourWalk(const SpatialLookup<2>& lookup, const float* positionX, const float* positionY, int count, float radius, int64_t* linesTouched)
+{
+	const std::vector<Entry>& entries = lookup.GetEntries();
+	float sqrRadius = radius * radius;
+	float total = 0.0f;
+	int64_t lines = 0;
+	std::vector<uintptr_t> particleLines;
+
+	for (int i = 0; i < count; i++)
+	{
+		int2 center = lookup.PositionToCellCoord({ positionX[i], positionY[i] });
+		particleLines.clear();
+
+		for (int offsetX = -1; offsetX <= 1; offsetX++)
+		{
+			for (int offsetY = -1; offsetY <= 1; offsetY++)
+			{
+				unsigned int key = lookup.GetCellKey(center + int2(offsetX, offsetY));
+				for (int e = lookup.GetCellStart(key); e < lookup.GetCellEnd(key); e++)
+				{
+					int j = entries[e].index;
+					float dx = positionX[j] - positionX[i];
+					float dy = positionY[j] - positionY[i];
+					float sqrDst = dx * dx + dy * dy;
+					if (sqrDst < sqrRadius)
+						total += sqrRadius - sqrDst;
+
+					if (linesTouched)
+						particleLines.push_back((uintptr_t)&positionX[j] / 64);
+				}
+			}
+		}
+
+		if (linesTouched)
+		{
+			std::sort(particleLines.begin(), particleLines.end());
+			lines += std::unique(particleLines.begin(), particleLines.end()) - particleLines.begin();
+		}
+	}
+
+	if (linesTouched)
+		*linesTouched = lines;
+	return total;
+}
+
+template<typename T>
+static void Permute(std::vector<T>& values, const std::vector<int>& order)
+{
+	std::vector<T> permuted(values.size());
+	for (int i = 0; i < order.size(); i++)
+		permuted[i] = values[order[i]];
+	values.swap(permuted);
+}
+
+static void BenchmarkReorder(int particleCount)
+{
+	const float cellSize = 11.0f;
+
+	for (const char* ordering : { "None", "Cell Key", "Morton" })
+	{
+		std::vector<float> positionX, positionY;
+		GenerateParticles(particleCount, cellSize, positionX, positionY);
+
+		SpatialLookup<2> lookup;
+		lookup.Build({ positionX.data(), positionY.data() }, particleCount, cellSize);
+
+		std::vector<int> order;
+		if (strcmp(ordering, "Cell Key") == 0)
+			lookup.GetCellKeyOrder(order);
+		else if (strcmp(ordering, "Morton") == 0)
+			lookup.GetMortonOrder({ positionX.data(), positionY.data() }, particleCount, order);
+
+		if (!order.empty())
+		{
+			Permute(positionX, order);
+			Permute(positionY, order);
+			lookup.RemapIndices(order);
+		}
+
+		int64_t lines = 0;
+		NeighbourWalk(lookup, positionX.data(), positionY.data(), particleCount, cellSize, &lines);
+
+		int iterations = std::max(3, 2000000 / particleCount);
+		float checksum = 0.0f;
+		CacheMissCounter counter;
+		counter.Start();
+		double millis = MeasureMillis(iterations, [&]()
+		{
+			checksum += NeighbourWalk(lookup, positionX.data(), positionY.data(), particleCount, cellSize, nullptr);
+		});
+		int64_t misses = counter.Stop();
+
+		char missText[32] = "n/a";
+		if (misses >= 0)
+			snprintf(missText, sizeof(missText), "%.3f", (double)misses / (iterations + 1) / particleCount);
+
+		printf("%10d | %-8s | %10.3f | %14.2f | %16s\n", particleCount, ordering, millis,
+			(double)lines / particleCount, missText);
+	}
+}
+
+void RunLookupBenchmarks()
+{
+	printf("Spatial lookup build time (ms)\n");
+	printf("%10s | %12s | %14s | %8s\n", "Particles", "std::sort", "Counting Sort", "Speedup");
+	for (int particleCount : { 10000, 100000, 1000000 })
+		BenchmarkSpatialLookup(particleCount);
+
+	printf("\nNeighbour walk after reordering the particles\n");
+	printf("%10s | %-8s | %10s | %14s | %16s\n", "Particles", "Ordering", "Time (ms)", "Lines/Particle", "Misses/Particle");
+	for (int particleCount : { 100000, 1000000 })
+		BenchmarkReorder(particleCount);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Micro benchmarks of the spatial lookup: build time per sort method and the neighbour walk
+// for every particle ordering, printed as tables
+void RunLookupBenchmarks();
@@ -0,0 +1,34 @@
+#version 450
+
+layout(location = 0) in vec2 a_Corner;
+layout(location = 1) in vec3 a_Position;
+layout(location = 2) in float a_Radius;
+layout(location = 3) in int a_Color;
+
+layout(std140, binding = 0) uniform Camera
+{
+	mat4 u_ViewProjection;
+};
+
+struct VertexOutput
+{
+	vec3 LocalPosition;
+	vec4 Color;
+	float Thickness;
+	float Fade;
+};
+
+layout (location = 0) out VertexOutput Output;
+layout (location = 4) out flat int v_EntityID;
+
+// Shares the fragment shader of Renderer2D_Circle, as a filled circle with the default fade
+void main()
+{
+	Output.LocalPosition = vec3(a_Corner, 0.0);
+	Output.Color = unpackUnorm4x8(uint(a_Color));
+	Output.Thickness = 1.0;
+	Output.Fade = 0.005;
+	v_EntityID = -1;
+
+	gl_Position = u_ViewProjection * vec4(a_Position.xy + a_Corner * a_Radius, a_Position.z, 1.0);
+}
@@ -122,3 +122,6 @@ project "FluidSim"
 		defines "ST_DIST"
 		runtime "Release"
 		optimize "On"
+
+	filter "options:avx2"
+		vectorextensions "AVX2"
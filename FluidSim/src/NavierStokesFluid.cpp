@@ -1,9 +1,9 @@
 #include "NavierStokesFluid.h"
+#include "SIMD.h"
 
-#include <Stengine.h>
+#include <algorithm>
 #include <cmath>
-
-#define IX(x, y) (std::clamp(x, 0, m_Width - 1) + std::clamp(y, 0, m_Height - 1) * m_Width)
+#include <cstring>
 
 NavierStokesFluid::NavierStokesFluid(int width, int height, int scale, float diffusion, float viscosity, int iterations)
 	: m_Width(width), m_Height(height), m_Scale(scale), m_Diffusion(diffusion), m_Viscosity(viscosity), m_Iterations(iterations)
@@ -26,6 +26,8 @@ NavierStokesFluid::NavierStokesFluid(int width, int height, int scale, float dif
     memset(m_VelocityY, 0, c * sizeof(float));
     memset(m_PreviousVelocityX, 0, c * sizeof(float));
     memset(m_PreviousVelocityY, 0, c * sizeof(float));
+
+    AllocateSolverBuffers();
 }
 
 void NavierStokesFluid::Resize(int width, int height)
@@ -56,6 +58,8 @@ void NavierStokesFluid::Resize(int width, int height)
     memset(m_VelocityY, 0, c * sizeof(float));
     memset(m_PreviousVelocityX, 0, c * sizeof(float));
     memset(m_PreviousVelocityY, 0, c * sizeof(float));
+
+    AllocateSolverBuffers();
 }
 
 void NavierStokesFluid::AddDensity(int x, int y, int radius, float amount)
@@ -72,7 +76,7 @@ void NavierStokesFluid::AddDensity(int x, int y, int radius, float amount)
             // Check if the distance is within the specified radius
             if (distance <= r2) {
                 // Set the value of the element to the specified value
-                m_Density[IX(i, j)] += amount;
+                m_Density[ClampedIndex(i, j)] += amount;
             }
         }
     }
@@ -92,7 +96,7 @@ void NavierStokesFluid::AddVelocity(int x, int y, int radius, float amountX, flo
             // Check if the distance is within the specified radius
             if (distance <= r2) {
                 // Set the value of the element to the specified value    
-                int index = IX(i, j);
+                int index = ClampedIndex(i, j);
                 m_VelocityX[index] += amountX;
                 m_VelocityY[index] += amountY;
             }
@@ -105,30 +109,91 @@ void NavierStokesFluid::Diffuse(int b, float* x, float* x0, float diff, float dt
     ST_PROFILE_FUNCTION();
 
     float a = dt * diff * (m_Width - 2) * (m_Height * 2);
-    LinearSolve(b, x, x0, a, 1 + a * 6);
+    if (m_PressureSolver != PressureSolver::ConjugateGradient)
+    {
+        LinearSolve(b, x, x0, a, 1 + a * 6);
+        m_SolverStats.DiffusionIterations += m_Iterations;
+        return;
+    }
+
+    // Diffusing over one step barely changes the field, so it is the starting guess
+    memcpy(x, x0, m_Width * m_Height * sizeof(float));
+    float residual = 0.0f;
+    m_SolverStats.DiffusionIterations += SolveConjugateGradient(b, x, x0, a, 1 + a * 6, SumSquares(x0), false, residual);
+    m_SolverStats.DiffusionResidual = residual;
+    if (residual > m_PressureTolerance)
+        m_SolverStats.DiffusionConverged = false;
 }
 
 void NavierStokesFluid::LinearSolve(int b, float* x, float* x0, float a, float c)
 {
     ST_PROFILE_FUNCTION();
 
+    RedBlackGaussSeidel(b, x, x0, m_Width, m_Height, a, c, m_Iterations);
+}
+
+void NavierStokesFluid::RedBlackGaussSeidel(int b, float* x, const float* x0, int width, int height, float a, float c, int iterations, bool blackFirst)
+{
+    // Red cells only depend on black ones and the other way around, so all cells of one colour can be updated
+    // at once. The even rows of a colour are done before the odd ones, that way no row is written while
+    // another thread reads it
     float cRecip = 1.0 / c;
-    for (int k = 0; k < m_Iterations; k++)
+    int rowCount = height - 2;
+    int grainSize = std::max(4096 / width, 1);
+    for (int k = 0; k < iterations; k++)
     {
-        for (int j = 1; j < m_Height - 1; j++)
+        for (int pass = 0; pass < 2; pass++)
         {
-            for (int i = 1; i < m_Width - 1; i++)
+            int color = pass ^ (int)blackFirst;
+            for (int parity = 0; parity < 2; parity++)
             {
-                x[IX(i, j)] =
-                    (x0[IX(i, j)] + a *
-                        (x[IX(i + 1, j)]
-                            + x[IX(i - 1, j)]
-                            + x[IX(i, j + 1)]
-                            + x[IX(i, j - 1)]
-                            )) * cRecip;
+                ParallelFor((rowCount - parity + 1) / 2, grainSize, [&](int begin, int end)
+                {
+                    for (int r = begin; r < end; r++)
+                        RelaxRow(x, x0, width, a, cRecip, 1 + parity + 2 * r, color);
+                });
             }
         }
-        SetBound(b, x);
+        SetBound(b, x, width, height);
+    }
+}
+
+// Lane l of a load at offset o is 1 when l + o is even
+alignas(64) static const float s_Checkerboard[17] = { 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1 };
+
+void NavierStokesFluid::RelaxRow(float* x, const float* x0, int width, float a, float cRecip, int j, int color)
+{
+    float* row = x + j * width;
+    const float* row0 = x0 + j * width;
+
+    // Whole vectors of the row, the cells of the other colour are written back unchanged. Every vector is stored
+    // one iteration late, the next one loads its last cell as a neighbour and a load that partly overlaps a store
+    // still in flight stalls
+    SIMD::Float va = SIMD::Set(a);
+    SIMD::Float vcRecip = SIMD::Set(cRecip);
+    SIMD::Mask mask = SIMD::Equal(SIMD::Load(s_Checkerboard + ((1 + j + color) & 1)), SIMD::Set(1.0f));
+    SIMD::Float pending = SIMD::Zero();
+    float* pendingTarget = nullptr;
+    int i = 1;
+    for (; i + SIMD::Width <= width - 1; i += SIMD::Width)
+    {
+        SIMD::Float neighbours = SIMD::Add(SIMD::Add(SIMD::Load(row + i + 1), SIMD::Load(row + i - 1)),
+            SIMD::Add(SIMD::Load(row + i + width), SIMD::Load(row + i - width)));
+        SIMD::Float value = SIMD::Mul(SIMD::Add(SIMD::Load(row0 + i), SIMD::Mul(va, neighbours)), vcRecip);
+        SIMD::Float result = SIMD::Select(mask, value, SIMD::Load(row + i));
+
+        if (pendingTarget)
+            SIMD::Store(pendingTarget, pending);
+        pending = result;
+        pendingTarget = row + i;
+    }
+    if (pendingTarget)
+        SIMD::Store(pendingTarget, pending);
+
+    for (; i < width - 1; i++)
+    {
+        if (((i + j + color) & 1) == 0)
+            row[i] = (row0[i] + a * ((row[i + 1] + row[i - 1]) + (row[i + width] + row[i - width]))) * cRecip;
     }
 }
 
@@ -136,114 +201,646 @@ void NavierStokesFluid::SetBound(int b, float* x)
 {
     ST_PROFILE_FUNCTION();
 
-    for (int i = 1; i < m_Width - 1; i++) {
-        x[IX(i, 0           )] = b == 2 ? -x[IX(i, 1           )] : x[IX(i, 1           )];
-        x[IX(i, m_Height - 1)] = b == 2 ? -x[IX(i, m_Height - 2)] : x[IX(i, m_Height - 2)];
+    SetBound(b, x, m_Width, m_Height);
+}
+
+void NavierStokesFluid::SetBound(int b, float* x, int width, int height)
+{
+    auto Index = [width](int i, int j) { return i + j * width; };
+
+    for (int i = 1; i < width - 1; i++) {
+        x[Index(i, 0         )] = b == 2 ? -x[Index(i, 1         )] : x[Index(i, 1         )];
+        x[Index(i, height - 1)] = b == 2 ? -x[Index(i, height - 2)] : x[Index(i, height - 2)];
     }
 
-    for (int j = 1; j < m_Height - 1; j++) {
-        x[IX(0, j          )] = b == 1 ? -x[IX(1, j          )] : x[IX(1, j         )];
-        x[IX(m_Width - 1, j)] = b == 1 ? -x[IX(m_Width - 2, j)] : x[IX(m_Width - 2, j)];
+    for (int j = 1; j < height - 1; j++) {
+        x[Index(0, j        )] = b == 1 ? -x[Index(1, j        )] : x[Index(1, j        )];
+        x[Index(width - 1, j)] = b == 1 ? -x[Index(width - 2, j)] : x[Index(width - 2, j)];
     }
 
-    x[IX(0, 0)] = 0.5 * (x[IX(1, 0)]
-                       + x[IX(0, 1)]);
+    x[Index(0, 0)] = 0.5 * (x[Index(1, 0)]
+                       + x[Index(0, 1)]);
 
-    x[IX(0, m_Height - 1)] = 0.5 * (x[IX(1, m_Height - 1)]
-                                  + x[IX(0, m_Height - 2)]);
+    x[Index(0, height - 1)] = 0.5 * (x[Index(1, height - 1)]
+                                + x[Index(0, height - 2)]);
 
-    x[IX(m_Width - 1, 0)] = 0.5 * (x[IX(m_Width - 2, 0)]
-                                 + x[IX(m_Width - 1, 1)]);
+    x[Index(width - 1, 0)] = 0.5 * (x[Index(width - 2, 0)]
+                               + x[Index(width - 1, 1)]);
 
-    x[IX(m_Width - 1, m_Height - 1)] = 0.5 * (x[IX(m_Width - 2, m_Height - 1)] +
-                                              x[IX(m_Width - 1, m_Height - 2)]);
+    x[Index(width - 1, height - 1)] = 0.5 * (x[Index(width - 2, height - 1)] +
+                                          x[Index(width - 1, height - 2)]);
 }
 
 void NavierStokesFluid::Project(float* velocX, float* velocY, float* p, float* div)
 {
     ST_PROFILE_FUNCTION();
 
+    float size = (m_Width + m_Height) / 2.0f;
     for (int j = 1; j < m_Height - 1; j++) {
-        for (int i = 1; i < m_Width - 1; i++) {
-            div[IX(i, j)] = -0.5f * (
-                velocX[IX(i + 1, j)]
-                - velocX[IX(i - 1, j)]
-                + velocY[IX(i, j + 1)]
-                - velocY[IX(i, j - 1)]
-                ) / ((m_Width + m_Height) / 2.0f);
-            p[IX(i, j)] = 0;
+        int row = Index(0, j);
+        for (int i = row + 1; i < row + m_Width - 1; i++) {
+            div[i] = -0.5f * (
+                velocX[i + 1]
+                - velocX[i - 1]
+                + velocY[i + m_Width]
+                - velocY[i - m_Width]
+                ) / size;
+            p[i] = 0;
         }
     }
     SetBound(0, div);
     SetBound(0, p);
-    LinearSolve(0, p, div, 1, 6);
+
+    // The iterative solvers solve the Poisson equation itself. The Gauss-Seidel sweeps keep the 6 on the diagonal
+    // from Stam's 3D code, which damps the few of them the solve gets
+    if (m_PressureSolver == PressureSolver::GaussSeidel)
+    {
+        LinearSolve(0, p, div, 1, 6);
+        m_SolverStats.PressureIterations += m_Iterations;
+    }
+    else
+    {
+        // Each of the projections of a Step starts from the pressure it ended with in the previous one
+        std::vector<float>& pressure = m_Pressure[m_Projection++ % 2];
+        memcpy(p, pressure.data(), m_Width * m_Height * sizeof(float));
+
+        double divSquares = RemoveMean(div);
+        float residual = 0.0f;
+        if (m_PressureSolver == PressureSolver::Multigrid)
+            m_SolverStats.PressureIterations += SolvePressureMultigrid(p, div, divSquares, residual);
+        else
+            m_SolverStats.PressureIterations += SolveConjugateGradient(0, p, div, 1, 4, divSquares, true, residual);
+        m_SolverStats.PressureResidual = residual;
+        if (residual > m_PressureTolerance)
+            m_SolverStats.PressureConverged = false;
+
+        memcpy(pressure.data(), p, m_Width * m_Height * sizeof(float));
+    }
 
     for (int j = 1; j < m_Height - 1; j++) {
-        for (int i = 1; i < m_Width - 1; i++) {
-            velocX[IX(i, j)] -= 0.5f * (p[IX(i + 1, j)]
-                - p[IX(i - 1, j)]) * m_Width;
-            velocY[IX(i, j)] -= 0.5f * (p[IX(i, j + 1)]
-                - p[IX(i, j - 1)]) * m_Height;
+        int row = Index(0, j);
+        for (int i = row + 1; i < row + m_Width - 1; i++) {
+            velocX[i] -= 0.5f * (p[i + 1]
+                - p[i - 1]) * m_Width;
+            velocY[i] -= 0.5f * (p[i + m_Width]
+                - p[i - m_Width]) * m_Height;
         }
     }
     SetBound(1, velocX);
     SetBound(2, velocY);
 }
 
+// Weights of the fine cells 2i - 2 to 2i + 1 in coarse cell i, for every coarse cell. They transpose the bilinear
+// interpolation along one axis, so restricting after interpolating is symmetric. Fine cells that interpolate from
+// the coarse border count towards the coarse cell it copies, and the ones past the fine cells get no weight
+static std::vector<float> GetRestrictionWeights(int fineCells, int coarseCells)
+{
+    std::vector<float> weights(4 * (coarseCells + 2), 0.0f);
+    for (int i = 1; i <= coarseCells; i++)
+    {
+        float* cell = &weights[4 * i];
+        cell[0] = i > 1 ? 0.25f : 0.0f;
+        cell[1] = i == 1 ? 1.0f : 0.75f;
+        if (2 * i <= fineCells)
+            cell[2] = i == coarseCells ? 1.0f : 0.75f;
+        if (2 * i + 1 <= fineCells)
+            cell[3] = 0.25f;
+    }
+    return weights;
+}
+
+void NavierStokesFluid::AllocateSolverBuffers()
+{
+    int c = m_Width * m_Height;
+    m_RowSums.assign(m_Height, 0.0);
+    m_ConjugateGradient.Residual.assign(c, 0.0f);
+    m_ConjugateGradient.Preconditioned.assign(c, 0.0f);
+    m_ConjugateGradient.Direction.assign(c, 0.0f);
+    m_ConjugateGradient.Product.assign(c, 0.0f);
+    m_Pressure[0].assign(c, 0.0f);
+    m_Pressure[1].assign(c, 0.0f);
+
+    m_Levels.clear();
+
+    // Halves the cells inside the border until a side gets too short to be worth another level
+    int width = m_Width, height = m_Height;
+    while (true)
+    {
+        MultigridLevel level;
+        level.Width = width;
+        level.Height = height;
+        level.Residual.resize(width * height, 0.0f);
+        if (!m_Levels.empty())
+        {
+            level.Error.resize(width * height, 0.0f);
+            level.Rhs.resize(width * height, 0.0f);
+            level.RestrictX = GetRestrictionWeights(m_Levels.back().Width - 2, width - 2);
+            level.RestrictY = GetRestrictionWeights(m_Levels.back().Height - 2, height - 2);
+        }
+        m_Levels.push_back(std::move(level));
+
+        if (std::min(width, height) - 2 < 8)
+            break;
+        width = (width - 1) / 2 + 2;
+        height = (height - 1) / 2 + 2;
+    }
+}
+
+int NavierStokesFluid::SolvePressureMultigrid(float* p, const float* div, double divSquares, float& residual)
+{
+    ST_PROFILE_FUNCTION();
+
+    residual = 0.0f;
+    if (divSquares == 0.0)
+        return 0;
+
+    int cycles = 0;
+    while (cycles < m_MaxCycles)
+    {
+        VCycle(0, p, div);
+        cycles++;
+
+        double squares = ComputeResidual(p, div, m_Levels[0].Residual.data(), m_Width, m_Height);
+        residual = (float)std::sqrt(squares / divSquares);
+        if (residual <= m_PressureTolerance)
+            break;
+    }
+    return cycles;
+}
+
+int NavierStokesFluid::SolveConjugateGradient(int b, float* x, const float* x0, float a, float c, double rhsSquares, bool multigrid,
+    float& residual)
+{
+    ST_PROFILE_FUNCTION();
+
+    float* r = m_ConjugateGradient.Residual.data();
+    float* z = m_ConjugateGradient.Preconditioned.data();
+    float* d = m_ConjugateGradient.Direction.data();
+    float* q = m_ConjugateGradient.Product.data();
+    int grainSize = std::max(4096 / m_Width, 1);
+
+    residual = 0.0f;
+    if (rhsSquares == 0.0)
+        return 0;
+
+    SetBound(b, x);
+    ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+    {
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            double squares = 0.0;
+            for (int i = Index(1, j); i < Index(m_Width - 1, j); i++)
+            {
+                r[i] = x0[i] - (c * x[i] - a * ((x[i + 1] + x[i - 1]) + (x[i + m_Width] + x[i - m_Width])));
+                squares += r[i] * r[i];
+            }
+            m_RowSums[j] = squares;
+        }
+    });
+
+    residual = (float)std::sqrt(SumRows(m_Height) / rhsSquares);
+    if (residual <= m_PressureTolerance)
+        return 0;
+
+    double rz = Precondition(a, c, multigrid);
+    memcpy(d, z, m_Width * m_Height * sizeof(float));
+
+    int iterations = 0;
+    while (iterations < m_MaxConjugateGradientIterations)
+    {
+        iterations++;
+
+        // The dot products are summed per row in SIMD lanes, the rows are short enough for floats
+        SetBound(b, d);
+        ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+        {
+            SIMD::Float vc = SIMD::Set(c), va = SIMD::Set(a);
+            for (int j = begin + 1; j < end + 1; j++)
+            {
+                SIMD::Float dq = SIMD::Zero();
+                int i = Index(1, j);
+                for (; i + SIMD::Width <= Index(m_Width - 1, j); i += SIMD::Width)
+                {
+                    SIMD::Float neighbours = SIMD::Add(SIMD::Add(SIMD::Load(d + i + 1), SIMD::Load(d + i - 1)),
+                        SIMD::Add(SIMD::Load(d + i + m_Width), SIMD::Load(d + i - m_Width)));
+                    SIMD::Float center = SIMD::Load(d + i);
+                    SIMD::Float product = SIMD::Sub(SIMD::Mul(vc, center), SIMD::Mul(va, neighbours));
+                    SIMD::Store(q + i, product);
+                    dq = SIMD::Add(dq, SIMD::Mul(center, product));
+                }
+
+                double sum = SIMD::ReduceAdd(dq);
+                for (; i < Index(m_Width - 1, j); i++)
+                {
+                    q[i] = c * d[i] - a * ((d[i + 1] + d[i - 1]) + (d[i + m_Width] + d[i - m_Width]));
+                    sum += d[i] * q[i];
+                }
+                m_RowSums[j] = sum;
+            }
+        });
+
+        double dq = SumRows(m_Height);
+        if (dq <= 0.0)
+            break;
+        float alpha = (float)(rz / dq);
+
+        ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+        {
+            SIMD::Float valpha = SIMD::Set(alpha);
+            for (int j = begin + 1; j < end + 1; j++)
+            {
+                SIMD::Float squares = SIMD::Zero();
+                int i = Index(1, j);
+                for (; i + SIMD::Width <= Index(m_Width - 1, j); i += SIMD::Width)
+                {
+                    SIMD::Store(x + i, SIMD::Add(SIMD::Load(x + i), SIMD::Mul(valpha, SIMD::Load(d + i))));
+                    SIMD::Float residualValue = SIMD::Sub(SIMD::Load(r + i), SIMD::Mul(valpha, SIMD::Load(q + i)));
+                    SIMD::Store(r + i, residualValue);
+                    squares = SIMD::Add(squares, SIMD::Mul(residualValue, residualValue));
+                }
+
+                double sum = SIMD::ReduceAdd(squares);
+                for (; i < Index(m_Width - 1, j); i++)
+                {
+                    x[i] += alpha * d[i];
+                    r[i] -= alpha * q[i];
+                    sum += r[i] * r[i];
+                }
+                m_RowSums[j] = sum;
+            }
+        });
+
+        residual = (float)std::sqrt(SumRows(m_Height) / rhsSquares);
+        if (residual <= m_PressureTolerance)
+            break;
+
+        double previousRz = rz;
+        rz = Precondition(a, c, multigrid);
+        float beta = (float)(rz / previousRz);
+
+        ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+        {
+            for (int j = begin + 1; j < end + 1; j++)
+            {
+                for (int i = Index(1, j); i < Index(m_Width - 1, j); i++)
+                    d[i] = z[i] + beta * d[i];
+            }
+        });
+    }
+    SetBound(b, x);
+    return iterations;
+}
+
+double NavierStokesFluid::Precondition(float a, float c, bool multigrid)
+{
+    const float* r = m_ConjugateGradient.Residual.data();
+    float* z = m_ConjugateGradient.Preconditioned.data();
+    int grainSize = std::max(4096 / m_Width, 1);
+
+    // One V-cycle from zero approximately inverts the pressure matrix at every scale, which leaves the conjugate
+    // gradient only a few iterations. The cycle is symmetric, so it is a valid preconditioner
+    if (multigrid)
+    {
+        std::fill(m_ConjugateGradient.Preconditioned.begin(), m_ConjugateGradient.Preconditioned.end(), 0.0f);
+        VCycle(0, z, r);
+
+        // The cycle fills the border of z, which the incomplete Cholesky of the diffusion needs to be zero
+        std::fill(z, z + m_Width, 0.0f);
+        std::fill(z + Index(0, m_Height - 1), z + m_Width * m_Height, 0.0f);
+        for (int j = 1; j < m_Height - 1; j++)
+            z[Index(0, j)] = z[Index(m_Width - 1, j)] = 0.0f;
+
+        ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+        {
+            for (int j = begin + 1; j < end + 1; j++)
+            {
+                SIMD::Float rz = SIMD::Zero();
+                int i = Index(1, j);
+                for (; i + SIMD::Width <= Index(m_Width - 1, j); i += SIMD::Width)
+                    rz = SIMD::Add(rz, SIMD::Mul(SIMD::Load(r + i), SIMD::Load(z + i)));
+
+                double sum = SIMD::ReduceAdd(rz);
+                for (; i < Index(m_Width - 1, j); i++)
+                    sum += r[i] * z[i];
+                m_RowSums[j] = sum;
+            }
+        });
+        return SumRows(m_Height);
+    }
+
+    // Incomplete Cholesky of the matrix in red-black order, where the cells of one colour only couple to the
+    // other colour. That leaves only a diagonal to factor for the black cells, and both triangular solves
+    // become a parallel pass over one colour. The walls are left out of the factored matrix, it only
+    // needs to be close to the real one
+    float cRecip = 1.0f / c;
+    float blackRecip = 1.0f / (c - 4.0f * a * a * cRecip);
+
+    // Whole rows, the red cells are replaced by the second pass. The border of r and z stays zero, so the
+    // cells next to it see no neighbour there
+    ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+    {
+        SIMD::Float coupling = SIMD::Set(a * cRecip), diagonalRecip = SIMD::Set(blackRecip);
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            int i = Index(1, j);
+            for (; i + SIMD::Width <= Index(m_Width - 1, j); i += SIMD::Width)
+            {
+                SIMD::Float neighbours = SIMD::Add(SIMD::Add(SIMD::Load(r + i + 1), SIMD::Load(r + i - 1)),
+                    SIMD::Add(SIMD::Load(r + i + m_Width), SIMD::Load(r + i - m_Width)));
+                SIMD::Store(z + i, SIMD::Mul(SIMD::Add(SIMD::Load(r + i), SIMD::Mul(coupling, neighbours)), diagonalRecip));
+            }
+
+            for (; i < Index(m_Width - 1, j); i++)
+                z[i] = (r[i] + a * cRecip * ((r[i + 1] + r[i - 1]) + (r[i + m_Width] + r[i - m_Width]))) * blackRecip;
+        }
+    });
+
+    // The red cells are a Gauss-Seidel update of z with r on the right hand side, in the row order of
+    // RedBlackGaussSeidel. Once a row is done its part of the dot product can be summed
+    for (int parity = 0; parity < 2; parity++)
+    {
+        ParallelFor((m_Height - 2 - parity + 1) / 2, grainSize, [&](int begin, int end)
+        {
+            for (int k = begin; k < end; k++)
+            {
+                int j = 1 + parity + 2 * k;
+                RelaxRow(z, r, m_Width, a, cRecip, j, 0);
+
+                SIMD::Float rz = SIMD::Zero();
+                int i = Index(1, j);
+                for (; i + SIMD::Width <= Index(m_Width - 1, j); i += SIMD::Width)
+                    rz = SIMD::Add(rz, SIMD::Mul(SIMD::Load(r + i), SIMD::Load(z + i)));
+
+                double sum = SIMD::ReduceAdd(rz);
+                for (; i < Index(m_Width - 1, j); i++)
+                    sum += r[i] * z[i];
+                m_RowSums[j] = sum;
+            }
+        });
+    }
+    return SumRows(m_Height);
+}
+
+double NavierStokesFluid::RemoveMean(float* values)
+{
+    // With only walls around it, the divergence has to sum to zero for the equation to have a solution
+    int grainSize = std::max(4096 / m_Width, 1);
+    ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+    {
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            double sum = 0.0;
+            for (int i = Index(1, j); i < Index(m_Width - 1, j); i++)
+                sum += values[i];
+            m_RowSums[j] = sum;
+        }
+    });
+    float mean = (float)(SumRows(m_Height) / ((double)(m_Width - 2) * (m_Height - 2)));
+
+    ParallelFor(m_Height - 2, grainSize, [&](int begin, int end)
+    {
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            double squares = 0.0;
+            for (int i = Index(1, j); i < Index(m_Width - 1, j); i++)
+            {
+                values[i] -= mean;
+                squares += values[i] * values[i];
+            }
+            m_RowSums[j] = squares;
+        }
+    });
+    return SumRows(m_Height);
+}
+
+double NavierStokesFluid::SumSquares(const float* values)
+{
+    ParallelFor(m_Height - 2, std::max(4096 / m_Width, 1), [&](int begin, int end)
+    {
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            double squares = 0.0;
+            for (int i = Index(1, j); i < Index(m_Width - 1, j); i++)
+                squares += values[i] * values[i];
+            m_RowSums[j] = squares;
+        }
+    });
+    return SumRows(m_Height);
+}
+
+double NavierStokesFluid::SumRows(int height) const
+{
+    double sum = 0.0;
+    for (int j = 1; j < height - 1; j++)
+        sum += m_RowSums[j];
+    return sum;
+}
+
+void NavierStokesFluid::VCycle(int level, float* x, const float* rhs)
+{
+    const int smoothingSweeps = 2;
+
+    MultigridLevel& fine = m_Levels[level];
+    int width = fine.Width, height = fine.Height;
+    if (level + 1 == (int)m_Levels.size())
+    {
+        // Few enough cells to just sweep until the error is gone, forwards and then backwards to stay symmetric
+        RedBlackGaussSeidel(0, x, rhs, width, height, 1, 4, width + height);
+        RedBlackGaussSeidel(0, x, rhs, width, height, 1, 4, width + height, true);
+        return;
+    }
+
+    RedBlackGaussSeidel(0, x, rhs, width, height, 1, 4, smoothingSweeps);
+    ComputeResidual(x, rhs, fine.Residual.data(), width, height);
+
+    // The weights sum to 4 for every coarse cell, which scales the residual for the 4 times larger squared spacing
+    MultigridLevel& coarse = m_Levels[level + 1];
+    int coarseWidth = coarse.Width, coarseHeight = coarse.Height;
+    std::fill(coarse.Error.begin(), coarse.Error.end(), 0.0f);
+    ParallelFor(coarseHeight - 2, std::max(4096 / coarseWidth, 1), [&](int begin, int end)
+    {
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            const float* weightsY = &coarse.RestrictY[4 * j];
+            const float* rows[4];
+            for (int k = 0; k < 4; k++)
+                rows[k] = fine.Residual.data() + std::min(2 * j - 2 + k, height - 1) * width;
+
+            float* coarseRhs = coarse.Rhs.data() + j * coarseWidth;
+            for (int i = 1; i < coarseWidth - 1; i++)
+            {
+                const float* weightsX = &coarse.RestrictX[4 * i];
+                int columns[4] = { 2 * i - 2, 2 * i - 1, 2 * i, std::min(2 * i + 1, width - 1) };
+
+                float sum = 0.0f;
+                for (int k = 0; k < 4; k++)
+                {
+                    const float* row = rows[k];
+                    sum += weightsY[k] * (weightsX[0] * row[columns[0]] + weightsX[1] * row[columns[1]] +
+                        weightsX[2] * row[columns[2]] + weightsX[3] * row[columns[3]]);
+                }
+                coarseRhs[i] = sum;
+            }
+        }
+    });
+
+    VCycle(level + 1, coarse.Error.data(), coarse.Rhs.data());
+
+    // Bilinear interpolation of the coarse error, weighted towards the coarse cell covering the fine one. Both fine
+    // cells of a coarse one are done together, the second one is in the border past an odd side and gets replaced
+    ParallelFor(height - 2, std::max(4096 / width, 1), [&](int begin, int end)
+    {
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            const float* nearRow = coarse.Error.data() + (j + 1) / 2 * coarseWidth;
+            const float* farRow = nearRow + (j & 1 ? -coarseWidth : coarseWidth);
+            float* row = x + j * width;
+            for (int i = 1; i < coarseWidth - 1; i++)
+            {
+                float center = 9.0f * nearRow[i] + 3.0f * farRow[i];
+                row[2 * i - 1] += (center + 3.0f * nearRow[i - 1] + farRow[i - 1]) * (1.0f / 16.0f);
+                row[2 * i] += (center + 3.0f * nearRow[i + 1] + farRow[i + 1]) * (1.0f / 16.0f);
+            }
+        }
+    });
+    SetBound(0, x, width, height);
+
+    // The colours in the opposite order of the first sweeps, which makes the cycle a symmetric operator that
+    // can precondition the conjugate gradient
+    RedBlackGaussSeidel(0, x, rhs, width, height, 1, 4, smoothingSweeps, true);
+}
+
+double NavierStokesFluid::ComputeResidual(const float* x, const float* rhs, float* residual, int width, int height)
+{
+    ParallelFor(height - 2, std::max(4096 / width, 1), [&](int begin, int end)
+    {
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            double squares = 0.0;
+            for (int i = j * width + 1; i < (j + 1) * width - 1; i++)
+            {
+                float r = rhs[i] - (4.0f * x[i] - ((x[i + 1] + x[i - 1]) + (x[i + width] + x[i - width])));
+                residual[i] = r;
+                squares += r * r;
+            }
+            m_RowSums[j] = squares;
+        }
+    });
+
+    double squares = 0.0;
+    for (int j = 1; j < height - 1; j++)
+        squares += m_RowSums[j];
+    return squares;
+}
+
 void NavierStokesFluid::Advect(int b, float* d, float* d0, float* velocX, float* velocY, float dt)
 {
     ST_PROFILE_FUNCTION();
 
-    float i0, i1, j0, j1;
+    AdvectFields(1, &d, &d0, velocX, velocY, dt);
+    SetBound(b, d);
+}
 
+void NavierStokesFluid::AdvectVelocityAndDensity(float dt)
+{
+    ST_PROFILE_FUNCTION();
+
+    float* fields[] = { m_VelocityX, m_VelocityY, m_Density };
+    float* previousFields[] = { m_PreviousVelocityX, m_PreviousVelocityY, m_PreviousDensity };
+    AdvectFields(3, fields, previousFields, m_PreviousVelocityX, m_PreviousVelocityY, dt);
+
+    SetBound(1, m_VelocityX);
+    SetBound(2, m_VelocityY);
+    SetBound(0, m_Density);
+}
+
+// Lane offsets within a vector
+alignas(32) static const float s_Lanes[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+void NavierStokesFluid::AdvectFields(int count, float* const* d, const float* const* d0, const float* velocX, const float* velocY, float dt)
+{
     float dtx = dt * (m_Width - 2);
     float dty = dt * (m_Height - 2);
 
-    float s0, s1, t0, t1;
-    float tmp1, tmp2, x, y;
-
-    float ifloat, jfloat;
-    int i, j;
-
-    for (j = 1, jfloat = 1; j < m_Height - 1; j++, jfloat++) {
-        for (i = 1, ifloat = 1; i < m_Width - 1; i++, ifloat++) {
-            tmp1 = dtx * velocX[IX(i, j)];
-            tmp2 = dty * velocY[IX(i, j)];
-            x = ifloat - tmp1;
-            y = jfloat - tmp2;
-
-            if (x < 0.5f) x = 0.5f;
-            if (x > m_Width + 0.5f) x = m_Width + 0.5f;
-            i0 = std::floor(x);
-            i1 = i0 + 1.0f;
-            if (y < 0.5f) y = 0.5f;
-            if (y > m_Height + 0.5f) y = m_Height + 0.5f;
-            j0 = std::floor(y);
-            j1 = j0 + 1.0f;
-
-            s1 = x - i0;
-            s0 = 1.0f - s1;
-            t1 = y - j0;
-            t0 = 1.0f - t1;
-
-            int i0i = i0;
-            int i1i = i1;
-            int j0i = j0;
-            int j1i = j1;
-
-            d[IX(i, j)] =
-                s0 * (t0 * d0[IX(i0i, j0i)] + t1 * d0[IX(i0i, j1i)]) +
-                s1 * (t0 * d0[IX(i1i, j0i)] + t1 * d0[IX(i1i, j1i)]);
+    ParallelFor(m_Height - 2, std::max(4096 / m_Width, 1), [&](int begin, int end)
+    {
+        SIMD::Float lanes = SIMD::Load(s_Lanes);
+        SIMD::Float vdtx = SIMD::Set(dtx), vdty = SIMD::Set(dty);
+        SIMD::Float low = SIMD::Set(0.5f), highX = SIMD::Set(m_Width - 1.5f), highY = SIMD::Set(m_Height - 1.5f);
+        SIMD::Float width = SIMD::Set((float)m_Width), one = SIMD::Set(1.0f);
+
+        for (int j = begin + 1; j < end + 1; j++)
+        {
+            // The backtrace, its bilinear weights and the cell it lands in are shared by all the fields,
+            // which are gathered from the four cells around it
+            int i = 1;
+            for (; i + SIMD::Width <= m_Width - 1; i += SIMD::Width)
+            {
+                int k = Index(i, j);
+                SIMD::Float x = SIMD::Sub(SIMD::Add(SIMD::Set((float)i), lanes), SIMD::Mul(vdtx, SIMD::Load(velocX + k)));
+                SIMD::Float y = SIMD::Sub(SIMD::Set((float)j), SIMD::Mul(vdty, SIMD::Load(velocY + k)));
+
+                // Halfway into the ghost border at most, so all four samples stay inside the grid. That also
+                // keeps the coordinates positive, where rounding towards zero floors them
+                x = SIMD::Min(SIMD::Max(x, low), highX);
+                y = SIMD::Min(SIMD::Max(y, low), highY);
+                SIMD::Float i0 = SIMD::ToFloat(SIMD::ToIndex(x));
+                SIMD::Float j0 = SIMD::ToFloat(SIMD::ToIndex(y));
+
+                SIMD::Float s1 = SIMD::Sub(x, i0);
+                SIMD::Float s0 = SIMD::Sub(one, s1);
+                SIMD::Float t1 = SIMD::Sub(y, j0);
+                SIMD::Float t0 = SIMD::Sub(one, t1);
+                SIMD::Index cell = SIMD::ToIndex(SIMD::Add(i0, SIMD::Mul(j0, width)));
+
+                for (int field = 0; field < count; field++)
+                {
+                    const float* source = d0[field];
+                    SIMD::Float d00 = SIMD::Gather(source, cell);
+                    SIMD::Float d01 = SIMD::Gather(source + m_Width, cell);
+                    SIMD::Float d10 = SIMD::Gather(source + 1, cell);
+                    SIMD::Float d11 = SIMD::Gather(source + m_Width + 1, cell);
+
+                    SIMD::Store(d[field] + k, SIMD::Add(
+                        SIMD::Mul(s0, SIMD::Add(SIMD::Mul(t0, d00), SIMD::Mul(t1, d01))),
+                        SIMD::Mul(s1, SIMD::Add(SIMD::Mul(t0, d10), SIMD::Mul(t1, d11)))));
+                }
+            }
+
+            for (; i < m_Width - 1; i++)
+            {
+                int k = Index(i, j);
+                float x = std::clamp(i - dtx * velocX[k], 0.5f, m_Width - 1.5f);
+                float y = std::clamp(j - dty * velocY[k], 0.5f, m_Height - 1.5f);
+                float i0 = std::floor(x);
+                float j0 = std::floor(y);
+
+                float s1 = x - i0;
+                float s0 = 1.0f - s1;
+                float t1 = y - j0;
+                float t0 = 1.0f - t1;
+                int cell = Index((int)i0, (int)j0);
+
+                for (int field = 0; field < count; field++)
+                {
+                    const float* source = d0[field];
+                    d[field][k] =
+                        s0 * (t0 * source[cell] + t1 * source[cell + m_Width]) +
+                        s1 * (t0 * source[cell + 1] + t1 * source[cell + m_Width + 1]);
+                }
+            }
         }
-    }
-    SetBound(b, d);
+    });
 }
 
 void NavierStokesFluid::Step(float dt)
 {
+    m_SolverStats = {};
+    m_Projection = 0;
+
     //for (int y = 0; y < m_Height; y++)
     //{
-    //    int index = IX(5, y);
+    //    int index = Index(5, y);
     //    m_VelocityX[index] += 1.0f;
     //}
 
@@ -252,15 +849,14 @@ void NavierStokesFluid::Step(float dt)
 
     Project(m_PreviousVelocityX, m_PreviousVelocityY, m_VelocityX, m_VelocityY);
 
-    Advect(1, m_VelocityX, m_PreviousVelocityX, m_PreviousVelocityX, m_PreviousVelocityY, dt);
-    Advect(2, m_VelocityY, m_PreviousVelocityY, m_PreviousVelocityX, m_PreviousVelocityY, dt);
+    // The density is moved by the same velocities as the velocities themselves, so one pass reads them for all three
+    Diffuse(0, m_PreviousDensity, m_Density, m_Diffusion, dt);
+    AdvectVelocityAndDensity(dt);
 
     Project(m_VelocityX, m_VelocityY, m_PreviousVelocityX, m_PreviousVelocityY);
-
-    Diffuse(0, m_PreviousDensity, m_Density, m_Diffusion, dt);
-    Advect(0, m_Density, m_PreviousDensity, m_VelocityX, m_VelocityY, dt);
 }
 
+#ifndef FLUID_HEADLESS
 void NavierStokesFluid::Render()
 {
     for (int i = 0; i < m_Width; i++)
@@ -269,11 +865,20 @@ void NavierStokesFluid::Render()
         {
             float x = (i - m_Width / 2.0f) * m_Scale;
             float y = (j - m_Height / 2.0f) * m_Scale;
-            float d = m_Density[IX(i, j)];
-            float vx = std::abs(m_VelocityX[IX(i, j)]);
-            float vy = std::abs(m_VelocityY[IX(i, j)]);
+            float d = m_Density[Index(i, j)];
+            float vx = std::abs(m_VelocityX[Index(i, j)]);
+            float vy = std::abs(m_VelocityY[Index(i, j)]);
             float avg = (vx + vy) / 2.0f;
             Sten::Renderer2D::DrawQuad({ x, y }, { m_Scale, m_Scale }, {avg / 3.0f + 0.2f, avg / 2.0f + 0.3f, 0.8f, 1.0f});
         }
     }
 }
+#endif
+
+void NavierStokesFluid::ParallelFor(int count, int grainSize, RangeFunction func)
+{
+    if (m_Multithreaded)
+        ThreadPool::Get().ParallelFor(count, func, grainSize);
+    else
+        func(0, count);
+}
@@ -1,7 +1,33 @@
 #pragma once
 
-#include <Stengine.h>
+#include "Simulation.h"
+#include "ThreadPool.h"
 
+#include <vector>
+
+enum class PressureSolver
+{
+    GaussSeidel,        // m_Iterations sweeps, cheap but leaves most of the divergence of large grids
+    Multigrid,          // V-cycles until the residual of the Poisson equation is below the tolerance
+    ConjugateGradient   // Preconditioned conjugate gradient to the tolerance, for the diffusion as well
+};
+
+// Linear solves of the last Step, which diffuses and projects the velocities twice. The residuals are the RMS
+// residuals the last solves ended with relative to the RMS of their right hand sides, only the iterative
+// solvers compute them. A solve that runs out of iterations above the tolerance clears its converged flag
+struct SolverStats
+{
+    int PressureIterations = 0;     // Sweeps, V-cycles or conjugate gradient iterations
+    float PressureResidual = 0.0f;
+    bool PressureConverged = true;
+    int DiffusionIterations = 0;
+    float DiffusionResidual = 0.0f;
+    bool DiffusionConverged = true;
+};
+
+// Stam's stable fluids on a grid of m_Width x m_Height cells. The outermost ring of cells is a ghost border that
+// SetBound fills from the cells next to it, so the stencils of the interior cells never leave the grid and index
+// it without any clamping. Only the splats, which can reach past the grid, clamp their cells.
 class NavierStokesFluid
 {
 public:
@@ -16,22 +42,94 @@ public:
     void Diffuse(int b, float* x, float* x0, float diff, float dt);
     void Project(float* velocX, float* velocY, float* p, float* div);
     void Advect(int b, float* d, float* d0, float* velocX, float* velocY, float dt);
+    // Advects the velocities and the density through the previous velocities in one pass
+    void AdvectVelocityAndDensity(float dt);
 
     void Step(float dt);
+#ifndef FLUID_HEADLESS
     void Render();
+#endif
 
     void LinearSolve(int b, float* x, float* x0, float a, float c);
     void SetBound(int b, float* x);
 
+    void SetMultithreaded(bool multithreaded) { m_Multithreaded = multithreaded; }
+    void SetPressureSolver(PressureSolver solver) { m_PressureSolver = solver; }
+    PressureSolver GetPressureSolver() const { return m_PressureSolver; }
+    void SetPressureTolerance(float tolerance) { m_PressureTolerance = tolerance; }
+    const SolverStats& GetSolverStats() const { return m_SolverStats; }
+
     int GetWidth() const { return m_Width; }
     int GetHeight() const { return m_Height; }
     int GetScale() const { return m_Scale; }
+private:
+    // A level of the multigrid hierarchy, with half the cells of the one above it along both axes and its own ghost border
+    struct MultigridLevel
+    {
+        int Width = 0, Height = 0;
+        std::vector<float> Error;
+        std::vector<float> Rhs;
+        std::vector<float> Residual;
+        std::vector<float> RestrictX;   // See GetRestrictionWeights, not used by the grid itself
+        std::vector<float> RestrictY;
+    };
+
+    struct ConjugateGradientBuffers
+    {
+        std::vector<float> Residual;
+        std::vector<float> Preconditioned;
+        std::vector<float> Direction;
+        std::vector<float> Product;     // The matrix times the direction
+    };
+
+    void SetBound(int b, float* x, int width, int height);
+    void RedBlackGaussSeidel(int b, float* x, const float* x0, int width, int height, float a, float c, int iterations, bool blackFirst = false);
+    // One Gauss-Seidel update of the cells of the colour in row j, red cells have an even i + j
+    void RelaxRow(float* x, const float* x0, int width, float a, float cRecip, int j, int color);
+
+    void AllocateSolverBuffers();
+    // Solves 4 p - (sum of the neighbours of p) = div, returns the V-cycles it took
+    int SolvePressureMultigrid(float* p, const float* div, double divSquares, float& residual);
+    void VCycle(int level, float* x, const float* rhs);
+    // Stores rhs - A x, returns the sum of the squared residuals
+    double ComputeResidual(const float* x, const float* rhs, float* residual, int width, int height);
+
+    // Solves the same system as LinearSolve starting from x, returns the iterations it took
+    int SolveConjugateGradient(int b, float* x, const float* x0, float a, float c, double rhsSquares, bool multigrid,
+        float& residual);
+    // Applies the preconditioner to the residual, returns the residual dotted with the result
+    double Precondition(float a, float c, bool multigrid);
+
+    // Reductions over the cells inside the border
+    double RemoveMean(float* values);   // Returns the sum of the squares that are left
+    double SumSquares(const float* values);
+    double SumRows(int height) const;
+    // Semi-Lagrangian advection of count fields d0 into d, through the same velocities
+    void AdvectFields(int count, float* const* d, const float* const* d0, const float* velocX, const float* velocY, float dt);
+
+    // Runs func over [0, count), split across the thread pool when multithreading is enabled
+    void ParallelFor(int count, int grainSize, RangeFunction func);
+
+    int Index(int x, int y) const { return x + y * m_Width; }
+    int ClampedIndex(int x, int y) const { return std::clamp(x, 0, m_Width - 1) + std::clamp(y, 0, m_Height - 1) * m_Width; }
 private:
     int m_Width, m_Height;
     int m_Scale;
     int m_Iterations;
     float m_Diffusion;
     float m_Viscosity;
+    bool m_Multithreaded = true;
+
+    PressureSolver m_PressureSolver = PressureSolver::GaussSeidel;
+    float m_PressureTolerance = 1e-3f;
+    int m_MaxCycles = 20;
+    int m_MaxConjugateGradientIterations = 200;
+    SolverStats m_SolverStats;
+    std::vector<MultigridLevel> m_Levels;   // m_Levels[0] is the grid itself, only its Residual is used
+    ConjugateGradientBuffers m_ConjugateGradient;
+    std::vector<float> m_Pressure[2];       // What each projection of the last Step solved for, to start the next one from
+    int m_Projection = 0;
+    std::vector<double> m_RowSums;          // Per row partial sums of the parallel reductions
 
     float* m_PreviousDensity;
     float* m_Density;
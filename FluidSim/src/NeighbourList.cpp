@@ -0,0 +1,181 @@
+#include "NeighbourList.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+static void Run(ThreadPool* threadPool, int count, RangeFunction func)
+{
+	if (threadPool)
+		threadPool->ParallelFor(count, func);
+	else
+		func(0, count);
+}
+
+template<int Dimension>
+template<typename Func>
+int NeighbourList<Dimension>::ForEachCandidate(const SpatialLookup<Dimension>& lookup, const AxisArrays<Dimension>& positions,
+	int particleIndex, float sqrRadius, bool halfList, Func&& func) const
+{
+	glm::vec<Dimension, float> position = LoadPosition<Dimension>(positions, particleIndex);
+	const std::vector<Entry>& entries = lookup.GetEntries();
+
+	unsigned int keys[SpatialLookup<Dimension>::NeighbourhoodSize];
+	int keyCount = lookup.GetNeighbourhoodKeys(lookup.PositionToCellCoord(position), keys);
+
+	int candidateCount = 0;
+	for (int k = 0; k < keyCount; k++)
+	{
+		int cellEnd = lookup.GetCellEnd(keys[k]);
+		candidateCount += cellEnd - lookup.GetCellStart(keys[k]);
+		for (int i = lookup.GetCellStart(keys[k]); i < cellEnd; i++)
+		{
+			int neighbourIndex = entries[i].index;
+			if (halfList && neighbourIndex <= particleIndex)
+				continue;
+
+			float sqrDst = 0.0f;
+			for (int axis = 0; axis < Dimension; axis++)
+			{
+				float offset = positions[axis][neighbourIndex] - position[axis];
+				sqrDst += offset * offset;
+			}
+			if (sqrDst <= sqrRadius)
+				func(neighbourIndex, sqrDst);
+		}
+	}
+
+	return candidateCount;
+}
+
+template<int Dimension>
+void NeighbourList<Dimension>::Build(const SpatialLookup<Dimension>& lookup, const AxisArrays<Dimension>& positions, int count,
+	float radius, float skin, bool halfList, ThreadPool* threadPool, const uint8_t* active, const float* radii)
+{
+	float sqrRadius = (radius + skin) * (radius + skin);
+	m_Offsets.resize(count + 1);
+
+	auto inRange = [&](int particleIndex, int neighbourIndex, float sqrDst)
+	{
+		if (!radii)
+			return true;
+		float pairRadius = (radii[particleIndex] + radii[neighbourIndex]) * 0.5f + skin;
+		return sqrDst <= pairRadius * pairRadius;
+	};
+
+	// Count the neighbours first, so every particle knows where its range starts before it is filled in
+	std::atomic<int64_t> candidateCount = 0;
+	Run(threadPool, count, [&](int begin, int end)
+	{
+		int64_t candidates = 0;
+		for (int i = begin; i < end; i++)
+		{
+			int neighbourCount = 0;
+			if (!active || active[i])
+				candidates += ForEachCandidate(lookup, positions, i, sqrRadius, halfList, [&](int neighbourIndex, float sqrDst)
+				{
+					neighbourCount += inRange(i, neighbourIndex, sqrDst);
+				});
+			m_Offsets[i + 1] = neighbourCount;
+		}
+		candidateCount += candidates;
+	});
+	m_CandidateCount = candidateCount;
+
+	m_Offsets[0] = 0;
+	for (int i = 0; i < count; i++)
+		m_Offsets[i + 1] += m_Offsets[i];
+
+	m_Indices.resize(m_Offsets[count] + Padding, 0);
+	m_Distances.resize(m_Offsets[count] + Padding, 0.0f);
+	// Resizing keeps what a longer list left in the padding, which can be particles that are gone by now
+	std::fill(m_Indices.end() - Padding, m_Indices.end(), 0);
+	std::fill(m_Distances.end() - Padding, m_Distances.end(), 0.0f);
+
+	Run(threadPool, count, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			if (active && !active[i])
+				continue;
+
+			int next = m_Offsets[i];
+			ForEachCandidate(lookup, positions, i, sqrRadius, halfList, [&](int neighbourIndex, float sqrDst)
+			{
+				if (!inRange(i, neighbourIndex, sqrDst))
+					return;
+				m_Indices[next] = neighbourIndex;
+				m_Distances[next] = std::sqrt(sqrDst);
+				next++;
+			});
+		}
+	});
+
+	for (int axis = 0; axis < Dimension; axis++)
+		m_BuildPositions[axis].assign(positions[axis], positions[axis] + count);
+	m_Radius = radius;
+	m_Skin = skin;
+	m_HalfList = halfList;
+	m_Valid = true;
+}
+
+template<int Dimension>
+void NeighbourList<Dimension>::Reserve(int particleCount)
+{
+	m_Offsets.reserve(particleCount + 1);
+	for (int axis = 0; axis < Dimension; axis++)
+		m_BuildPositions[axis].reserve(particleCount);
+}
+
+template<int Dimension>
+bool NeighbourList<Dimension>::NeedsRebuild(const AxisArrays<Dimension>& positions, int count, float radius, float skin,
+	bool halfList, ThreadPool* threadPool) const
+{
+	if (!m_Valid || skin <= 0.0f || count != GetParticleCount() || radius != m_Radius || skin != m_Skin || halfList != m_HalfList)
+		return true;
+
+	// A pair can only have come into range if both particles moved towards each other by half the skin
+	float maxSqrDisplacement = skin * skin / 4.0f;
+	std::atomic<bool> moved = false;
+	Run(threadPool, count, [&](int begin, int end)
+	{
+		for (int i = begin; i < end && !moved.load(std::memory_order_relaxed); i++)
+		{
+			float sqrDisplacement = 0.0f;
+			for (int axis = 0; axis < Dimension; axis++)
+			{
+				float offset = positions[axis][i] - m_BuildPositions[axis][i];
+				sqrDisplacement += offset * offset;
+			}
+			if (sqrDisplacement > maxSqrDisplacement)
+				moved = true;
+		}
+	});
+
+	return moved;
+}
+
+template<int Dimension>
+void NeighbourList<Dimension>::UpdateDistances(const AxisArrays<Dimension>& positions, ThreadPool* threadPool)
+{
+	Run(threadPool, GetParticleCount(), [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			for (int j = m_Offsets[i]; j < m_Offsets[i + 1]; j++)
+			{
+				float sqrDst = 0.0f;
+				for (int axis = 0; axis < Dimension; axis++)
+				{
+					float offset = positions[axis][m_Indices[j]] - positions[axis][i];
+					sqrDst += offset * offset;
+				}
+				m_Distances[j] = std::sqrt(sqrDst);
+			}
+		}
+	});
+}
+
+template class NeighbourList<2>;
+template class NeighbourList<3>;
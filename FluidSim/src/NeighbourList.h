@@ -0,0 +1,63 @@
+#pragma once
+
+#include "SpatialLookup.h"
+
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// Compressed (CSR) list of every particle's neighbours within radius + skin, together with their
+// current distance. The neighbours of particle i are stored in [GetStart(i), GetEnd(i)).
+// As long as no particle has moved more than half the skin since the last build, the list still
+// contains every pair within radius, so only the distances need to be refreshed.
+// A half list only stores the neighbours with a higher index, so every pair appears exactly once.
+template<int Dimension>
+class NeighbourList
+{
+public:
+	// Extra entries past the last neighbour, so that vector loads of a partial batch stay in bounds
+	static constexpr int Padding = 16;
+
+	// The lookup has to be built with a cell size of at least radius + skin. Particles that are zero
+	// in the active mask get no neighbours of their own, but are still neighbours of the others.
+	// With per particle radii a pair is only kept within the average of both radii, which must not exceed radius
+	void Build(const SpatialLookup<Dimension>& lookup, const AxisArrays<Dimension>& positions, int count,
+		float radius, float skin, bool halfList, ThreadPool* threadPool = nullptr, const uint8_t* active = nullptr,
+		const float* radii = nullptr);
+
+	bool NeedsRebuild(const AxisArrays<Dimension>& positions, int count, float radius, float skin,
+		bool halfList, ThreadPool* threadPool = nullptr) const;
+	void UpdateDistances(const AxisArrays<Dimension>& positions, ThreadPool* threadPool = nullptr);
+	void Invalidate() { m_Valid = false; }
+	bool IsValid() const { return m_Valid; }
+	// Allocates the per particle arrays up front, the neighbour arrays still grow with the neighbour count
+	void Reserve(int particleCount);
+
+	int GetStart(int particleIndex) const { return m_Offsets[particleIndex]; }
+	int GetEnd(int particleIndex) const { return m_Offsets[particleIndex + 1]; }
+	const int* GetIndices() const { return m_Indices.data(); }
+	const float* GetDistances() const { return m_Distances.data(); }
+
+	int GetParticleCount() const { return (int)m_Offsets.size() - 1; }
+	int GetNeighbourCount() const { return m_Offsets.empty() ? 0 : m_Offsets.back(); }
+	// Particles that were distance tested during the last build, including the ones from colliding cells
+	int64_t GetCandidateCount() const { return m_CandidateCount; }
+private:
+	// Returns the number of particles that were tested
+	template<typename Func>
+	int ForEachCandidate(const SpatialLookup<Dimension>& lookup, const AxisArrays<Dimension>& positions,
+		int particleIndex, float sqrRadius, bool halfList, Func&& func) const;
+private:
+	std::vector<int> m_Offsets;
+	std::vector<int> m_Indices;
+	std::vector<float> m_Distances;
+
+	// Positions and settings the list was built with
+	std::vector<float> m_BuildPositions[Dimension];
+	float m_Radius = 0.0f;
+	float m_Skin = 0.0f;
+	bool m_HalfList = false;
+	bool m_Valid = false;
+	int64_t m_CandidateCount = 0;
+};
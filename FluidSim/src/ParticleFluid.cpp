@@ -1,386 +1,2131 @@
-#include "stpch.h"
 #include "ParticleFluid.h"
+#include "SIMD.h"
+#include "ThreadPool.h"
 
-#include <Stengine.h>
+#include <atomic>
 #include <cmath>
+#include <functional>
 #include <limits>
+
+#ifndef FLUID_HEADLESS
+#include "SpeedColorMap.h"
+
 #include <glm/gtc/matrix_transform.hpp>
 #include <imgui.h>
+#endif
+
+#define MASS 1.0f
+
+// One SIMD register worth of neighbours of a particle
+struct NeighbourBatch
+{
+	const int* Indices;		// SIMD::Width entries, the lanes past the end of the list are padding
+	int Count;				// Lanes that hold a neighbour, the first Count ones
+	SIMD::Float Distance;
+	SIMD::Mask Mask;		// Lanes that hold a particle inside the smoothing radius
+};
+
+// Component of the unit diagonal along every axis
+template<int Dimension>
+static constexpr float Diagonal = Dimension == 2 ? 0.70710678f : 0.57735027f;
+
+// Unit vectors from a particle towards a batch of its neighbours. Overlapping particles get opposite
+// diagonals depending on their index, so that the pair is still pushed apart
+template<int Dimension>
+static void CalculateDirections(const NeighbourBatch& batch, const AxisArrays<Dimension>& positions, int particleIndex,
+	SIMD::Float (&dir)[Dimension])
+{
+	SIMD::Float diagonal = SIMD::Set(Diagonal<Dimension>);
+	SIMD::Float overlapDir = SIMD::Select(SIMD::GreaterIndex(batch.Indices, particleIndex), diagonal, SIMD::Sub(SIMD::Zero(), diagonal));
+	SIMD::Mask overlapping = SIMD::Equal(batch.Distance, SIMD::Zero());
+
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		SIMD::Float offset = SIMD::Sub(SIMD::Gather(positions[axis], batch.Indices), SIMD::Set(positions[axis][particleIndex]));
+		dir[axis] = SIMD::Select(overlapping, overlapDir, SIMD::Div(offset, batch.Distance));
+	}
+}
+
+template<int Dimension>
+ParticleFluid<Dimension>::ParticleFluid()
+{
+	// The 3D block is about as many particles as the 2D one, in a box with room to spread out
+	// Room for emitters to add about four times the initial block
+	SetCapacity(20000);
+
+	if constexpr (Dimension == 2)
+	{
+		m_BoundsSize = { 1920.0f, 1080.0f };
+		GenerateParticleGrid({ 70, 70 }, 7.0f);
+	}
+	else
+	{
+		// The target density and pressure multiplier of the explicit solver are tuned to the 2D kernel,
+		// the implicit ones only need the rest density of the spawn grid
+		m_Solver = ParticleSolver::DFSPH;
+		m_BoundsSize = { 600.0f, 400.0f, 300.0f };
+		GenerateParticleGrid({ 20, 20, 12 }, 7.0f);
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::GenerateParticleGrid(Cell counts, float spacing, Vector center)
+{
+	m_ParticleSpacing = spacing;
+	Vector offset = (Vector(counts) * spacing - spacing) / 2.0f - center;
+
+	int particleCount = 1;
+	for (int axis = 0; axis < Dimension; axis++)
+		particleCount *= counts[axis];
+	SetCapacity(std::max(m_Capacity, GetParticleCount() + particleCount));
+
+	for (int i = 0; i < particleCount; i++)
+	{
+		// The last axis changes fastest
+		Cell cell;
+		int remainder = i;
+		for (int axis = Dimension - 1; axis >= 0; axis--)
+		{
+			cell[axis] = remainder % counts[axis];
+			remainder /= counts[axis];
+		}
+
+		AddParticle(Vector(cell) * spacing - offset, Vector(0.0f));
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::ClearParticles()
+{
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		m_Position[axis].clear();
+		m_Velocity[axis].clear();
+	}
+	m_Densities.clear();
+	m_Awake.clear();
+	m_DensityChanges.clear();
+	m_Levels.clear();
+	m_DensityStiffness.clear();
+	m_DivergenceStiffness.clear();
+	m_HasCoarseParticles = false;
+	m_NeighbourList.Invalidate();
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::SetCapacity(int capacity)
+{
+	m_Capacity = std::max(capacity, GetParticleCount());
+
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		m_Position[axis].reserve(m_Capacity);
+		m_Velocity[axis].reserve(m_Capacity);
+		m_Predicted[axis].reserve(m_Capacity);
+		m_Acceleration[axis].reserve(m_Capacity);
+	}
+	m_Densities.reserve(m_Capacity);
+
+	// Solver state and the scratch arrays of the reordering, which swaps its arrays with the particle ones
+	for (std::vector<float>* values : { &m_Lambdas, &m_DensityFactors, &m_DensityStiffness, &m_DivergenceStiffness,
+		&m_IterationStiffness, &m_DensityErrors, &m_ReorderScratch })
+		values->reserve(m_Capacity);
+	m_Order.reserve(m_Capacity);
+	m_DensityChanges.reserve(m_Capacity);
+	m_ParticleCells.reserve(m_Capacity);
+	m_Awake.reserve(m_Capacity);
+	m_AwakeScratch.reserve(m_Capacity);
+	m_ActiveParticles.reserve(m_Capacity);
+	m_Levels.reserve(m_Capacity);
+	m_Masses.reserve(m_Capacity);
+	m_SmoothingRadii.reserve(m_Capacity);
+	m_MergeFlags.reserve(m_Capacity);
+
+	m_PairAccumulators.resize(std::max((int)m_PairAccumulators.size(), (int)ThreadPool::Get().GetThreadCount()));
+	for (PairAccumulator<Dimension>& accumulator : m_PairAccumulators)
+	{
+		for (int axis = 0; axis < Dimension; axis++)
+			accumulator.Values[axis].reserve(m_Capacity);
+	}
+
+	m_SpatialLookup.Reserve(m_Capacity);
+	m_NeighbourList.Reserve(m_Capacity);
+}
+
+template<int Dimension>
+bool ParticleFluid<Dimension>::AddParticle(Vector position, Vector velocity)
+{
+	if (GetParticleCount() >= m_Capacity)
+		return false;
+
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		m_Position[axis].push_back(position[axis]);
+		m_Velocity[axis].push_back(velocity[axis]);
+	}
+	// The state RemoveParticle carries over has to stay aligned with the positions, the step can remove particles
+	// before it resizes anything
+	m_Densities.push_back(0.0f);
+	m_Awake.push_back(1);
+	m_DensityChanges.push_back(std::numeric_limits<float>::max());
+	m_Levels.push_back(0);
+	m_DensityStiffness.push_back(0.0f);
+	m_DivergenceStiffness.push_back(0.0f);
+	m_NeighbourList.Invalidate();
+	return true;
+}
+
+template<typename T>
+static void SwapRemove(std::vector<T>& values, int index)
+{
+	values[index] = values.back();
+	values.pop_back();
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::RemoveParticle(int index)
+{
+	// Only the state that is carried over between steps, the rest is resized and recomputed by the next one
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		SwapRemove(m_Position[axis], index);
+		SwapRemove(m_Velocity[axis], index);
+	}
+	SwapRemove(m_Densities, index);
+	SwapRemove(m_Awake, index);
+	SwapRemove(m_DensityChanges, index);
+	SwapRemove(m_Levels, index);
+	SwapRemove(m_DensityStiffness, index);
+	SwapRemove(m_DivergenceStiffness, index);
+	m_NeighbourList.Invalidate();
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::Step(const Sten::InputState& input, glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt)
+{
+	ST_PROFILE_FUNCTION();
+
+	glm::vec2 mouse = input.MousePosition - viewportOffset - viewportSize / 2.0f;
+	mouse.y = viewportSize.y - mouse.y - viewportSize.y;
+	Vector pos = Vector(0.0f);
+	pos[0] = mouse.x;
+	pos[1] = mouse.y;
+
+	float interactionStrength = input.IsMouseButtonPressed(Sten::Mouse::ButtonLeft) ? m_InteractionStrength :
+		(input.IsMouseButtonPressed(Sten::Mouse::ButtonRight) ? -m_InteractionStrength : 0.0f);
+
+	// Merging uses the neighbours of the last substep, so it has to come before anything adds or removes particles
+	m_AdaptiveActive = m_AdaptiveResolution && m_Solver == ParticleSolver::SPH;
+	UpdateResolution(pos, interactionStrength);
+	// The emitters fill the gap the last layers moved away by, which is the time the previous frame simulated. The
+	// time this frame will simulate isn't known yet, the substep limit can drop some of it
+	UpdateEmittersAndSinks(m_EmitterTime);
+
+	int particleCount = GetParticleCount();
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		m_Predicted[axis].resize(particleCount);
+		m_Acceleration[axis].resize(particleCount);
+	}
+
+	m_Kernel.SetRadius(m_SmoothingRadius);
+	m_SearchRadius = m_SmoothingRadius;
+	if (m_AdaptiveActive)
+		UpdateParticleScales();
+	m_RestDensity = CalculateLatticeDensity(m_ParticleSpacing);
+
+	m_PressureStats = {};
+
+	TimestepStats stats;
+	if (!m_AdaptiveTimestep)
+	{
+		Substep(pos, interactionStrength, m_FixedTimestep);
+		stats = { 1, m_FixedTimestep, m_FixedTimestep, m_FixedTimestep, false };
+	}
+	else
+	{
+		stats.MinTimestep = std::numeric_limits<float>::max();
+
+		float remaining = std::min(dt, m_MaxFrameTime) * m_TimeScale;
+		while (remaining > 0.0f)
+		{
+			// Past the limit the simulation slows down rather than becoming unstable
+			if (stats.Substeps == m_MaxSubsteps)
+			{
+				stats.Limited = true;
+				break;
+			}
+
+			// Spread the remaining time evenly, so the last substep is not a tiny leftover
+			float timestep = CalculateTimestep(interactionStrength);
+			timestep = remaining / std::ceil(remaining / timestep);
+
+			Substep(pos, interactionStrength, timestep);
+			remaining -= timestep;
+
+			stats.Substeps++;
+			stats.SimulatedTime += timestep;
+			stats.MinTimestep = std::min(stats.MinTimestep, timestep);
+			stats.MaxTimestep = std::max(stats.MaxTimestep, timestep);
+		}
+
+		if (stats.Substeps == 0)
+			stats.MinTimestep = 0.0f;
+	}
+
+	m_TimestepStats = stats;
+	m_AverageSubsteps += (stats.Substeps - m_AverageSubsteps) * 0.05f;
+	m_LimitedFrames += stats.Limited;
+	m_Time += stats.SimulatedTime;
+	m_EmitterTime = stats.SimulatedTime;
+
+	if (m_Recorder.IsOpen())
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::Step - Record Frame");
+
+		const float* streams[SnapshotStreamCount] = {};
+		for (int axis = 0; axis < Dimension; axis++)
+		{
+			streams[(int)SnapshotStream::PositionX + axis] = m_Position[axis].data();
+			streams[(int)SnapshotStream::VelocityX + axis] = m_Velocity[axis].data();
+		}
+		streams[(int)SnapshotStream::Density] = m_Densities.data();
+		m_Recorder.SubmitFrame(GetParticleCount(), m_Time, streams);
+	}
+}
+
+template<int Dimension>
+bool ParticleFluid<Dimension>::StartRecording(const std::string& path, bool quantised)
+{
+	uint32_t streams = GetStreamBit(SnapshotStream::Density);
+	for (int axis = 0; axis < Dimension; axis++)
+		streams |= GetStreamBit((SnapshotStream)((int)SnapshotStream::PositionX + axis)) | GetStreamBit((SnapshotStream)((int)SnapshotStream::VelocityX + axis));
+
+	return m_Recorder.Open(path, Dimension, streams, quantised);
+}
+
+template<int Dimension>
+float ParticleFluid<Dimension>::CalculateTimestep(float interactionStrength)
+{
+	float timestep = m_MaxTimestep;
+	if (m_MaxSpeed > 0.0f)
+		timestep = std::min(timestep, m_CourantNumber * m_SmoothingRadius / m_MaxSpeed);
+
+	// Gravity and the mouse are applied before the pressure forces, so they are not part of m_MaxAcceleration
+	float acceleration = m_MaxAcceleration + std::abs(m_Gravity) + std::abs(interactionStrength);
+	if (acceleration > 0.0f)
+		timestep = std::min(timestep, m_ForceNumber * std::sqrt(m_SmoothingRadius / acceleration));
+
+	return std::max(timestep, m_MinTimestep);
+}
+
+template<int Dimension>
+int ParticleFluid<Dimension>::GetGridCell(Vector position, float cellSize, Cell gridSize) const
+{
+	Cell cell = glm::clamp(Cell(glm::floor((position + m_BoundsSize / 2.0f) / cellSize)), Cell(0), gridSize - 1);
+
+	int index = 0;
+	for (int axis = Dimension - 1; axis >= 0; axis--)
+		index = index * gridSize[axis] + cell[axis];
+	return index;
+}
+
+// Calls func with the index of every cell of the 3x3 or 3x3x3 block around the cell that is inside the grid
+template<int Dimension, typename Func>
+static void ForEachNeighbourCell(int cellIndex, glm::vec<Dimension, int> gridSize, Func&& func)
+{
+	glm::vec<Dimension, int> cell;
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		cell[axis] = cellIndex % gridSize[axis];
+		cellIndex /= gridSize[axis];
+	}
+
+	constexpr int neighbourhoodSize = Dimension == 2 ? 9 : 27;
+	for (int neighbour = 0; neighbour < neighbourhoodSize; neighbour++)
+	{
+		int index = 0;
+		bool inside = true;
+		int digits = neighbour;
+		for (int axis = Dimension - 1; axis >= 0; axis--)
+		{
+			int coord = cell[axis] + digits % 3 - 1;
+			digits /= 3;
+			inside &= coord >= 0 && coord < gridSize[axis];
+			index = index * gridSize[axis] + coord;
+		}
+		if (inside)
+			func(index);
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::UpdateActivity(Vector inputPos, float interactionStrength)
+{
+	ST_PROFILE_FUNCTION();
+
+	// Twice the smoothing radius, so a particle only ever interacts with the particles of the cells right around its own
+	float cellSize = m_SmoothingRadius * 2.0f;
+	Cell gridSize = glm::max(Cell(glm::ceil(m_BoundsSize / cellSize)), Cell(1));
+	int cellCount = 1;
+	for (int axis = 0; axis < Dimension; axis++)
+		cellCount *= gridSize[axis];
+
+	if (gridSize != m_ActivityGridSize || (int)m_QuietSteps.size() != cellCount)
+	{
+		m_ActivityGridSize = gridSize;
+		m_QuietSteps.assign(cellCount, 0);
+		m_DisturbedCells.resize(cellCount);
+	}
+	std::fill(m_DisturbedCells.begin(), m_DisturbedCells.end(), (uint8_t)0);
+
+	// Sleeping particles don't move, they can only be disturbed from outside: by the mouse, a sink or their neighbours
+	int particleCount = GetParticleCount();
+	m_ParticleCells.resize(particleCount);
+	m_Awake.resize(particleCount, 1);
+	float sqrSleepSpeed = m_SleepSpeed * m_SleepSpeed;
+	float maxDensityChange = m_SleepDensityChange * m_TargetDensity;
+	for (int i = 0; i < particleCount; i++)
+	{
+		Vector position = Load(m_Position, i);
+		m_ParticleCells[i] = GetGridCell(position, cellSize, gridSize);
+
+		bool disturbed = false;
+		if (m_Awake[i])
+		{
+			Vector velocity = Load(m_Velocity, i);
+			disturbed = glm::dot(velocity, velocity) > sqrSleepSpeed || m_DensityChanges[i] > maxDensityChange;
+		}
+		if (interactionStrength != 0.0f)
+		{
+			Vector offset = position - inputPos;
+			disturbed |= glm::dot(offset, offset) < m_InteractionRadius * m_InteractionRadius;
+		}
+		for (const ParticleSink<Dimension>& sink : m_Sinks)
+		{
+			Vector offset = position - sink.Position;
+			float radius = sink.Radius + cellSize;
+			disturbed |= sink.Enabled && glm::dot(offset, offset) < radius * radius;
+		}
+
+		if (disturbed)
+			m_DisturbedCells[m_ParticleCells[i]] = 1;
+	}
+
+	// A disturbance reaches the cells around it within a step, so those wake up as well
+	for (int cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		bool disturbed = false;
+		ForEachNeighbourCell<Dimension>(cellIndex, gridSize, [&](int index) { disturbed |= m_DisturbedCells[index] != 0; });
+
+		m_QuietSteps[cellIndex] = disturbed ? 0 : (uint16_t)std::min(m_QuietSteps[cellIndex] + 1, m_SleepSteps);
+	}
+
+	// Particles that fall asleep are stopped where they are, any change of the awake set needs new neighbour lists
+	bool changed = false;
+	for (int i = 0; i < particleCount; i++)
+	{
+		bool awake = m_QuietSteps[m_ParticleCells[i]] < m_SleepSteps;
+		if (!awake && m_Awake[i])
+		{
+			for (int axis = 0; axis < Dimension; axis++)
+			{
+				m_Velocity[axis][i] = 0.0f;
+				m_Predicted[axis][i] = m_Position[axis][i];
+			}
+		}
+		changed |= awake != (bool)m_Awake[i];
+		m_Awake[i] = awake;
+	}
+
+	if (changed)
+		m_NeighbourList.Invalidate();
+	CollectActiveParticles();
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::CollectActiveParticles()
+{
+	m_ActiveParticles.clear();
+	for (int i = 0; i < (int)m_Awake.size(); i++)
+	{
+		if (m_Awake[i])
+			m_ActiveParticles.push_back(i);
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::WakeAll()
+{
+	m_QuietSteps.clear();
+	m_Awake.assign(GetParticleCount(), 1);
+	m_NeighbourList.Invalidate();
+}
+
+// A particle of the level covers 2^level times the area or volume of a base particle
+template<int Dimension>
+static float GetRadiusScale(int level)
+{
+	return std::pow(2.0f, (float)level / Dimension);
+}
+
+// Spread out over the circle or sphere, so the halves of neighbouring particles don't all split along the same axis
+template<int Dimension>
+static glm::vec<Dimension, float> GetSplitDirection(int index)
+{
+	const float goldenAngle = 2.39996323f;
+	float angle = index * goldenAngle;
+	if constexpr (Dimension == 2)
+	{
+		return { std::cos(angle), std::sin(angle) };
+	}
+	else
+	{
+		float z = 1.0f - 2.0f * std::fmod(index * 0.618034f, 1.0f);
+		float radius = std::sqrt(std::max(1.0f - z * z, 0.0f));
+		return { radius * std::cos(angle), radius * std::sin(angle), z };
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::UpdateResolution(Vector inputPos, float interactionStrength)
+{
+	ST_PROFILE_FUNCTION();
+
+	// Without adaptive resolution everything is split back down to the base mass
+	if (!m_AdaptiveActive && !m_HasCoarseParticles)
+		return;
+
+	ComputeTargetLevels(inputPos, interactionStrength);
+	if (m_AdaptiveActive)
+		MergeParticles();
+	SplitParticles();
+
+	m_HasCoarseParticles = std::any_of(m_Levels.begin(), m_Levels.end(), [](uint8_t level) { return level > 0; });
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::ComputeTargetLevels(Vector inputPos, float interactionStrength)
+{
+	// Cells of twice the smoothing radius of the coarsest level, every cell further from the surface can be a level
+	// coarser. The distance goes one past the coarsest level, merging needs one more cell than splitting so that
+	// particles on the border between two levels don't merge and split again every step
+	int maxLevel = m_AdaptiveActive ? m_MaxLevel : 0;
+	m_ResolutionCellSize = m_SmoothingRadius * GetRadiusScale<Dimension>(maxLevel) * 2.0f;
+	m_ResolutionGridSize = glm::max(Cell(glm::ceil(m_BoundsSize / m_ResolutionCellSize)), Cell(1));
+	int cellCount = 1;
+	for (int axis = 0; axis < Dimension; axis++)
+		cellCount *= m_ResolutionGridSize[axis];
+	m_TargetLevels.assign(cellCount, (uint8_t)(maxLevel + 1));
+	if (maxLevel == 0)
+	{
+		std::fill(m_TargetLevels.begin(), m_TargetLevels.end(), (uint8_t)0);
+		return;
+	}
+
+	int particleCount = GetParticleCount();
+	m_OccupiedCells.assign(cellCount, 0);
+	for (int i = 0; i < particleCount; i++)
+		m_OccupiedCells[GetGridCell(Load(m_Position, i), m_ResolutionCellSize, m_ResolutionGridSize)] = 1;
+
+	// Cells hold a few particles even of the coarsest level, so only the cells at the surface have empty neighbours
+	for (int cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		bool surface = false;
+		if (m_OccupiedCells[cellIndex])
+			ForEachNeighbourCell<Dimension>(cellIndex, m_ResolutionGridSize, [&](int index) { surface |= !m_OccupiedCells[index]; });
+		if (surface)
+			m_TargetLevels[cellIndex] = 0;
+	}
+
+	if (interactionStrength != 0.0f)
+	{
+		float interactionRadius = m_InteractionRadius + m_ResolutionCellSize;
+		for (int i = 0; i < particleCount; i++)
+		{
+			Vector position = Load(m_Position, i);
+			Vector offset = position - inputPos;
+			if (glm::dot(offset, offset) < interactionRadius * interactionRadius)
+				m_TargetLevels[GetGridCell(position, m_ResolutionCellSize, m_ResolutionGridSize)] = 0;
+		}
+	}
+
+	// Distance to the closest fine cell, each pass can only lower a cell to one more than its lowest neighbour
+	for (int pass = 0; pass <= maxLevel; pass++)
+	{
+		for (int cellIndex = 0; cellIndex < cellCount; cellIndex++)
+		{
+			int level = m_TargetLevels[cellIndex];
+			ForEachNeighbourCell<Dimension>(cellIndex, m_ResolutionGridSize, [&](int index) { level = std::min(level, m_TargetLevels[index] + 1); });
+			m_TargetLevels[cellIndex] = (uint8_t)level;
+		}
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::MergeParticles()
+{
+	ST_PROFILE_FUNCTION();
+
+	// The neighbours are gone once particles were added or removed since the last substep
+	int particleCount = GetParticleCount();
+	if (!m_NeighbourList.IsValid() || m_NeighbourList.GetParticleCount() != particleCount)
+		return;
+
+	const int* indices = m_NeighbourList.GetIndices();
+	const float* distances = m_NeighbourList.GetDistances();
+	m_MergeFlags.assign(particleCount, 0);
+	m_MergedParticles.clear();
+	for (int i = 0; i < particleCount; i++)
+	{
+		int level = m_Levels[i];
+		if (m_MergeFlags[i] || level + 1 >= m_TargetLevels[GetGridCell(Load(m_Position, i), m_ResolutionCellSize, m_ResolutionGridSize)])
+			continue;
+
+		// The closest neighbour of the same level that can merge as well, within about the spacing of their level
+		int partner = -1;
+		float partnerDistance = m_ParticleSpacing * GetRadiusScale<Dimension>(level) * 1.5f;
+		for (int n = m_NeighbourList.GetStart(i); n < m_NeighbourList.GetEnd(i); n++)
+		{
+			int j = indices[n];
+			if (j == i || m_MergeFlags[j] || m_Levels[j] != level || distances[n] >= partnerDistance)
+				continue;
+			if (level + 1 < m_TargetLevels[GetGridCell(Load(m_Position, j), m_ResolutionCellSize, m_ResolutionGridSize)])
+			{
+				partner = j;
+				partnerDistance = distances[n];
+			}
+		}
+		if (partner < 0)
+			continue;
+
+		// Both have the same mass, so the merged particle sits in the middle and keeps the momentum with the average velocity
+		Store(m_Position, i, (Load(m_Position, i) + Load(m_Position, partner)) * 0.5f);
+		Store(m_Velocity, i, (Load(m_Velocity, i) + Load(m_Velocity, partner)) * 0.5f);
+		m_Levels[i] = (uint8_t)(level + 1);
+		m_MergeFlags[i] = 1;
+		m_MergeFlags[partner] = 1;
+		m_MergedParticles.push_back(partner);
+	}
+
+	// Highest index first, so the particle that is swapped into a removed slot is never one that still has to be removed
+	std::sort(m_MergedParticles.begin(), m_MergedParticles.end(), std::greater<int>());
+	for (int index : m_MergedParticles)
+		RemoveParticle(index);
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::SplitParticles()
+{
+	ST_PROFILE_FUNCTION();
+
+	// The halves are added at the end, they only split further in the next step
+	int particleCount = GetParticleCount();
+	for (int i = 0; i < particleCount; i++)
+	{
+		int level = m_Levels[i];
+		if (level == 0 || level <= m_TargetLevels[GetGridCell(Load(m_Position, i), m_ResolutionCellSize, m_ResolutionGridSize)])
+			continue;
+
+		// Either side of the old position, one spacing of the finer level apart. Stops once the pool is full
+		Vector position = Load(m_Position, i);
+		Vector offset = GetSplitDirection<Dimension>(i) * (m_ParticleSpacing * GetRadiusScale<Dimension>(level - 1) * 0.5f);
+		if (!AddParticle(position + offset, Load(m_Velocity, i)))
+			break;
+
+		Store(m_Position, i, position - offset);
+		m_Levels[i] = (uint8_t)(level - 1);
+		m_Levels.back() = (uint8_t)(level - 1);
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::UpdateParticleScales()
+{
+	float radii[MaxParticleLevel + 1];
+	for (int level = 0; level <= MaxParticleLevel; level++)
+		radii[level] = m_SmoothingRadius * GetRadiusScale<Dimension>(level);
+
+	int particleCount = GetParticleCount();
+	m_Masses.resize(particleCount);
+	m_SmoothingRadii.resize(particleCount);
+	int maxLevel = 0;
+	for (int i = 0; i < particleCount; i++)
+	{
+		int level = m_Levels[i];
+		m_Masses[i] = MASS * (float)(1 << level);
+		m_SmoothingRadii[i] = radii[level];
+		maxLevel = std::max(maxLevel, level);
+	}
+
+	m_SearchRadius = radii[maxLevel];
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::UpdateEmittersAndSinks(float dt)
+{
+	ST_PROFILE_FUNCTION();
+
+	// Backwards, so the particle that is swapped into a removed slot has already been checked
+	if (!m_Sinks.empty())
+	{
+		for (int i = GetParticleCount() - 1; i >= 0; i--)
+		{
+			Vector position = Load(m_Position, i);
+			for (const ParticleSink<Dimension>& sink : m_Sinks)
+			{
+				Vector offset = position - sink.Position;
+				if (sink.Enabled && glm::dot(offset, offset) < sink.Radius * sink.Radius)
+				{
+					RemoveParticle(i);
+					break;
+				}
+			}
+		}
+	}
+
+	for (ParticleEmitter<Dimension>& emitter : m_Emitters)
+	{
+		float length = glm::length(emitter.Direction);
+		if (!emitter.Enabled || emitter.Speed <= 0.0f || length == 0.0f)
+			continue;
+
+		// The first layer of the frame has moved the furthest since it was emitted
+		Vector direction = emitter.Direction / length;
+		emitter.Distance += emitter.Speed * dt;
+		while (emitter.Distance >= m_ParticleSpacing)
+		{
+			emitter.Distance -= m_ParticleSpacing;
+			EmitLayer(emitter, direction, emitter.Distance);
+		}
+	}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::EmitLayer(const ParticleEmitter<Dimension>& emitter, Vector direction, float offset)
+{
+	int range = (int)(emitter.Radius / m_ParticleSpacing);
+	Vector origin = emitter.Position + direction * offset;
+	Vector velocity = direction * emitter.Speed;
+
+	if constexpr (Dimension == 2)
+	{
+		Vector tangent = { -direction.y, direction.x };
+		for (int i = -range; i <= range; i++)
+			AddParticle(origin + tangent * (i * m_ParticleSpacing), velocity);
+	}
+	else
+	{
+		// Any axis that isn't close to the direction spans the plane of the layer together with it
+		Vector axis = std::abs(direction.y) < 0.9f ? Vector(0.0f, 1.0f, 0.0f) : Vector(1.0f, 0.0f, 0.0f);
+		Vector tangent = glm::normalize(glm::cross(direction, axis));
+		Vector bitangent = glm::cross(direction, tangent);
+		for (int i = -range; i <= range; i++)
+		{
+			for (int j = -range; j <= range; j++)
+			{
+				if (i * i + j * j <= range * range)
+					AddParticle(origin + (tangent * (float)i + bitangent * (float)j) * m_ParticleSpacing, velocity);
+			}
+		}
+	}
+}
+
+static void AtomicMax(std::atomic<float>& value, float candidate)
+{
+	float current = value.load(std::memory_order_relaxed);
+	while (candidate > current && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::Substep(Vector pos, float interactionStrength, float dt)
+{
+	ST_PROFILE_FUNCTION();
+	int particleCount = GetParticleCount();
+
+	// The other solvers correct all particles together, so only the explicit one can leave some out
+	m_SleepingActive = m_Sleeping && m_Solver == ParticleSolver::SPH;
+	if (m_SleepingActive)
+		UpdateActivity(pos, interactionStrength);
+	else if (!m_QuietSteps.empty())
+		WakeAll();
+
+	if (m_Solver == ParticleSolver::DFSPH)
+	{
+		StepDivergenceFree(pos, interactionStrength, dt);
+		return;
+	}
+
+	// Sleeping particles keep their predicted position, which is the same as their position
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::Substep - External Forces");
+		ParallelFor(GetActiveCount(), [&](int begin, int end)
+		{
+			for (int k = begin; k < end; k++)
+			{
+				int i = GetActiveParticle(k);
+				Vector position = Load(m_Position, i);
+				Vector velocity = Load(m_Velocity, i);
+				velocity += CalculateExternalForces(position, velocity, pos, m_InteractionRadius, interactionStrength) * dt;
+
+				Store(m_Velocity, i, velocity);
+				Store(m_Predicted, i, position + velocity * dt);
+			}
+		});
+	}
+
+	UpdateNeighbourList();
+	m_StepCount++;
+
+	if (m_Solver == ParticleSolver::PBF)
+	{
+		SolveDensityConstraints(dt);
+		return;
+	}
+
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::Substep - Density");
+		if (UseSymmetricPairs())
+		{
+			float* densities[] = { m_Densities.data() };
+			AccumulatePairs(densities, [&](int i, PairAccumulator<Dimension>& accumulator) { AccumulateDensityPairs(i, accumulator); });
+		}
+		else if (m_SleepingActive || m_AdaptiveActive)
+		{
+			// Without pairs the awake particles sum up their own neighbours
+			ParallelFor(GetActiveCount(), [&](int begin, int end)
+			{
+				for (int k = begin; k < end; k++)
+				{
+					int i = GetActiveParticle(k);
+					float density = m_AdaptiveActive ? CalculateAdaptiveDensity(i) : CalculateDensity(i);
+					m_DensityChanges[i] = std::abs(density - m_Densities[i]);
+					m_Densities[i] = density;
+				}
+			});
+		}
+		else
+		{
+			ParallelFor(particleCount, [&](int begin, int end)
+			{
+				for (int i = begin; i < end; i++)
+					m_Densities[i] = CalculateDensity(i);
+			});
+		}
+	}
+
+	// Viscosity and pressure only read the velocities, the results are stored separately
+	// so that every particle sees the same state no matter which thread handles it
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::Substep - Viscosity & Pressure");
+		if (UseSymmetricPairs())
+		{
+			float* accelerations[Dimension];
+			for (int axis = 0; axis < Dimension; axis++)
+				accelerations[axis] = m_Acceleration[axis].data();
+			AccumulatePairs(accelerations, [&](int i, PairAccumulator<Dimension>& accumulator) { AccumulateForcePairs(i, accumulator); });
+		}
+		else
+		{
+			ParallelFor(GetActiveCount(), [&](int begin, int end)
+			{
+				for (int k = begin; k < end; k++)
+				{
+					int i = GetActiveParticle(k);
+					if (m_AdaptiveActive)
+					{
+						Store(m_Acceleration, i, CalculateAdaptiveAcceleration(i));
+						continue;
+					}
+					Vector viscosityForce = CalculateViscosityForce(i);
+					Vector pressureForce = -CalculatePressureForce(i);
+					Store(m_Acceleration, i, viscosityForce + pressureForce / m_Densities[i]);
+				}
+			});
+		}
+	}
+
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::Substep - Integrate");
+		Vector halfBounds = m_BoundsSize / 2.0f;
+		std::atomic<float> maxSqrSpeed = 0.0f;
+		std::atomic<float> maxSqrAcceleration = 0.0f;
+		ParallelFor(GetActiveCount(), [&](int begin, int end)
+		{
+			float chunkSqrSpeed = 0.0f;
+			float chunkSqrAcceleration = 0.0f;
+			for (int k = begin; k < end; k++)
+			{
+				int i = GetActiveParticle(k);
+				Vector acceleration = Load(m_Acceleration, i);
+				chunkSqrAcceleration = std::max(chunkSqrAcceleration, glm::dot(acceleration, acceleration));
+				for (int axis = 0; axis < Dimension; axis++)
+				{
+					m_Velocity[axis][i] += m_Acceleration[axis][i] * dt;
+					m_Position[axis][i] += m_Velocity[axis][i] * dt;
+				}
+				ResolveCollisions(i, halfBounds);
+
+				Vector velocity = Load(m_Velocity, i);
+				chunkSqrSpeed = std::max(chunkSqrSpeed, glm::dot(velocity, velocity));
+			}
+			AtomicMax(maxSqrSpeed, chunkSqrSpeed);
+			AtomicMax(maxSqrAcceleration, chunkSqrAcceleration);
+		});
+		m_MaxSpeed = std::sqrt(maxSqrSpeed.load());
+		m_MaxAcceleration = std::sqrt(maxSqrAcceleration.load());
+	}
+}
+
+#ifndef FLUID_HEADLESS
+template<int Dimension>
+void ParticleFluid<Dimension>::Render()
+{
+	ST_PROFILE_FUNCTION();
+
+	// 3D fluids are drawn as seen along the z axis, merged particles grow with their area or volume
+	const SpeedColorMap& colorMap = SpeedColorMap::Get();
+	m_CircleInstances.resize(GetParticleCount());
+	for (int i = 0; i < GetParticleCount(); i++)
+	{
+		float radius = m_Levels[i] == 0 ? 2.5f : 2.5f * GetRadiusScale<Dimension>(m_Levels[i]);
+		m_CircleInstances[i] = { { m_Position[0][i], m_Position[1][i], 0.0f }, radius, colorMap.MapPacked(glm::length(Load(m_Velocity, i)), 100.0f) };
+	}
+	Sten::Renderer2D::DrawCircles(m_CircleInstances.data(), (uint32_t)m_CircleInstances.size());
+
+	// Emitters and sinks as rings around their area
+	for (const ParticleEmitter<Dimension>& emitter : m_Emitters)
+	{
+		glm::mat4 transform = glm::translate(glm::mat4(1.0f), { emitter.Position[0], emitter.Position[1], 0.1f })
+			* glm::scale(glm::mat4(1.0f), { emitter.Radius * 2.0f, emitter.Radius * 2.0f, 1.0f });
+		Sten::Renderer2D::DrawCircle({ transform, { 0.2f, 1.0f, 0.3f, emitter.Enabled ? 1.0f : 0.3f }, 0.05f });
+	}
+	for (const ParticleSink<Dimension>& sink : m_Sinks)
+	{
+		glm::mat4 transform = glm::translate(glm::mat4(1.0f), { sink.Position[0], sink.Position[1], 0.1f })
+			* glm::scale(glm::mat4(1.0f), { sink.Radius * 2.0f, sink.Radius * 2.0f, 1.0f });
+		Sten::Renderer2D::DrawCircle({ transform, { 1.0f, 0.2f, 0.2f, sink.Enabled ? 1.0f : 0.3f }, 0.05f });
+	}
+
+	//for (int i = -WIDTH; i < WIDTH; i++)
+	//for (int j = -HEIGHT; j < HEIGHT; j++)
+	//{
+	//	float d = CalculateDensity(i, j) * 300.0f;
+	//	Sten::Renderer2D::DrawQuad({ i, j, -0.1f }, { 1, 1 }, {d / 7.0f, d / 10.0f, d, 1.0f});
+	//}
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::OnImGuiRender()
+{
+	ST_PROFILE_FUNCTION();
+
+	ImGui::Begin("Particle Simulation");
+
+	const char* solvers[] = { "SPH", "Position Based Fluids", "Divergence-free SPH" };
+	int solver = (int)m_Solver;
+	if (ImGui::Combo("Solver", &solver, solvers, IM_ARRAYSIZE(solvers)))
+		m_Solver = (ParticleSolver)solver;
+
+	// Sleeping particles wouldn't notice changed parameters on their own
+	bool changed = ImGui::DragFloat("Smoothing Radius", &m_SmoothingRadius, 0.1f, 0.0f, 1000.0f);
+	changed |= ImGui::DragFloat("Gravity", &m_Gravity, 0.1f, -1000.0f, 1000.0f);
+	if (m_Solver == ParticleSolver::SPH)
+	{
+		changed |= ImGui::DragFloat("Target Density", &m_TargetDensity, 0.1f, 0.0f, 1000.0f);
+		changed |= ImGui::DragFloat("Pressure Multiplier", &m_PressureMultiplier, 0.1f, 0.0f, 1000.0f);
+		ImGui::DragFloat("Collision Damping", &m_CollisionDamping, 0.05f, 0.0f, 1.0f);
+		ImGui::DragFloat("Viscosity Strengh", &m_ViscosityStrength, 0.1f, 0.0f, 1000.0f);
+
+		ImGui::Checkbox("Sleeping", &m_Sleeping);
+		if (m_Sleeping)
+		{
+			ImGui::DragFloat("Sleep Speed", &m_SleepSpeed, 0.1f, 0.0f, 100.0f);
+			ImGui::DragFloat("Sleep Density Change", &m_SleepDensityChange, 0.0001f, 0.0f, 1.0f, "%.4f");
+			ImGui::DragInt("Sleep Steps", &m_SleepSteps, 1.0f, 1, 1000);
+			ImGui::Text("Awake: %d of %d particles", GetActiveCount(), GetParticleCount());
+		}
+
+		ImGui::Checkbox("Adaptive Resolution", &m_AdaptiveResolution);
+		if (m_AdaptiveResolution)
+		{
+			ImGui::DragInt("Max Level", &m_MaxLevel, 0.05f, 1, MaxParticleLevel);
+
+			int baseParticles = 0;
+			for (uint8_t level : m_Levels)
+				baseParticles += 1 << level;
+			ImGui::Text("Particles: %d, standing in for %d", GetParticleCount(), baseParticles);
+		}
+	}
+	else if (m_Solver == ParticleSolver::PBF)
+	{
+		ImGui::DragInt("Solver Iterations", &m_SolverIterations, 0.1f, 1, 50);
+		ImGui::DragFloat("Constraint Relaxation", &m_ConstraintRelaxation, 0.0001f, 0.0f, 1.0f, "%.4f");
+		ImGui::DragFloat("Correction Factor", &m_CorrectionFactor, 0.01f, 0.0f, 1.0f);
+		ImGui::DragFloat("XSPH Viscosity", &m_XSPHViscosity, 0.001f, 0.0f, 1.0f);
+	}
+	else
+	{
+		ImGui::DragFloat("Collision Damping", &m_CollisionDamping, 0.05f, 0.0f, 1.0f);
+		ImGui::DragFloat("Density Tolerance", &m_DensityTolerance, 0.0001f, 0.0f, 1.0f, "%.4f");
+		ImGui::Checkbox("Divergence Solve", &m_DivergenceSolve);
+		if (m_DivergenceSolve)
+			ImGui::DragFloat("Divergence Tolerance", &m_DivergenceTolerance, 0.0001f, 0.0f, 1.0f, "%.4f");
+		ImGui::Checkbox("Warm Start", &m_WarmStart);
+		ImGui::DragInt("Max Pressure Iterations", &m_MaxPressureIterations, 1.0f, 1, 1000);
+
+		int substeps = std::max(m_TimestepStats.Substeps, 1);
+		ImGui::Text("Density solve: %.1f iterations per substep, error %.3f%%",
+			(float)m_PressureStats.DensityIterations / substeps, m_PressureStats.DensityError * 100.0f);
+		if (m_DivergenceSolve)
+			ImGui::Text("Divergence solve: %.1f iterations per substep, error %.3f%%",
+				(float)m_PressureStats.DivergenceIterations / substeps, m_PressureStats.DivergenceError * 100.0f);
+	}
+
+	DensityStats densityStats = CalculateDensityStats();
+	ImGui::Text("Compression: %.2f%% average, %.2f%% max", densityStats.AverageCompression * 100.0f, densityStats.MaxCompression * 100.0f);
+
+	ImGui::DragFloat("Interaction Strengh", &m_InteractionStrength, 1.0f, 0.0f, 10000.0f);
+	ImGui::DragFloat("Interaction Radius", &m_InteractionRadius, 1.0f, 0.0f, 1000.0f);
+
+	if (ImGui::CollapsingHeader("Emitters & Sinks"))
+	{
+		ImGui::Text("Particles: %d of %d", GetParticleCount(), m_Capacity);
+		int capacity = m_Capacity;
+		if (ImGui::DragInt("Capacity", &capacity, 100.0f, 0, 10000000))
+			SetCapacity(capacity);
+
+		for (int i = 0; i < (int)m_Emitters.size(); i++)
+		{
+			ParticleEmitter<Dimension>& emitter = m_Emitters[i];
+			ImGui::PushID(i);
+			ImGui::Text("Emitter %d", i);
+			ImGui::Checkbox("Enabled", &emitter.Enabled);
+			ImGui::DragScalarN("Position", ImGuiDataType_Float, &emitter.Position[0], Dimension, 1.0f);
+			ImGui::DragScalarN("Direction", ImGuiDataType_Float, &emitter.Direction[0], Dimension, 0.01f);
+			ImGui::DragFloat("Speed", &emitter.Speed, 1.0f, 0.0f, 1000.0f);
+			ImGui::DragFloat("Radius", &emitter.Radius, 0.5f, 0.0f, 500.0f);
+			bool remove = ImGui::Button("Remove");
+			ImGui::PopID();
+			if (remove)
+				m_Emitters.erase(m_Emitters.begin() + i--);
+		}
+
+		for (int i = 0; i < (int)m_Sinks.size(); i++)
+		{
+			ParticleSink<Dimension>& sink = m_Sinks[i];
+			ImGui::PushID(-1 - i);
+			ImGui::Text("Sink %d", i);
+			ImGui::Checkbox("Enabled", &sink.Enabled);
+			ImGui::DragScalarN("Position", ImGuiDataType_Float, &sink.Position[0], Dimension, 1.0f);
+			ImGui::DragFloat("Radius", &sink.Radius, 0.5f, 0.0f, 500.0f);
+			bool remove = ImGui::Button("Remove");
+			ImGui::PopID();
+			if (remove)
+				m_Sinks.erase(m_Sinks.begin() + i--);
+		}
+
+		// New ones start in the upper left, pointing right, and in the lower right
+		if (ImGui::Button("Add Emitter"))
+		{
+			ParticleEmitter<Dimension> emitter;
+			emitter.Position = Vector(0.0f);
+			emitter.Position[0] = -m_BoundsSize[0] / 4.0f;
+			emitter.Position[1] = m_BoundsSize[1] / 4.0f;
+			emitter.Direction = Vector(0.0f);
+			emitter.Direction[0] = 1.0f;
+			m_Emitters.push_back(emitter);
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Add Sink"))
+		{
+			ParticleSink<Dimension> sink;
+			sink.Position = Vector(0.0f);
+			sink.Position[0] = m_BoundsSize[0] / 4.0f;
+			sink.Position[1] = -m_BoundsSize[1] / 2.0f;
+			m_Sinks.push_back(sink);
+		}
+	}
 
-#define PI 3.14159265358979f
-#define MASS 1.0f
-#define WIDTH 1920
-#define HEIGHT 1080
-
-static int2 s_CellOffsets[] = {
-	{ -1,  1 },
-	{  0,  1 },
-	{  1,  1 },
-	{ -1,  0 },
-	{  0,  0 },
-	{  1,  0 },
-	{ -1, -1 },
-	{  0, -1 },
-	{  1, -1 }
-};
+	if (ImGui::CollapsingHeader("Recording"))
+	{
+		if (!m_Recorder.IsOpen())
+		{
+			ImGui::InputText("File", m_RecordingPath, sizeof(m_RecordingPath));
+			ImGui::Checkbox("Quantise to 16 bits", &m_QuantiseRecording);
+			if (ImGui::Button("Start Recording"))
+				StartRecording(m_RecordingPath, m_QuantiseRecording);
+		}
+		else
+		{
+			if (ImGui::Button("Stop Recording"))
+				StopRecording();
+			ImGui::Text("Frames: %u written, %u dropped, %.1f MB", m_Recorder.GetWrittenFrames(), m_Recorder.GetDroppedFrames(),
+				m_Recorder.GetWrittenBytes() / (1024.0 * 1024.0));
+		}
+		if (m_Recorder.HasFailed())
+			ImGui::TextColored({ 1.0f, 0.3f, 0.3f, 1.0f }, "Writing the file failed");
+	}
 
-glm::vec4 MapSpeedToColor(const glm::vec2& velocity, float maxSpeed) 
-{
-	// Define colors for different speed ranges
-	glm::vec3 slowColor =		{ 0.0f, 0.0f, 1.0f }; // Blue
-	glm::vec3 mediumColor =		{ 0.0f, 1.0f, 1.0f }; // Cyan
-	glm::vec3 moderateColor =	{ 0.0f, 0.5f, 1.0f }; // Teal
-	glm::vec3 fastColor =		{ 1.0f, 1.0f, 0.0f }; // Yellow
-	glm::vec3 fasterColor =		{ 1.0f, 0.5f, 0.0f }; // Orange
-	glm::vec3 maxColor =		{ 1.0f, 0.0f, 0.0f }; // Red
+	ImGui::Checkbox("Adaptive Timestep", &m_AdaptiveTimestep);
+	if (m_AdaptiveTimestep)
+	{
+		ImGui::DragFloat("Time Scale", &m_TimeScale, 0.01f, 0.0f, 10.0f);
+		ImGui::DragFloat("Courant Number", &m_CourantNumber, 0.01f, 0.01f, 1.0f);
+		ImGui::DragFloat("Force Number", &m_ForceNumber, 0.01f, 0.01f, 1.0f);
+		ImGui::DragInt("Max Substeps", &m_MaxSubsteps, 1.0f, 1, 100);
+		ImGui::Text("Substeps: %d (%.2f average), dt %.3f - %.3f ms", m_TimestepStats.Substeps, m_AverageSubsteps,
+			m_TimestepStats.MinTimestep * 1000.0f, m_TimestepStats.MaxTimestep * 1000.0f);
+		ImGui::Text("Max speed: %.1f, max acceleration: %.1f", m_MaxSpeed, m_MaxAcceleration);
+		ImGui::Text("Frames limited by the max substeps: %u", m_LimitedFrames);
+	}
+	else
+	{
+		ImGui::DragFloat("Timestep", &m_FixedTimestep, 0.0001f, 0.0001f, 0.1f, "%.4f");
+	}
 
-	// Normalize speed to [0, 1] range
-	float speedNormalized = glm::length(velocity) / maxSpeed;
+	const char* sortMethods[] = { "Counting Sort", "std::sort" };
+	int sortMethod = (int)m_SortMethod;
+	if (ImGui::Combo("Spatial Sort", &sortMethod, sortMethods, IM_ARRAYSIZE(sortMethods)))
+		m_SortMethod = (SpatialSortMethod)sortMethod;
+
+	const char* forceEvaluations[] = { "Per Particle", "Symmetric Pairs" };
+	int forceEvaluation = (int)m_ForceEvaluation;
+	if (ImGui::Combo("Force Evaluation", &forceEvaluation, forceEvaluations, IM_ARRAYSIZE(forceEvaluations)))
+		m_ForceEvaluation = (ForceEvaluation)forceEvaluation;
+
+	ImGui::DragFloat("Neighbour Skin", &m_NeighbourSkin, 0.1f, 0.0f, 100.0f);
+	ImGui::Text("Neighbour list: %.1f neighbours per particle, rebuilt %.1f%% of the steps",
+		(float)m_NeighbourList.GetNeighbourCount() / std::max(m_NeighbourList.GetParticleCount(), 1),
+		100.0f * m_NeighbourListBuilds / std::max(m_StepCount, 1u));
+
+	const char* indexModes[] = { "Hashed", "Dense Grid" };
+	int indexMode = (int)m_IndexMode;
+	if (ImGui::Combo("Spatial Index", &indexMode, indexModes, IM_ARRAYSIZE(indexModes)))
+		m_IndexMode = (SpatialIndexMode)indexMode;
+
+	const SpatialLookupStats& stats = m_SpatialLookup.GetStats();
+	if (m_IndexMode == SpatialIndexMode::Hashed)
+		ImGui::Text("Hash collisions: %d of %d keys, %.1f%% of the particles", stats.CollidingKeys, stats.OccupiedKeys,
+			100.0f * stats.CollidingParticles / std::max(m_SpatialLookup.GetSize(), 1));
+	ImGui::Text("Candidates tested: %.1f per particle",
+		(float)m_NeighbourList.GetCandidateCount() / std::max(m_NeighbourList.GetParticleCount(), 1));
+
+	const char* orderings[] = { "None", "Cell Key", "Morton" };
+	int ordering = (int)m_Ordering;
+	if (ImGui::Combo("Particle Ordering", &ordering, orderings, IM_ARRAYSIZE(orderings)))
+		m_Ordering = (ParticleOrdering)ordering;
+	if (m_Ordering != ParticleOrdering::None)
+		ImGui::DragInt("Reorder Interval", &m_ReorderInterval, 1.0f, 1, 1000);
+
+	ImGui::Checkbox("Multithreaded", &m_Multithreaded);
+	if (m_Multithreaded)
+		ImGui::Text("Threads: %u", ThreadPool::Get().GetThreadCount());
+
+	if (changed && m_SleepingActive)
+		WakeAll();
 
-	// Use glm::mix to interpolate between colors based on speed
-	glm::vec3 resultColor;
+	ImGui::End();
+}
+#endif
 
-	if		(speedNormalized < 0.2f)	resultColor = glm::mix(slowColor,		mediumColor,	 speedNormalized * 5.0f);
-	else if (speedNormalized < 0.4f)	resultColor = glm::mix(mediumColor,		moderateColor,	(speedNormalized - 0.2f) * 5.0f);
-	else if (speedNormalized < 0.6f)	resultColor = glm::mix(moderateColor,	fastColor,		(speedNormalized - 0.4f) * 5.0f);
-	else if (speedNormalized < 0.8f)	resultColor = glm::mix(fastColor,		fasterColor,	(speedNormalized - 0.6f) * 5.0f);
-	else								resultColor = glm::mix(fasterColor,		maxColor,		(speedNormalized - 0.8f) * 5.0f);
+template<int Dimension>
+template<typename Func>
+void ParticleFluid<Dimension>::ForEachNeighbourBatch(int particleIndex, Func&& func)
+{
+	SIMD::Float radius = SIMD::Set(m_SearchRadius);
+	const int* indices = m_NeighbourList.GetIndices();
+	const float* distances = m_NeighbourList.GetDistances();
 
-	// Return the resulting color with alpha set to 1.0
-	return { resultColor, 1.0f };
+	NeighbourBatch batch;
+	int end = m_NeighbourList.GetEnd(particleIndex);
+	for (int i = m_NeighbourList.GetStart(particleIndex); i < end; i += SIMD::Width)
+	{
+		// The list also holds the particles inside the skin, those are masked out like the padding
+		batch.Indices = indices + i;
+		batch.Count = std::min(end - i, SIMD::Width);
+		batch.Distance = SIMD::Load(distances + i);
+		batch.Mask = SIMD::And(SIMD::FirstLanes(batch.Count), SIMD::LessEqual(batch.Distance, radius));
+		if (SIMD::Any(batch.Mask))
+			func(batch);
+	}
 }
 
+template<int Dimension>
+float ParticleFluid<Dimension>::CalculateDensity(int particleIndex)
+{
+	SIMD::Float density = SIMD::Zero();
+
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		SIMD::Float influence = m_Kernel.Value(batch.Distance);
+		density = SIMD::Add(density, SIMD::Keep(batch.Mask, influence));
+	});
+
+	return SIMD::ReduceAdd(density) * MASS;
+}
 
-ParticleFluid::ParticleFluid()
+template<int Dimension>
+void ParticleFluid<Dimension>::AccumulateDensityPairs(int particleIndex, PairAccumulator<Dimension>& accumulator)
 {
-	GenerateParticleGrid(70, 70, 7.0f);
+	SIMD::Float density = SIMD::Zero();
+	float influences[SIMD::Width];
+
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		SIMD::Float influence = SIMD::Keep(batch.Mask, m_Kernel.Value(batch.Distance));
+		density = SIMD::Add(density, influence);
+
+		SIMD::Store(influences, influence);
+		for (int lane = 0; lane < batch.Count; lane++)
+			accumulator.Add(batch.Indices[lane], influences[lane] * MASS);
+	});
+
+	// The particle itself is not part of the half list
+	float selfInfluence = m_Kernel.Value(0.0f);
+	accumulator.Add(particleIndex, (SIMD::ReduceAdd(density) + selfInfluence) * MASS);
 }
 
-void ParticleFluid::GenerateParticleGrid(int width, int height, float spacing)
+template<int Dimension>
+void ParticleFluid<Dimension>::AccumulateForcePairs(int particleIndex, PairAccumulator<Dimension>& accumulator)
 {
-	glm::vec2 offset = glm::vec2{ width * spacing - spacing, height * spacing - spacing } / 2.0f;
-	for (int i = 0; i < width; ++i)
+	SIMD::Float acceleration[Dimension];
+	SIMD::Float position[Dimension];
+	SIMD::Float velocity[Dimension];
+	float pair[Dimension][SIMD::Width];
+	for (int axis = 0; axis < Dimension; axis++)
 	{
-		for (int j = 0; j < height; ++j)
+		acceleration[axis] = SIMD::Zero();
+		position[axis] = SIMD::Set(m_Predicted[axis][particleIndex]);
+		velocity[axis] = SIMD::Set(m_Velocity[axis][particleIndex]);
+	}
+
+	float density = m_Densities[particleIndex];
+	SIMD::Float targetDensity = SIMD::Set(density);
+	SIMD::Float targetPressure = SIMD::Set(ConvertDensityToPressure(density));
+	SIMD::Float diagonal = SIMD::Set(Diagonal<Dimension>);
+
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		// Same terms as CalculatePressureForce and CalculateViscosityForce, already divided by both densities
+		// since the acceleration of either particle is its force divided by its own density
+		SIMD::Float slope = m_Kernel.Derivative(batch.Distance);
+		SIMD::Float neighbourDensity = SIMD::Gather(m_Densities.data(), batch.Indices);
+		SIMD::Float pressure = SIMD::Mul(SIMD::Sub(neighbourDensity, SIMD::Set(m_TargetDensity)), SIMD::Set(m_PressureMultiplier));
+		SIMD::Float sharedPressure = SIMD::Mul(SIMD::Add(pressure, targetPressure), SIMD::Set(0.5f));
+		SIMD::Float pressureScale = SIMD::Div(SIMD::Mul(SIMD::Mul(sharedPressure, slope), SIMD::Set(MASS)), SIMD::Mul(neighbourDensity, targetDensity));
+
+		SIMD::Float influence = m_Kernel.Value(batch.Distance);
+		SIMD::Mask overlapping = SIMD::Equal(batch.Distance, SIMD::Zero());
+
+		for (int axis = 0; axis < Dimension; axis++)
 		{
-			Particle particle;
-			particle.Position = glm::vec2{ i * spacing, j * spacing } - offset;
-			particle.Velocity = { 0, 0 };
-			particle.Color = { 1, 1, 1, 1 };
-			m_Particles.push_back(particle);
+			SIMD::Float offset = SIMD::Sub(SIMD::Gather(m_Predicted[axis].data(), batch.Indices), position[axis]);
+			SIMD::Float dir = SIMD::Select(overlapping, diagonal, SIMD::Div(offset, batch.Distance));
+			SIMD::Float neighbourVelocity = SIMD::Gather(m_Velocity[axis].data(), batch.Indices);
+
+			SIMD::Float accel = SIMD::Keep(batch.Mask, SIMD::Sub(SIMD::Mul(SIMD::Sub(neighbourVelocity, velocity[axis]), influence), SIMD::Mul(dir, pressureScale)));
+			acceleration[axis] = SIMD::Add(acceleration[axis], accel);
+			SIMD::Store(pair[axis], accel);
 		}
-	}
+
+		// Both terms flip sign when seen from the neighbour
+		for (int lane = 0; lane < batch.Count; lane++)
+			accumulator.Subtract(batch.Indices[lane], pair, lane);
+	});
+
+	Vector particleAcceleration;
+	for (int axis = 0; axis < Dimension; axis++)
+		particleAcceleration[axis] = SIMD::ReduceAdd(acceleration[axis]);
+	accumulator.Add(particleIndex, particleAcceleration);
 }
 
-void ParticleFluid::Step(glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt)
+template<int Dimension>
+template<int Components, typename Func>
+void ParticleFluid<Dimension>::AccumulatePairs(float* const (&outputs)[Components], Func&& func)
 {
-	ST_PROFILE_FUNCTION();
-	float staticDeltaTime = 1.0f / 120.0f;
+	// One chunk per thread, the chunk boundaries don't depend on the scheduling so the result is deterministic
+	int particleCount = GetParticleCount();
+	int chunkCount = m_Multithreaded ? (int)ThreadPool::Get().GetThreadCount() : 1;
+	m_PairAccumulators.resize(chunkCount);
+
+	auto accumulate = [&](int chunkBegin, int chunkEnd)
+	{
+		for (int chunk = chunkBegin; chunk < chunkEnd; chunk++)
+		{
+			PairAccumulator<Dimension>& accumulator = m_PairAccumulators[chunk];
+			for (int component = 0; component < Components; component++)
+				accumulator.Values[component].resize(particleCount, 0.0f);
+			accumulator.Begin = (int)((int64_t)particleCount * chunk / chunkCount);
+			accumulator.End = accumulator.Begin;
+
+			int end = (int)((int64_t)particleCount * (chunk + 1) / chunkCount);
+			for (int i = accumulator.Begin; i < end; i++)
+				func(i, accumulator);
+		}
+	};
 
-	glm::vec2 pos = Sten::Input::GetMousePosition() - viewportOffset - viewportSize / 2.0f;
-	pos.y = viewportSize.y - pos.y - viewportSize.y;
+	if (m_Multithreaded)
+		ThreadPool::Get().ParallelFor(chunkCount, accumulate, 1);
+	else
+		accumulate(0, chunkCount);
 
-	m_PredictedPositions.resize(m_Particles.size());
-	for (int i = 0; i < m_Particles.size(); i++)
+	// Neighbours are mostly close in index, so each chunk only touched a narrow range
+	ParallelFor(particleCount, [&](int begin, int end)
 	{
-		// External forces
-		m_Particles[i].Velocity += CalculateExternalForces(m_Particles[i], pos, m_InteractionRadius,
-			Sten::Input::IsMouseButtonPressed(Sten::Mouse::ButtonLeft) ? m_InteractionStrength :
-			(Sten::Input::IsMouseButtonPressed(Sten::Mouse::ButtonRight) ? -m_InteractionStrength : 0.0f)) * staticDeltaTime;
+		for (int i = begin; i < end; i++)
+		{
+			float sum[Components] = {};
+			for (PairAccumulator<Dimension>& accumulator : m_PairAccumulators)
+			{
+				if (i < accumulator.Begin || i >= accumulator.End)
+					continue;
+
+				for (int component = 0; component < Components; component++)
+				{
+					sum[component] += accumulator.Values[component][i];
+					accumulator.Values[component][i] = 0.0f;
+				}
+			}
 
-		m_PredictedPositions[i] = m_Particles[i].Position + m_Particles[i].Velocity * staticDeltaTime;
+			for (int component = 0; component < Components; component++)
+				outputs[component][i] = sum[component];
+		}
+	});
+}
+
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::CalculatePressureForce(int targetIndex)
+{
+	SIMD::Float force[Dimension];
+	SIMD::Float position[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		force[axis] = SIMD::Zero();
+		position[axis] = SIMD::Set(m_Predicted[axis][targetIndex]);
 	}
 
-	UpdateSpatialLookup(m_PredictedPositions);
+	float targetPressure = ConvertDensityToPressure(m_Densities[targetIndex]);
+	SIMD::Float diagonal = SIMD::Set(Diagonal<Dimension>);
 
-	m_Densities.resize(m_Particles.size());
-	for (int i = 0; i < m_Particles.size(); i++)
+	ForEachNeighbourBatch(targetIndex, [&](const NeighbourBatch& batch)
 	{
-		m_Densities[i] = CalculateDensity(m_PredictedPositions[i]);
-		m_Particles[i].Velocity += CalculateViscosityForce(i) * staticDeltaTime;
+		SIMD::Mask mask = SIMD::AndNot(SIMD::EqualIndex(batch.Indices, targetIndex), batch.Mask);
+		SIMD::Mask overlapping = SIMD::Equal(batch.Distance, SIMD::Zero());
+
+		SIMD::Float slope = m_Kernel.Derivative(batch.Distance);
+		SIMD::Float density = SIMD::Gather(m_Densities.data(), batch.Indices);
+		SIMD::Float pressure = SIMD::Mul(SIMD::Sub(density, SIMD::Set(m_TargetDensity)), SIMD::Set(m_PressureMultiplier));
+		SIMD::Float sharedPressure = SIMD::Mul(SIMD::Add(pressure, SIMD::Set(targetPressure)), SIMD::Set(0.5f));
+		SIMD::Float scale = SIMD::Keep(mask, SIMD::Div(SIMD::Mul(SIMD::Mul(sharedPressure, slope), SIMD::Set(MASS)), density));
+
+		// Particles on top of each other get pushed apart diagonally
+		for (int axis = 0; axis < Dimension; axis++)
+		{
+			SIMD::Float offset = SIMD::Sub(SIMD::Gather(m_Predicted[axis].data(), batch.Indices), position[axis]);
+			SIMD::Float dir = SIMD::Select(overlapping, diagonal, SIMD::Div(offset, batch.Distance));
+			force[axis] = SIMD::Add(force[axis], SIMD::Mul(dir, scale));
+		}
+	});
+
+	Vector result;
+	for (int axis = 0; axis < Dimension; axis++)
+		result[axis] = SIMD::ReduceAdd(force[axis]);
+	return result;
+}
+
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::CalculateExternalForces(Vector position, Vector velocity, Vector inputPos, float radius, float strength)
+{
+	// Gravity
+	Vector gravityAccel = Vector(0.0f);
+	gravityAccel[1] = m_Gravity;
+
+	// Input interactions modify gravity
+	if (strength != 0) {
+		Vector inputPointOffset = inputPos - position;
+		float sqrDst = dot(inputPointOffset, inputPointOffset);
+		if (sqrDst < radius * radius)
+		{
+			float dst = sqrt(sqrDst);
+			float edgeT = (dst / radius);
+			float centreT = 1.0f - edgeT;
+			Vector dirToCentre = inputPointOffset / dst;
+
+			float gravityWeight = 1.0f - (centreT * std::min(1.0f, std::max(0.0f, strength / 10.0f)));
+			Vector accel = gravityAccel * gravityWeight + dirToCentre * centreT * strength;
+			accel -= velocity * centreT;
+			return accel;
+		}
 	}
 
-	for (int i = 0; i < m_Particles.size(); i++)
+	return gravityAccel;
+}
+
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::CalculateViscosityForce(int targetIndex)
+{
+	SIMD::Float force[Dimension];
+	SIMD::Float velocity[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
 	{
-		glm::vec2 pressureForce = -CalculatePressureForce(i);
-		glm::vec2 acceleration = pressureForce / m_Densities[i];
-		m_Particles[i].Velocity += acceleration * staticDeltaTime;
+		force[axis] = SIMD::Zero();
+		velocity[axis] = SIMD::Set(m_Velocity[axis][targetIndex]);
 	}
 
-	for (int i = 0; i < m_Particles.size(); i++)
+	ForEachNeighbourBatch(targetIndex, [&](const NeighbourBatch& batch)
 	{
-		m_Particles[i].Position += m_Particles[i].Velocity * staticDeltaTime;
-		if (std::abs(m_Particles[i].Position.x) > WIDTH / 2.0f)
-		{
-			m_Particles[i].Position.x = WIDTH / 2.0f * (m_Particles[i].Position.x / std::abs(m_Particles[i].Position.x));
-			m_Particles[i].Velocity.x *= -m_CollisionDamping;
-		}
-		if (std::abs(m_Particles[i].Position.y) > HEIGHT / 2.0f)
+		SIMD::Float influence = SIMD::Keep(batch.Mask, m_Kernel.Value(batch.Distance));
+		for (int axis = 0; axis < Dimension; axis++)
 		{
-			m_Particles[i].Position.y = HEIGHT / 2.0f * (m_Particles[i].Position.y / std::abs(m_Particles[i].Position.y));
-			m_Particles[i].Velocity.y *= -m_CollisionDamping;
+			SIMD::Float neighbourVelocity = SIMD::Gather(m_Velocity[axis].data(), batch.Indices);
+			force[axis] = SIMD::Add(force[axis], SIMD::Mul(SIMD::Sub(neighbourVelocity, velocity[axis]), influence));
 		}
-		m_Particles[i].Color = MapSpeedToColor(m_Particles[i].Velocity, 100.0f);
-	}
+	});
+
+	Vector result;
+	for (int axis = 0; axis < Dimension; axis++)
+		result[axis] = SIMD::ReduceAdd(force[axis]);
+	return result;
 }
 
-void ParticleFluid::Render()
+// The kernel of the pair's radius is the base kernel at the distance scaled by radius / pairRadius, scaled by
+// (radius / pairRadius)^Dimension, so it still sums up to one. Its derivative needs one more factor of the scale
+template<int Dimension>
+static SIMD::Float PowDimension(SIMD::Float value)
 {
-	ST_PROFILE_FUNCTION();
+	SIMD::Float result = SIMD::Mul(value, value);
+	return Dimension == 2 ? result : SIMD::Mul(result, value);
+}
+
+template<int Dimension>
+float ParticleFluid<Dimension>::CalculateAdaptiveDensity(int particleIndex)
+{
+	SIMD::Float density = SIMD::Zero();
+	SIMD::Float radius = SIMD::Set(m_SmoothingRadii[particleIndex]);
+
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		SIMD::Float pairRadius = SIMD::Mul(SIMD::Add(SIMD::Gather(m_SmoothingRadii.data(), batch.Indices), radius), SIMD::Set(0.5f));
+		SIMD::Float scale = SIMD::Div(SIMD::Set(m_SmoothingRadius), pairRadius);
+		SIMD::Float influence = SIMD::Mul(m_Kernel.Value(SIMD::Mul(batch.Distance, scale)), PowDimension<Dimension>(scale));
+		SIMD::Float mass = SIMD::Gather(m_Masses.data(), batch.Indices);
+		density = SIMD::Add(density, SIMD::Keep(batch.Mask, SIMD::Mul(influence, mass)));
+	});
+
+	return SIMD::ReduceAdd(density);
+}
 
-	for (int i = 0; i < m_Particles.size(); i++)
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::CalculateAdaptiveAcceleration(int particleIndex)
+{
+	SIMD::Float viscosity[Dimension];
+	SIMD::Float pressure[Dimension];
+	SIMD::Float position[Dimension];
+	SIMD::Float velocity[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
 	{
-		Particle particle = m_Particles[i];
-		glm::mat4 transform = glm::translate(glm::mat4(1.0f), { particle.Position.x, particle.Position.y, 0.0f })
-			* glm::scale(glm::mat4(1.0f), { 5.0f, 5.0f, 1.0f });
-		Sten::Renderer2D::DrawCircle({ transform, particle.Color });
+		viscosity[axis] = SIMD::Zero();
+		pressure[axis] = SIMD::Zero();
+		position[axis] = SIMD::Set(m_Predicted[axis][particleIndex]);
+		velocity[axis] = SIMD::Set(m_Velocity[axis][particleIndex]);
 	}
 
-	//for (int i = -WIDTH; i < WIDTH; i++)
-	//for (int j = -HEIGHT; j < HEIGHT; j++)
-	//{
-	//	float d = CalculateDensity({i, j}) * 300.0f;
-	//	Sten::Renderer2D::DrawQuad({ i, j, -0.1f }, { 1, 1 }, {d / 7.0f, d / 10.0f, d, 1.0f});
-	//}
+	SIMD::Float radius = SIMD::Set(m_SmoothingRadii[particleIndex]);
+	float targetPressure = ConvertDensityToPressure(m_Densities[particleIndex]);
+	SIMD::Float diagonal = SIMD::Set(Diagonal<Dimension>);
+
+	// Same terms as CalculatePressureForce and CalculateViscosityForce, with the neighbour's mass instead of the base one
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		SIMD::Mask mask = SIMD::AndNot(SIMD::EqualIndex(batch.Indices, particleIndex), batch.Mask);
+		SIMD::Mask overlapping = SIMD::Equal(batch.Distance, SIMD::Zero());
+
+		SIMD::Float pairRadius = SIMD::Mul(SIMD::Add(SIMD::Gather(m_SmoothingRadii.data(), batch.Indices), radius), SIMD::Set(0.5f));
+		SIMD::Float scale = SIMD::Div(SIMD::Set(m_SmoothingRadius), pairRadius);
+		SIMD::Float scaledDistance = SIMD::Mul(batch.Distance, scale);
+		SIMD::Float normalisation = PowDimension<Dimension>(scale);
+		SIMD::Float influence = SIMD::Mul(m_Kernel.Value(scaledDistance), normalisation);
+		SIMD::Float slope = SIMD::Mul(m_Kernel.Derivative(scaledDistance), SIMD::Mul(normalisation, scale));
+
+		SIMD::Float mass = SIMD::Gather(m_Masses.data(), batch.Indices);
+		SIMD::Float density = SIMD::Gather(m_Densities.data(), batch.Indices);
+		SIMD::Float neighbourPressure = SIMD::Mul(SIMD::Sub(density, SIMD::Set(m_TargetDensity)), SIMD::Set(m_PressureMultiplier));
+		SIMD::Float sharedPressure = SIMD::Mul(SIMD::Add(neighbourPressure, SIMD::Set(targetPressure)), SIMD::Set(0.5f));
+		SIMD::Float pressureScale = SIMD::Keep(mask, SIMD::Div(SIMD::Mul(SIMD::Mul(sharedPressure, slope), mass), density));
+		SIMD::Float viscosityScale = SIMD::Keep(batch.Mask, SIMD::Mul(influence, SIMD::Mul(mass, SIMD::Set(1.0f / MASS))));
+
+		for (int axis = 0; axis < Dimension; axis++)
+		{
+			SIMD::Float offset = SIMD::Sub(SIMD::Gather(m_Predicted[axis].data(), batch.Indices), position[axis]);
+			SIMD::Float dir = SIMD::Select(overlapping, diagonal, SIMD::Div(offset, batch.Distance));
+			SIMD::Float neighbourVelocity = SIMD::Gather(m_Velocity[axis].data(), batch.Indices);
+			pressure[axis] = SIMD::Add(pressure[axis], SIMD::Mul(dir, pressureScale));
+			viscosity[axis] = SIMD::Add(viscosity[axis], SIMD::Mul(SIMD::Sub(neighbourVelocity, velocity[axis]), viscosityScale));
+		}
+	});
+
+	Vector result;
+	for (int axis = 0; axis < Dimension; axis++)
+		result[axis] = SIMD::ReduceAdd(viscosity[axis]) - SIMD::ReduceAdd(pressure[axis]) / m_Densities[particleIndex];
+	return result;
 }
 
-void ParticleFluid::OnImGuiRender()
+template<int Dimension>
+void ParticleFluid<Dimension>::SolveDensityConstraints(float dt)
 {
 	ST_PROFILE_FUNCTION();
 
-	ImGui::Begin("Particle Simulation");
+	ThreadPool* threadPool = m_Multithreaded ? &ThreadPool::Get() : nullptr;
+	int particleCount = GetParticleCount();
+	Vector halfBounds = m_BoundsSize / 2.0f;
+	m_Lambdas.resize(particleCount);
 
-	ImGui::DragFloat("Smoothing Radius", &m_SmoothingRadius, 0.1f, 0.0f, 1000.0f);
-	ImGui::DragFloat("Target Density", &m_TargetDensity, 0.1f, 0.0f, 1000.0f);
-	ImGui::DragFloat("Pressure Multiplier", &m_PressureMultiplier, 0.1f, 0.0f, 1000.0f);
-	ImGui::DragFloat("Gravity", &m_Gravity, 0.1f, -1000.0f, 1000.0f);
-	ImGui::DragFloat("Collision Damping", &m_CollisionDamping, 0.05f, 0.0f, 1.0f);
-	ImGui::DragFloat("Viscosity Strengh", &m_ViscosityStrength, 0.1f, 0.0f, 1000.0f);
+	// The predicted positions are moved until the constraints hold, the corrections are stored in the accelerations
+	for (int iteration = 0; iteration < m_SolverIterations; iteration++)
+	{
+		// The neighbours stay the same during the iterations, only their distances follow the corrections
+		if (iteration > 0)
+			m_NeighbourList.UpdateDistances(GetPointers(m_Predicted), threadPool);
 
-	ImGui::DragFloat("Interaction Strengh", &m_InteractionStrength, 1.0f, 0.0f, 10000.0f);
-	ImGui::DragFloat("Interaction Radius", &m_InteractionRadius, 1.0f, 0.0f, 1000.0f);
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				m_Lambdas[i] = CalculateConstraintLambda(i);
+		});
 
-	ImGui::End();
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				Store(m_Acceleration, i, CalculatePositionCorrection(i));
+		});
+
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				for (int axis = 0; axis < Dimension; axis++)
+					m_Predicted[axis][i] = std::clamp(m_Predicted[axis][i] + m_Acceleration[axis][i], -halfBounds[axis], halfBounds[axis]);
+			}
+		});
+	}
+
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::SolveDensityConstraints - Integrate");
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				for (int axis = 0; axis < Dimension; axis++)
+					m_Velocity[axis][i] = (m_Predicted[axis][i] - m_Position[axis][i]) / dt;
+			}
+		});
+
+		// Uses the distances from before the last correction, which is close enough for smoothing the velocities
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				Store(m_Acceleration, i, CalculateXSPHViscosity(i));
+		});
+
+		std::atomic<float> maxSqrSpeed = 0.0f;
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			float chunkSqrSpeed = 0.0f;
+			for (int i = begin; i < end; i++)
+			{
+				for (int axis = 0; axis < Dimension; axis++)
+				{
+					m_Velocity[axis][i] += m_Acceleration[axis][i];
+					m_Position[axis][i] = m_Predicted[axis][i];
+				}
+
+				Vector velocity = Load(m_Velocity, i);
+				chunkSqrSpeed = std::max(chunkSqrSpeed, glm::dot(velocity, velocity));
+			}
+			AtomicMax(maxSqrSpeed, chunkSqrSpeed);
+		});
+
+		// There are no pressure accelerations to limit the timestep, only the velocities
+		m_MaxSpeed = std::sqrt(maxSqrSpeed.load());
+		m_MaxAcceleration = 0.0f;
+	}
 }
 
-float ParticleFluid::SmoothingFunction(float dst)
+template<int Dimension>
+float ParticleFluid<Dimension>::CalculateConstraintLambda(int particleIndex)
 {
-	if (dst >= m_SmoothingRadius) return 0.0f;
-
-	float volume = (PI * std::pow(m_SmoothingRadius, 4)) / 6.0f;
-	return (m_SmoothingRadius - dst) * (m_SmoothingRadius - dst) / volume;
+	SIMD::Float density = SIMD::Zero();
+	SIMD::Float gradient[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
+		gradient[axis] = SIMD::Zero();
+	SIMD::Float sqrGradientSum = SIMD::Zero();
+
+	AxisArrays<Dimension> predicted = GetPointers(m_Predicted);
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		density = SIMD::Add(density, SIMD::Keep(batch.Mask, m_Kernel.Value(batch.Distance)));
+
+		SIMD::Float dir[Dimension];
+		CalculateDirections<Dimension>(batch, predicted, particleIndex, dir);
+
+		// Gradient of the constraint with respect to the neighbour's position, the particle itself has none
+		SIMD::Mask others = SIMD::AndNot(SIMD::EqualIndex(batch.Indices, particleIndex), batch.Mask);
+		SIMD::Float slope = SIMD::Keep(others, m_Kernel.Derivative(batch.Distance));
+		for (int axis = 0; axis < Dimension; axis++)
+			gradient[axis] = SIMD::Add(gradient[axis], SIMD::Mul(slope, dir[axis]));
+		sqrGradientSum = SIMD::Add(sqrGradientSum, SIMD::Mul(slope, slope));
+	});
+
+	float particleDensity = SIMD::ReduceAdd(density) * MASS;
+	m_Densities[particleIndex] = particleDensity;
+
+	// Only compression is corrected, pulling the particles at the surface inwards would make them clump
+	float constraint = particleDensity / m_RestDensity - 1.0f;
+	if (constraint <= 0.0f)
+		return 0.0f;
+
+	// The particle's own gradient is minus the sum of its neighbours' ones
+	float scale = MASS / m_RestDensity;
+	float sqrGradientLength = 0.0f;
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		float ownGradient = SIMD::ReduceAdd(gradient[axis]) * scale;
+		sqrGradientLength += ownGradient * ownGradient;
+	}
+	sqrGradientLength += SIMD::ReduceAdd(sqrGradientSum) * scale * scale;
+	return -constraint / (sqrGradientLength + m_ConstraintRelaxation);
 }
 
-float ParticleFluid::SmoothingFunctionDerivative(float dst)
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::CalculatePositionCorrection(int particleIndex)
 {
-	if (dst >= m_SmoothingRadius) return 0.0f;
+	SIMD::Float correction[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
+		correction[axis] = SIMD::Zero();
+	SIMD::Float lambda = SIMD::Set(m_Lambdas[particleIndex]);
 
-	float scale = 12.0f / (std::pow(m_SmoothingRadius, 4) * PI);
-	return (dst - m_SmoothingRadius) * scale;
+	AxisArrays<Dimension> predicted = GetPointers(m_Predicted);
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		SIMD::Float dir[Dimension];
+		CalculateDirections<Dimension>(batch, predicted, particleIndex, dir);
+
+		// Both the lambdas and the slope are negative, the correction points away from the neighbour
+		SIMD::Mask others = SIMD::AndNot(SIMD::EqualIndex(batch.Indices, particleIndex), batch.Mask);
+		SIMD::Float lambdaSum = SIMD::Add(lambda, SIMD::Gather(m_Lambdas.data(), batch.Indices));
+		SIMD::Float scale = SIMD::Keep(others, SIMD::Mul(lambdaSum, m_Kernel.Derivative(batch.Distance)));
+		for (int axis = 0; axis < Dimension; axis++)
+			correction[axis] = SIMD::Add(correction[axis], SIMD::Mul(scale, dir[axis]));
+	});
+
+	// Every neighbour corrects the same overlap at the same time, so the full Jacobi step overshoots
+	float scale = -MASS / m_RestDensity * m_CorrectionFactor;
+	Vector result;
+	for (int axis = 0; axis < Dimension; axis++)
+		result[axis] = SIMD::ReduceAdd(correction[axis]) * scale;
+	return result;
 }
 
-float ParticleFluid::ViscositySmoothingFunction(float dst)
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::CalculateXSPHViscosity(int particleIndex)
 {
-	float volume = PI * std::pow(m_SmoothingRadius, 8) / 4.0f;
-	float value = std::max(0.0f, m_SmoothingRadius * m_SmoothingRadius - dst * dst);
-	return value * value * value / volume;
+	SIMD::Float velocityChange[Dimension];
+	SIMD::Float velocity[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		velocityChange[axis] = SIMD::Zero();
+		velocity[axis] = SIMD::Set(m_Velocity[axis][particleIndex]);
+	}
+
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		// Weighted by the neighbour's volume, so the sum is a proper average of the velocity differences
+		SIMD::Float neighbourDensity = SIMD::Gather(m_Densities.data(), batch.Indices);
+		SIMD::Float weight = SIMD::Keep(batch.Mask, SIMD::Div(m_Kernel.Value(batch.Distance), neighbourDensity));
+		for (int axis = 0; axis < Dimension; axis++)
+		{
+			SIMD::Float neighbourVelocity = SIMD::Gather(m_Velocity[axis].data(), batch.Indices);
+			velocityChange[axis] = SIMD::Add(velocityChange[axis], SIMD::Mul(SIMD::Sub(neighbourVelocity, velocity[axis]), weight));
+		}
+	});
+
+	Vector result;
+	for (int axis = 0; axis < Dimension; axis++)
+		result[axis] = SIMD::ReduceAdd(velocityChange[axis]) * (m_XSPHViscosity * MASS);
+	return result;
 }
 
-float ParticleFluid::CalculateDensity(glm::vec2 samplePoint)
+template<int Dimension>
+void ParticleFluid<Dimension>::StepDivergenceFree(Vector inputPos, float interactionStrength, float dt)
 {
-	float density = 0.0f;
+	ST_PROFILE_FUNCTION();
 
-	int2 center = PositionToCellCoord(samplePoint);
-	float sqrRadius = m_SmoothingRadius * m_SmoothingRadius;
+	int particleCount = GetParticleCount();
+	m_DensityFactors.resize(particleCount);
 
-	for (int i = 0; i < 9; i++)
+	// The pressure solves correct the velocities, so the neighbourhood is the one of the current positions
+	ParallelFor(particleCount, [&](int begin, int end)
 	{
-		int2 offset = s_CellOffsets[i];
-		unsigned int key = GetKeyFromHash(HashCell(center + offset));
-		int cellStartIndex = m_StartIndices[key];
+		for (int axis = 0; axis < Dimension; axis++)
+			std::copy(m_Position[axis].begin() + begin, m_Position[axis].begin() + end, m_Predicted[axis].begin() + begin);
+	});
 
-		for (int j = cellStartIndex; j < m_SpatialLookup.size(); j++)
+	UpdateNeighbourList();
+	m_StepCount++;
+
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::StepDivergenceFree - Density");
+		ParallelFor(particleCount, [&](int begin, int end)
 		{
-			if (m_SpatialLookup[j].key != key) break;
+			for (int i = begin; i < end; i++)
+				CalculateDensityFactor(i);
+		});
+	}
+
+	// Removes the compression the velocities of the last substep still carry
+	if (m_DivergenceSolve)
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::StepDivergenceFree - Divergence Solve");
+		m_PressureStats.DivergenceIterations += SolvePressure(m_DivergenceStiffness, dt, true, m_DivergenceTolerance, m_PressureStats.DivergenceError);
+	}
 
-			int particleIndex = m_SpatialLookup[j].index;
-			glm::vec2 off = m_PredictedPositions[particleIndex] - samplePoint;
-			float sqrDst = off.x * off.x + off.y * off.y;
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::StepDivergenceFree - External Forces");
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				Vector position = Load(m_Position, i);
+				Vector velocity = Load(m_Velocity, i);
+				Vector acceleration = CalculateExternalForces(position, velocity, inputPos, m_InteractionRadius, interactionStrength)
+					+ CalculateViscosityForce(i);
+				Store(m_Acceleration, i, acceleration);
+			}
+		});
 
-			if (sqrDst <= sqrRadius)
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
 			{
-				float dst = glm::sqrt(sqrDst);
-				float influence = SmoothingFunction(dst);
-				density += MASS * influence;
+				for (int axis = 0; axis < Dimension; axis++)
+					m_Velocity[axis][i] += m_Acceleration[axis][i] * dt;
 			}
-		}
+		});
 	}
 
-	return density;
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::StepDivergenceFree - Density Solve");
+		m_PressureStats.DensityIterations += SolvePressure(m_DensityStiffness, dt, false, m_DensityTolerance, m_PressureStats.DensityError);
+	}
+
+	{
+		ST_PROFILE_SCOPE("ParticleFluid::StepDivergenceFree - Integrate");
+		Vector halfBounds = m_BoundsSize / 2.0f;
+		std::atomic<float> maxSqrSpeed = 0.0f;
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			float chunkSqrSpeed = 0.0f;
+			for (int i = begin; i < end; i++)
+			{
+				for (int axis = 0; axis < Dimension; axis++)
+					m_Position[axis][i] += m_Velocity[axis][i] * dt;
+				ResolveCollisions(i, halfBounds);
+
+				Vector velocity = Load(m_Velocity, i);
+				chunkSqrSpeed = std::max(chunkSqrSpeed, glm::dot(velocity, velocity));
+			}
+			AtomicMax(maxSqrSpeed, chunkSqrSpeed);
+		});
+
+		// Pressure is implicit, like with PBF only the velocities limit the timestep
+		m_MaxSpeed = std::sqrt(maxSqrSpeed.load());
+		m_MaxAcceleration = 0.0f;
+	}
 }
 
-glm::vec2 ParticleFluid::CalculatePressureForce(int targetIndex)
+template<int Dimension>
+int ParticleFluid<Dimension>::SolvePressure(std::vector<float>& stiffness, float dt, bool divergence, float tolerance, float& error)
 {
-	ST_PROFILE_FUNCTION();
-
-	glm::vec2 pressureForce = { 0, 0 };
+	int particleCount = GetParticleCount();
+	m_IterationStiffness.resize(particleCount);
+	m_DensityErrors.resize(particleCount);
 
-	int2 center = PositionToCellCoord(m_PredictedPositions[targetIndex]);
-	float sqrRadius = m_SmoothingRadius * m_SmoothingRadius;
+	// The density solve predicts the density after dt, the divergence solve only the rate of change.
+	// Stiffness values are stored without the timestep, so they stay valid when it changes
+	float scale = divergence ? 1.0f : 1.0f / dt;
 
-	for (int i = 0; i < 9; i++)
+	// The errors are one-sided, so the iterations can only ever add stiffness. The stored values are halved
+	// and dropped for particles that are no longer compressed, otherwise they would keep growing every substep
+	if (m_WarmStart)
 	{
-		int2 offset = s_CellOffsets[i];
-		unsigned int key = GetKeyFromHash(HashCell(center + offset));
-		int cellStartIndex = m_StartIndices[key];
-
-		for (int j = cellStartIndex; j < m_SpatialLookup.size(); j++)
+		ParallelFor(particleCount, [&](int begin, int end)
 		{
-			if (m_SpatialLookup[j].key != key) break;
-
-			int particleIndex = m_SpatialLookup[j].index;
-			glm::vec2 off = m_PredictedPositions[particleIndex] - m_PredictedPositions[targetIndex];
-			float sqrDst = off.x * off.x + off.y * off.y;
+			for (int i = begin; i < end; i++)
+				stiffness[i] = m_Densities[i] < m_RestDensity ? 0.0f : stiffness[i] * 0.5f;
+		});
+		ApplyPressure(stiffness.data(), scale);
+	}
+	else
+		std::fill(stiffness.begin(), stiffness.end(), 0.0f);
 
-			if (sqrDst <= sqrRadius)
+	int iteration = 0;
+	while (iteration < m_MaxPressureIterations)
+	{
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
 			{
-				if (particleIndex == targetIndex) continue;
+				// Only compression is corrected, particles at the surface are allowed to have less density
+				float densityChange = CalculateDensityChange(i);
+				float densityError;
+				if (divergence)
+					densityError = m_Densities[i] < m_RestDensity ? 0.0f : std::max(densityChange, 0.0f) * dt;
+				else
+					densityError = std::max(m_Densities[i] + densityChange * dt - m_RestDensity, 0.0f);
+
+				m_DensityErrors[i] = densityError / m_RestDensity;
+				m_IterationStiffness[i] = densityError / dt * m_DensityFactors[i] / scale;
+			}
+		});
 
-				float dst = glm::sqrt(sqrDst);
-				glm::vec2 dir = dst == 0 ? glm::vec2{ 1.0f, 1.0f } / glm::length(glm::vec2{ 1.0f, 1.0f }) : (off / dst);
+		// Summed up on one thread, so the number of iterations doesn't depend on the scheduling
+		double errorSum = 0.0;
+		for (float particleError : m_DensityErrors)
+			errorSum += particleError;
+		error = particleCount > 0 ? (float)(errorSum / particleCount) : 0.0f;
 
-				float slope = SmoothingFunctionDerivative(dst);
-				float density = m_Densities[particleIndex];
-				float sharedPressure = CalculateSharedPressure(density, m_Densities[targetIndex]);
+		if (iteration >= m_MinPressureIterations && error <= tolerance)
+			break;
 
-				pressureForce += sharedPressure * dir * slope * MASS / density;
-			}
-		}
+		ApplyPressure(m_IterationStiffness.data(), scale);
+		ParallelFor(particleCount, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				stiffness[i] += m_IterationStiffness[i];
+		});
+		iteration++;
 	}
 
-	return pressureForce;
+	return iteration;
 }
 
-glm::vec2 ParticleFluid::CalculateExternalForces(const Particle& particle, glm::vec2 inputPos, float radius, float strength)
+template<int Dimension>
+void ParticleFluid<Dimension>::ApplyPressure(const float* stiffness, float scale)
 {
-	// Gravity
-	glm::vec2 gravityAccel = { 0, m_Gravity };
+	int particleCount = GetParticleCount();
 
-	// Input interactions modify gravity
-	if (strength != 0) {
-		glm::vec2 inputPointOffset = inputPos - particle.Position;
-		float sqrDst = dot(inputPointOffset, inputPointOffset);
-		if (sqrDst < radius * radius)
-		{
-			float dst = sqrt(sqrDst);
-			float edgeT = (dst / radius);
-			float centreT = 1.0f - edgeT;
-			glm::vec2 dirToCentre = inputPointOffset / dst;
+	// All accelerations are computed before any velocity changes, every particle sees the same state
+	ParallelFor(particleCount, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			Store(m_Acceleration, i, CalculatePressureAcceleration(i, stiffness));
+	});
 
-			float gravityWeight = 1.0f - (centreT * std::min(1.0f, std::max(0.0f, strength / 10.0f)));
-			glm::vec2 accel = gravityAccel * gravityWeight + dirToCentre * centreT * strength;
-			accel -= particle.Velocity * centreT;
-			return accel;
+	ParallelFor(particleCount, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			for (int axis = 0; axis < Dimension; axis++)
+				m_Velocity[axis][i] -= m_Acceleration[axis][i] * scale;
 		}
+	});
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::CalculateDensityFactor(int particleIndex)
+{
+	SIMD::Float density = SIMD::Zero();
+	SIMD::Float gradient[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
+		gradient[axis] = SIMD::Zero();
+	SIMD::Float sqrGradientSum = SIMD::Zero();
+
+	AxisArrays<Dimension> predicted = GetPointers(m_Predicted);
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		density = SIMD::Add(density, SIMD::Keep(batch.Mask, m_Kernel.Value(batch.Distance)));
+
+		SIMD::Float dir[Dimension];
+		CalculateDirections<Dimension>(batch, predicted, particleIndex, dir);
+
+		SIMD::Mask others = SIMD::AndNot(SIMD::EqualIndex(batch.Indices, particleIndex), batch.Mask);
+		SIMD::Float slope = SIMD::Keep(others, m_Kernel.Derivative(batch.Distance));
+		for (int axis = 0; axis < Dimension; axis++)
+			gradient[axis] = SIMD::Add(gradient[axis], SIMD::Mul(slope, dir[axis]));
+		sqrGradientSum = SIMD::Add(sqrGradientSum, SIMD::Mul(slope, slope));
+	});
+
+	float particleDensity = SIMD::ReduceAdd(density) * MASS;
+	float denominator = 0.0f;
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		float sum = SIMD::ReduceAdd(gradient[axis]) * MASS;
+		denominator += sum * sum;
 	}
+	denominator += SIMD::ReduceAdd(sqrGradientSum) * MASS * MASS;
 
-	return gravityAccel;
+	// A particle without neighbours can't be corrected by pressure
+	m_Densities[particleIndex] = particleDensity;
+	m_DensityFactors[particleIndex] = denominator > 0.0f ? particleDensity / denominator : 0.0f;
 }
 
-glm::vec2 ParticleFluid::CalculateViscosityForce(int targetIndex)
+template<int Dimension>
+float ParticleFluid<Dimension>::CalculateDensityChange(int particleIndex)
 {
-	glm::vec2 viscosityForce = { 0, 0 };
+	SIMD::Float change = SIMD::Zero();
+	SIMD::Float velocity[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
+		velocity[axis] = SIMD::Set(m_Velocity[axis][particleIndex]);
+
+	AxisArrays<Dimension> predicted = GetPointers(m_Predicted);
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
+	{
+		SIMD::Float dir[Dimension];
+		CalculateDirections<Dimension>(batch, predicted, particleIndex, dir);
+
+		// (v_i - v_j) . gradW_ij, with gradW_ij = -slope * dir
+		SIMD::Float approach = SIMD::Mul(SIMD::Sub(SIMD::Gather(m_Velocity[0].data(), batch.Indices), velocity[0]), dir[0]);
+		for (int axis = 1; axis < Dimension; axis++)
+		{
+			SIMD::Float relative = SIMD::Sub(SIMD::Gather(m_Velocity[axis].data(), batch.Indices), velocity[axis]);
+			approach = SIMD::Add(approach, SIMD::Mul(relative, dir[axis]));
+		}
+		SIMD::Mask others = SIMD::AndNot(SIMD::EqualIndex(batch.Indices, particleIndex), batch.Mask);
+		change = SIMD::Add(change, SIMD::Keep(others, SIMD::Mul(approach, m_Kernel.Derivative(batch.Distance))));
+	});
+
+	return SIMD::ReduceAdd(change) * MASS;
+}
 
-	int2 center = PositionToCellCoord(m_PredictedPositions[targetIndex]);
-	float sqrRadius = m_SmoothingRadius * m_SmoothingRadius;
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::CalculatePressureAcceleration(int particleIndex, const float* stiffness)
+{
+	SIMD::Float acceleration[Dimension];
+	for (int axis = 0; axis < Dimension; axis++)
+		acceleration[axis] = SIMD::Zero();
+	SIMD::Float ownTerm = SIMD::Set(stiffness[particleIndex] / m_Densities[particleIndex]);
 
-	for (int i = 0; i < 9; i++)
+	AxisArrays<Dimension> predicted = GetPointers(m_Predicted);
+	ForEachNeighbourBatch(particleIndex, [&](const NeighbourBatch& batch)
 	{
-		int2 offset = s_CellOffsets[i];
-		unsigned int key = GetKeyFromHash(HashCell(center + offset));
-		int cellStartIndex = m_StartIndices[key];
+		SIMD::Float dir[Dimension];
+		CalculateDirections<Dimension>(batch, predicted, particleIndex, dir);
+
+		// Sum of (k_i / rho_i + k_j / rho_j) gradW_ij, with gradW_ij = -slope * dir
+		SIMD::Float neighbourTerm = SIMD::Div(SIMD::Gather(stiffness, batch.Indices), SIMD::Gather(m_Densities.data(), batch.Indices));
+		SIMD::Mask others = SIMD::AndNot(SIMD::EqualIndex(batch.Indices, particleIndex), batch.Mask);
+		SIMD::Float scale = SIMD::Keep(others, SIMD::Mul(SIMD::Add(ownTerm, neighbourTerm), m_Kernel.Derivative(batch.Distance)));
+		for (int axis = 0; axis < Dimension; axis++)
+			acceleration[axis] = SIMD::Sub(acceleration[axis], SIMD::Mul(scale, dir[axis]));
+	});
+
+	Vector result;
+	for (int axis = 0; axis < Dimension; axis++)
+		result[axis] = SIMD::ReduceAdd(acceleration[axis]) * MASS;
+	return result;
+}
 
-		for (int j = cellStartIndex; j < m_SpatialLookup.size(); j++)
+template<int Dimension>
+void ParticleFluid<Dimension>::ResolveCollisions(int particleIndex, Vector halfBounds)
+{
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		float& position = m_Position[axis][particleIndex];
+		if (std::abs(position) > halfBounds[axis])
 		{
-			if (m_SpatialLookup[j].key != key) break;
+			position = halfBounds[axis] * (position / std::abs(position));
+			m_Velocity[axis][particleIndex] *= -m_CollisionDamping;
+		}
+	}
+}
 
-			int particleIndex = m_SpatialLookup[j].index;
-			glm::vec2 off = m_PredictedPositions[particleIndex] - m_PredictedPositions[targetIndex];
-			float sqrDst = off.x * off.x + off.y * off.y;
+template<int Dimension>
+float ParticleFluid<Dimension>::CalculateLatticeDensity(float spacing)
+{
+	// Every lattice point within the radius along each axis, the last axis changes fastest
+	int range = (int)(m_SmoothingRadius / spacing);
+	int side = 2 * range + 1;
+	int pointCount = 1;
+	for (int axis = 0; axis < Dimension; axis++)
+		pointCount *= side;
 
-			if (sqrDst <= sqrRadius)
-			{
-				float dst = glm::sqrt(sqrDst);
-				glm::vec2 neighbourVelocity = m_Particles[particleIndex].Velocity;
-				viscosityForce += (neighbourVelocity - m_Particles[targetIndex].Velocity) * SmoothingFunction(dst);
-			}
+	float density = 0.0f;
+	for (int i = 0; i < pointCount; i++)
+	{
+		int sqrDst = 0;
+		int remainder = i;
+		for (int axis = 0; axis < Dimension; axis++)
+		{
+			int offset = remainder % side - range;
+			remainder /= side;
+			sqrDst += offset * offset;
 		}
+		density += m_Kernel.Value(std::sqrt((float)sqrDst) * spacing);
 	}
+	return density * MASS;
+}
+
+template<int Dimension>
+DensityStats ParticleFluid<Dimension>::CalculateDensityStats() const
+{
+	DensityStats stats;
+	if (m_Densities.empty() || m_RestDensity <= 0.0f)
+		return stats;
 
-	return viscosityForce;
+	double compressionSum = 0.0;
+	for (float density : m_Densities)
+	{
+		float compression = std::max(density / m_RestDensity - 1.0f, 0.0f);
+		compressionSum += compression;
+		stats.MaxCompression = std::max(stats.MaxCompression, compression);
+	}
+	stats.AverageCompression = (float)(compressionSum / m_Densities.size());
+	return stats;
 }
 
-float ParticleFluid::ConvertDensityToPressure(float density)
+template<int Dimension>
+float ParticleFluid<Dimension>::ConvertDensityToPressure(float density)
 {
 	float densityError = density - m_TargetDensity;
 	float pressure = densityError * m_PressureMultiplier;
 	return pressure;
 }
 
-float ParticleFluid::CalculateSharedPressure(float d1, float d2)
+template<int Dimension>
+float ParticleFluid<Dimension>::CalculateSharedPressure(float d1, float d2)
 {
 	float pressureA = ConvertDensityToPressure(d1);
 	float pressureB = ConvertDensityToPressure(d2);
 	return (pressureA + pressureB) / 2.0f;
 }
 
-bool CompareByKey(const Entry& entry1, const Entry& entry2)
+template<int Dimension>
+void ParticleFluid<Dimension>::ParallelFor(int count, RangeFunction func)
+{
+	if (m_Multithreaded)
+		ThreadPool::Get().ParallelFor(count, func);
+	else
+		func(0, count);
+}
+
+template<int Dimension>
+typename ParticleFluid<Dimension>::Vector ParticleFluid<Dimension>::Load(const AxisVectors& arrays, int index)
 {
-	return entry1.key < entry2.key;
+	Vector value;
+	for (int axis = 0; axis < Dimension; axis++)
+		value[axis] = arrays[axis][index];
+	return value;
 }
 
-void ParticleFluid::UpdateSpatialLookup(const std::vector<glm::vec2>& positions)
+template<int Dimension>
+void ParticleFluid<Dimension>::Store(AxisVectors& arrays, int index, Vector value)
 {
-	m_SpatialLookup.resize(positions.size());
-	m_StartIndices.resize(positions.size());
+	for (int axis = 0; axis < Dimension; axis++)
+		arrays[axis][index] = value[axis];
+}
+
+template<int Dimension>
+AxisArrays<Dimension> ParticleFluid<Dimension>::GetPointers(const AxisVectors& arrays)
+{
+	AxisArrays<Dimension> pointers;
+	for (int axis = 0; axis < Dimension; axis++)
+		pointers[axis] = arrays[axis].data();
+	return pointers;
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::UpdateSpatialLookup()
+{
+	ST_PROFILE_FUNCTION();
+
+	// The domain is bounded, so the dense grid covers the whole of it
+	m_SpatialLookup.SetIndexMode(m_IndexMode);
+	m_SpatialLookup.SetGridBounds(-m_BoundsSize / 2.0f, m_BoundsSize / 2.0f);
 
-	for (int i = 0; i < positions.size(); i++)
+	// The cells have to cover the skin as well, or the neighbourhood of 3 cells per axis would miss some of the list
+	m_SpatialLookup.Build(GetPointers(m_Predicted), GetParticleCount(), m_SearchRadius + m_NeighbourSkin,
+		m_SortMethod, m_Multithreaded ? &ThreadPool::Get() : nullptr);
+}
+
+template<int Dimension>
+void ParticleFluid<Dimension>::UpdateNeighbourList()
+{
+	ST_PROFILE_FUNCTION();
+
+	ThreadPool* threadPool = m_Multithreaded ? &ThreadPool::Get() : nullptr;
+	int particleCount = GetParticleCount();
+
+	bool halfList = m_Solver == ParticleSolver::SPH && UseSymmetricPairs();
+	if (!m_NeighbourList.NeedsRebuild(GetPointers(m_Predicted), particleCount, m_SearchRadius, m_NeighbourSkin, halfList, threadPool))
 	{
-		int2 cell = PositionToCellCoord(positions[i]);
-		unsigned int cellKey = GetKeyFromHash(HashCell(cell));
-		m_SpatialLookup[i] = { i, cellKey };
-		m_StartIndices[i] = 4294967295;
+		m_NeighbourList.UpdateDistances(GetPointers(m_Predicted), threadPool);
+		return;
 	}
 
-	// sort spatial lookup
-	std::sort(m_SpatialLookup.begin(), m_SpatialLookup.end(), CompareByKey);
+	UpdateSpatialLookup();
 
-	for (long i = 0; i < positions.size(); i++)
+	// Reordering changes the particle indices, so it can only happen while the list is rebuilt anyway
+	if (m_Ordering != ParticleOrdering::None && m_StepCount - m_LastReorderStep >= (uint32_t)std::max(m_ReorderInterval, 1))
 	{
-		unsigned int key = m_SpatialLookup[i].key;
-		unsigned int keyPrev = i == 0 ? 4294967295 : m_SpatialLookup[i - 1].key;
-		if (key != keyPrev)
-		{
-			m_StartIndices[key] = i;
-		}
+		ReorderParticles();
+		m_LastReorderStep = m_StepCount;
 	}
-}
 
-int2 ParticleFluid::PositionToCellCoord(glm::vec2 point)
-{
-	int cellX = point.x / m_SmoothingRadius;
-	int cellY = point.y / m_SmoothingRadius;
-	return { cellX, cellY };
+	m_NeighbourList.Build(m_SpatialLookup, GetPointers(m_Predicted), particleCount, m_SearchRadius, m_NeighbourSkin, halfList,
+		threadPool, m_SleepingActive ? m_Awake.data() : nullptr, m_AdaptiveActive ? m_SmoothingRadii.data() : nullptr);
+	m_NeighbourListBuilds++;
 }
 
-unsigned int ParticleFluid::HashCell(int2 cell)
+template<typename T>
+static void Permute(std::vector<T>& values, const std::vector<int>& order, std::vector<T>& scratch)
 {
-	unsigned int a = (unsigned int)cell.x * 15823;
-	unsigned int b = (unsigned int)cell.y * 9737333;
-	return a + b;
+	scratch.resize(values.size());
+	for (int i = 0; i < order.size(); i++)
+		scratch[i] = values[order[i]];
+	values.swap(scratch);
 }
 
-unsigned int ParticleFluid::GetKeyFromHash(unsigned int hash)
+template<int Dimension>
+void ParticleFluid<Dimension>::ReorderParticles()
 {
-	return hash % (unsigned int)m_SpatialLookup.size();
+	ST_PROFILE_FUNCTION();
+
+	if (m_Ordering == ParticleOrdering::CellKey)
+		m_SpatialLookup.GetCellKeyOrder(m_Order);
+	else
+		m_SpatialLookup.GetMortonOrder(GetPointers(m_Predicted), GetParticleCount(), m_Order);
+
+	// Only the state that is carried over between passes needs to move, the rest is recomputed
+	for (int axis = 0; axis < Dimension; axis++)
+	{
+		Permute(m_Position[axis], m_Order, m_ReorderScratch);
+		Permute(m_Velocity[axis], m_Order, m_ReorderScratch);
+		Permute(m_Predicted[axis], m_Order, m_ReorderScratch);
+	}
+
+	// The warm start values of DFSPH belong to the particles as well
+	Permute(m_DensityStiffness, m_Order, m_ReorderScratch);
+	Permute(m_DivergenceStiffness, m_Order, m_ReorderScratch);
+
+	// So do the densities of sleeping particles, which aren't recomputed, and the density changes that wake them
+	if (m_SleepingActive)
+	{
+		Permute(m_Densities, m_Order, m_ReorderScratch);
+		Permute(m_DensityChanges, m_Order, m_ReorderScratch);
+		Permute(m_Awake, m_Order, m_AwakeScratch);
+		CollectActiveParticles();
+	}
+
+	if (m_HasCoarseParticles)
+	{
+		Permute(m_Levels, m_Order, m_AwakeScratch);
+		if (m_AdaptiveActive)
+			UpdateParticleScales();
+	}
+
+	m_SpatialLookup.RemapIndices(m_Order);
 }
+
+template class ParticleFluid<2>;
+template class ParticleFluid<3>;
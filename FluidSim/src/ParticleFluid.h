@@ -1,61 +1,372 @@
 #pragma once
 
+#include "NeighbourList.h"
+#include "SIMD.h"
+#include "Simulation.h"
+#include "SmoothingKernel.h"
+#include "SnapshotWriter.h"
+#include "SpatialLookup.h"
+#include "ThreadPool.h"
+
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <array>
+#include <string>
 #include <vector>
 
-struct Particle
+struct NeighbourBatch;
+
+enum class ParticleOrdering
+{
+	None,
+	CellKey,	// Same order as the spatial lookup entries, neighbour reads within a cell become contiguous
+	Morton		// Z-order curve over the cells, also keeps neighbouring cells close together
+};
+
+enum class ParticleSolver
+{
+	SPH,	// Explicit pressure forces from the density error, needs small timesteps to stay incompressible
+	PBF,	// Position Based Fluids, iteratively moves the particles until the density constraints hold
+	DFSPH	// Divergence-free SPH, iterates implicit pressures until the density and divergence errors are small enough
+};
+
+enum class ForceEvaluation
+{
+	PerParticle,	// Every particle sums up its own neighbours, so every pair is evaluated twice
+	SymmetricPairs	// Every pair is evaluated once and applied to both particles with opposite signs
+};
+
+// Substeps of the last frame, min/max are the shortest and longest substep in seconds
+struct TimestepStats
+{
+	int Substeps = 0;
+	float SimulatedTime = 0.0f;
+	float MinTimestep = 0.0f;
+	float MaxTimestep = 0.0f;
+	bool Limited = false;	// Ran out of substeps, the rest of the frame's time was dropped
+};
+
+// Compression of the fluid, as the density above the rest density of the spawn grid
+struct DensityStats
 {
-	glm::vec2 Position;
-	glm::vec2 Velocity;
-	glm::vec4 Color;
+	float AverageCompression = 0.0f;
+	float MaxCompression = 0.0f;
 };
 
-struct Entry
+// Pressure solves of DFSPH during the last frame, the errors are the ones the last substep ended with
+struct PressureSolverStats
 {
-	int index;
-	unsigned int key;
+	int DensityIterations = 0;
+	int DivergenceIterations = 0;
+	float DensityError = 0.0f;		// Average density above the rest density, relative to it
+	float DivergenceError = 0.0f;	// Average relative density change over one substep
 };
 
-typedef glm::vec<2, int> int2;
+// Adds layers of particles across a line (a disc in 3D) of the radius, perpendicular to the direction.
+// Layers are one particle spacing apart, so the stream comes out with the spacing of the spawn grid
+template<int Dimension>
+struct ParticleEmitter
+{
+	glm::vec<Dimension, float> Position;
+	glm::vec<Dimension, float> Direction;
+	float Speed = 100.0f;
+	float Radius = 20.0f;
+	bool Enabled = true;
+	float Distance = 0.0f;	// Travelled since the last layer
+};
+
+// Removes every particle inside the circle or sphere
+template<int Dimension>
+struct ParticleSink
+{
+	glm::vec<Dimension, float> Position;
+	float Radius = 40.0f;
+	bool Enabled = true;
+};
+
+// Pair contributions of one chunk of particles, every chunk writes to its own copy so that
+// the chunks can run on different threads. Values are summed up and cleared afterwards.
+template<int Dimension>
+struct PairAccumulator
+{
+	std::vector<float> Values[Dimension];	// Scalars only use the first one
+	int Begin = 0, End = 0;	// Range of particles that were written to
 
+	void Add(int index, float value) { Values[0][index] += value; End = std::max(End, index + 1); }
+	void Add(int index, const glm::vec<Dimension, float>& value)
+	{
+		for (int axis = 0; axis < Dimension; axis++)
+			Values[axis][index] += value[axis];
+		End = std::max(End, index + 1);
+	}
+
+	// Subtracts lane of the per axis values
+	void Subtract(int index, const float (&values)[Dimension][SIMD::Width], int lane)
+	{
+		for (int axis = 0; axis < Dimension; axis++)
+			Values[axis][index] -= values[axis][lane];
+		End = std::max(End, index + 1);
+	}
+};
+
+// Particle fluid in 2D or 3D. The neighbour search, kernels and solvers are shared, only the
+// number of axes changes, so both are instantiated from the same code in ParticleFluid.cpp.
+// Gravity points down the y axis and the mouse acts in the z = 0 plane.
+template<int Dimension>
 class ParticleFluid
 {
 public:
+	static_assert(Dimension == 2 || Dimension == 3, "Only 2D and 3D fluids are supported");
+	using Vector = glm::vec<Dimension, float>;
+	using Cell = glm::vec<Dimension, int>;
+
 	ParticleFluid();
 	virtual ~ParticleFluid() = default;
 
-	void GenerateParticleGrid(int rows, int cols, float spacing);
+	// Block with counts[axis] particles along every axis
+	void GenerateParticleGrid(Cell counts, float spacing, Vector center = Vector(0.0f));
+	void ClearParticles();
+
+	// Size of the box around the origin that the particles are kept in
+	void SetBounds(Vector size) { m_BoundsSize = size; }
+	int GetParticleCount() const { return (int)m_Position[0].size(); }
+
+	// Every per particle array is allocated for the capacity up front, so adding and removing particles
+	// never reallocates. Emitters stop while the pool is full, GenerateParticleGrid grows it if needed
+	void SetCapacity(int capacity);
+	int GetCapacity() const { return m_Capacity; }
+	// Returns false when the pool is full
+	bool AddParticle(Vector position, Vector velocity);
+	// Moves the last particle into the slot, so the indices of all other particles stay the same
+	void RemoveParticle(int index);
+
+	// Applied once per Step, before the substeps
+	void AddEmitter(const ParticleEmitter<Dimension>& emitter) { m_Emitters.push_back(emitter); }
+	void AddSink(const ParticleSink<Dimension>& sink) { m_Sinks.push_back(sink); }
+	void ClearEmittersAndSinks() { m_Emitters.clear(); m_Sinks.clear(); }
+	void SetMultithreaded(bool multithreaded) { m_Multithreaded = multithreaded; }
+	void SetSolver(ParticleSolver solver) { m_Solver = solver; }
+	ParticleSolver GetSolver() const { return m_Solver; }
+	// Lets resting regions fall asleep, only used by the SPH solver
+	void SetSleeping(bool sleeping) { m_Sleeping = sleeping; }
+	// Lets calm regions far from the surface merge into fewer, heavier particles, only used by the SPH solver
+	void SetAdaptiveResolution(bool adaptive) { m_AdaptiveResolution = adaptive; }
+	// Particles that are awake, all of them unless sleeping
+	int GetActiveCount() const { return m_SleepingActive ? (int)m_ActiveParticles.size() : GetParticleCount(); }
+	DensityStats CalculateDensityStats() const;
 
-	void Step(glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt);
+	// Advances the simulation by dt of real time, in one or more substeps
+	void Step(const Sten::InputState& input, glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt);
+	const TimestepStats& GetTimestepStats() const { return m_TimestepStats; }
+	const PressureSolverStats& GetPressureSolverStats() const { return m_PressureStats; }
+
+	// Streams the positions, velocities and densities to a snapshot file after every Step, without waiting for the disk
+	bool StartRecording(const std::string& path, bool quantised);
+	void StopRecording() { m_Recorder.Close(); }
+	const SnapshotWriter& GetRecorder() const { return m_Recorder; }
+#ifndef FLUID_HEADLESS
 	void Render();
 	void OnImGuiRender();
+#endif
 private:
-	// Smoothing Functions
-	float SmoothingFunction(float dst);
-	float SmoothingFunctionDerivative(float dst);
-	float ViscositySmoothingFunction(float dst);
+	void Substep(Vector inputPos, float interactionStrength, float dt);
+	// Largest stable timestep for the velocities and accelerations of the last substep
+	float CalculateTimestep(float interactionStrength);
+
+	// Calls func with batches of SIMD::Width neighbours of the particle from the neighbour list
+	template<typename Func>
+	void ForEachNeighbourBatch(int particleIndex, Func&& func);
 
 	// Forces
-	glm::vec2 CalculatePressureForce(int particleIndex);
-	glm::vec2 CalculateExternalForces(const Particle& particle, glm::vec2 inputPos, float radius, float strength);
-	glm::vec2 CalculateViscosityForce(int targetIndex);
+	Vector CalculatePressureForce(int particleIndex);
+	Vector CalculateExternalForces(Vector position, Vector velocity, Vector inputPos, float radius, float strength);
+	Vector CalculateViscosityForce(int targetIndex);
+
+	// Symmetric pair versions, the particle only visits the neighbours with a higher index
+	void AccumulateDensityPairs(int particleIndex, PairAccumulator<Dimension>& accumulator);
+	void AccumulateForcePairs(int particleIndex, PairAccumulator<Dimension>& accumulator);
+
+	// Runs func(particleIndex, accumulator) over all particles and sums the accumulators into outputs,
+	// one array for each of the first Components values
+	template<int Components, typename Func>
+	void AccumulatePairs(float* const (&outputs)[Components], Func&& func);
+
+	// Position Based Fluids
+	void SolveDensityConstraints(float dt);
+	float CalculateConstraintLambda(int particleIndex);
+	Vector CalculatePositionCorrection(int particleIndex);
+	Vector CalculateXSPHViscosity(int particleIndex);
+	// Divergence-free SPH
+	void StepDivergenceFree(Vector inputPos, float interactionStrength, float dt);
+	void CalculateDensityFactor(int particleIndex);
+	float CalculateDensityChange(int particleIndex);
+	Vector CalculatePressureAcceleration(int particleIndex, const float* stiffness);
+	// Iterates until the average error is below tolerance, returns the number of iterations. The stiffness
+	// of every particle is summed up over the iterations, so it can warm start the next substep
+	int SolvePressure(std::vector<float>& stiffness, float dt, bool divergence, float tolerance, float& error);
+	void ApplyPressure(const float* stiffness, float scale);
+	void ResolveCollisions(int particleIndex, Vector halfBounds);
+
+	// Puts cells to sleep and wakes them up again, then collects the particles of the awake cells
+	void UpdateActivity(Vector inputPos, float interactionStrength);
+	void CollectActiveParticles();
+	// Index of the cell of a grid over the box, x is the fastest changing axis
+	int GetGridCell(Vector position, float cellSize, Cell gridSize) const;
+	// The passes of the SPH solver run over [0, GetActiveCount()), GetActiveParticle maps that to the particle index
+	int GetActiveParticle(int activeIndex) const { return m_SleepingActive ? m_ActiveParticles[activeIndex] : activeIndex; }
+	void WakeAll();
+
+	// Merges and splits particles towards the resolution their region needs, once per Step
+	void UpdateResolution(Vector inputPos, float interactionStrength);
+	void ComputeTargetLevels(Vector inputPos, float interactionStrength);
+	void MergeParticles();
+	void SplitParticles();
+	// Masses and smoothing radii of the particle levels
+	void UpdateParticleScales();
+	// Variable mass versions of the density and the viscosity and pressure acceleration, with the
+	// kernels scaled to the average smoothing radius of every pair so the forces stay symmetric
+	float CalculateAdaptiveDensity(int particleIndex);
+	Vector CalculateAdaptiveAcceleration(int particleIndex);
+	// Symmetric pairs assume the same mass and radius everywhere, and can't leave out sleeping particles
+	bool UseSymmetricPairs() const { return m_ForceEvaluation == ForceEvaluation::SymmetricPairs && !m_SleepingActive && !m_AdaptiveActive; }
+
+	// Emitters and sinks over dt of simulated time
+	void UpdateEmittersAndSinks(float dt);
+	void EmitLayer(const ParticleEmitter<Dimension>& emitter, Vector direction, float offset);
+
+	// Density of a particle in the middle of a square or cubic grid with the given spacing
+	float CalculateLatticeDensity(float spacing);
 
 	// Pressure calculations
-	float CalculateDensity(glm::vec2 samplePoint);
+	float CalculateDensity(int particleIndex);
 	float ConvertDensityToPressure(float density);
 	float CalculateSharedPressure(float d1, float d2);
 	
 	// Spatial Lookup
-	void UpdateSpatialLookup(const std::vector<glm::vec2>& positions);
-	int2 PositionToCellCoord(glm::vec2 point);
-	unsigned int HashCell(int2 cell);
-	unsigned int GetKeyFromHash(unsigned int hash);
+	void UpdateSpatialLookup();
+	void ReorderParticles();
+	void UpdateNeighbourList();
+
+	// Runs func over [0, count), split across the thread pool when multithreading is enabled
+	void ParallelFor(int count, RangeFunction func);
+
+	// One array per axis
+	using AxisVectors = std::array<std::vector<float>, Dimension>;
+	static Vector Load(const AxisVectors& arrays, int index);
+	static void Store(AxisVectors& arrays, int index, Vector value);
+	static AxisArrays<Dimension> GetPointers(const AxisVectors& arrays);
 private:
-	std::vector<Particle> m_Particles;
+	// Particle state, stored as separate arrays so the neighbour loops only touch what they use
+	AxisVectors m_Position;
+	AxisVectors m_Velocity;
+	AxisVectors m_Predicted;
+	AxisVectors m_Acceleration;
 	std::vector<float> m_Densities;
-	std::vector<Entry> m_SpatialLookup;
-	std::vector<unsigned int> m_StartIndices;
-	std::vector<glm::vec2> m_PredictedPositions;
+	int m_Capacity = 0;
+
+	std::vector<ParticleEmitter<Dimension>> m_Emitters;
+	std::vector<ParticleSink<Dimension>> m_Sinks;
+	float m_EmitterTime = 0.0f;				// Simulated by the last frame, the emitters catch up on it in the next one
+
+	SpatialLookup<Dimension> m_SpatialLookup;
+	SpatialSortMethod m_SortMethod = SpatialSortMethod::CountingSort;
+	SpatialIndexMode m_IndexMode = SpatialIndexMode::DenseGrid;
+
+	// Every m_ReorderInterval steps the particle arrays are permuted into m_Ordering
+	ParticleOrdering m_Ordering = ParticleOrdering::CellKey;
+	int m_ReorderInterval = 10;
+	uint32_t m_StepCount = 0;
+	std::vector<int> m_Order;
+	std::vector<float> m_ReorderScratch;
+
+	// Neighbours within smoothing radius + skin, only rebuilt once a particle could have moved into range.
+	// Without a skin it is rebuilt every step, which is cheaper for a fluid that moves this fast
+	NeighbourList<Dimension> m_NeighbourList;
+	float m_NeighbourSkin = 0.0f;
+	uint32_t m_NeighbourListBuilds = 0;
+	uint32_t m_LastReorderStep = 0;
+
+	// Sleeping, SPH only. The box is split into cells of twice the smoothing radius, a cell falls asleep once all of
+	// its particles stayed below both thresholds for m_SleepSteps substeps in a row. Sleeping particles keep their
+	// position and density and are skipped by every pass, the awake ones still see them as neighbours. A cell
+	// wakes up when it or one of the cells around it holds a particle that moves, or when the mouse reaches it
+	bool m_Sleeping = false;
+	bool m_SleepingActive = false;		// Sleeping is enabled and the solver supports it
+	float m_SleepSpeed = 30.0f;		// Explicit SPH keeps jittering at a few tens of pixels per second when at rest
+	float m_SleepDensityChange = 0.02f;	// Per substep, relative to the target density
+	int m_SleepSteps = 30;
+	Cell m_ActivityGridSize = Cell(0);
+	std::vector<uint16_t> m_QuietSteps;		// Per cell, asleep once it reaches m_SleepSteps
+	std::vector<uint8_t> m_DisturbedCells;
+	std::vector<int> m_ParticleCells;
+	std::vector<uint8_t> m_Awake, m_AwakeScratch;
+	std::vector<int> m_ActiveParticles;
+	std::vector<float> m_DensityChanges;
+
+	// Adaptive resolution, SPH only. A particle of level n stands in for 2^n particles of the base mass, with a
+	// smoothing radius that grows with its volume so it keeps about as many neighbours. Pairs of particles of the
+	// same level merge far from the surface and the mouse and split again close to them, one level per step
+	static constexpr int MaxParticleLevel = 6;
+	bool m_AdaptiveResolution = false;
+	bool m_AdaptiveActive = false;		// Adaptive resolution is enabled and the solver supports it
+	int m_MaxLevel = 2;
+	float m_SearchRadius = 0.0f;		// Largest smoothing radius of any particle
+	float m_ResolutionCellSize = 0.0f;
+	Cell m_ResolutionGridSize = Cell(0);
+	std::vector<uint8_t> m_Levels;
+	std::vector<uint8_t> m_OccupiedCells;
+	std::vector<uint8_t> m_TargetLevels;		// Per cell, the number of cells to the closest surface or mouse cell
+	std::vector<float> m_Masses;
+	std::vector<float> m_SmoothingRadii;
+	std::vector<int> m_MergedParticles;
+	std::vector<uint8_t> m_MergeFlags;
+	bool m_HasCoarseParticles = false;
+
+	ParticleSolver m_Solver = ParticleSolver::SPH;
+	ForceEvaluation m_ForceEvaluation = ForceEvaluation::SymmetricPairs;
+
+	// Position Based Fluids, the rest density is the one of the grid the particles were spawned in
+	int m_SolverIterations = 4;
+	float m_ConstraintRelaxation = 0.001f;	// Keeps the constraint steps bounded when a particle has few neighbours
+	float m_CorrectionFactor = 0.5f;		// Under-relaxation of the position corrections
+	float m_XSPHViscosity = 0.05f;
+	float m_ParticleSpacing = 7.0f;
+	float m_RestDensity = 0.0f;
+	std::vector<float> m_Lambdas;
+
+	// Divergence-free SPH, the rest density is shared with PBF
+	float m_DensityTolerance = 0.001f;
+	float m_DivergenceTolerance = 0.01f;
+	int m_MinPressureIterations = 2;
+	int m_MaxPressureIterations = 100;
+	bool m_DivergenceSolve = true;
+	bool m_WarmStart = true;
+	std::vector<float> m_DensityFactors;
+	std::vector<float> m_DensityStiffness, m_DivergenceStiffness;
+	std::vector<float> m_IterationStiffness;
+	std::vector<float> m_DensityErrors;
+	PressureSolverStats m_PressureStats;
+	std::vector<PairAccumulator<Dimension>> m_PairAccumulators;
+
+	// Timestep. The adaptive one follows the CFL condition dt <= C * h / v_max, together with
+	// dt <= F * sqrt(h / a_max) for the forces, and splits every frame into as many substeps as that needs
+	bool m_AdaptiveTimestep = true;
+	float m_FixedTimestep = 1.0f / 120.0f;
+	float m_TimeScale = 0.5f;				// Simulated seconds per real second
+	float m_MaxFrameTime = 1.0f / 30.0f;	// Longer frames, like the ones after a hitch, are clamped to this
+	float m_CourantNumber = 0.4f;
+	float m_ForceNumber = 0.25f;
+	float m_MinTimestep = 1.0f / 2000.0f;
+	float m_MaxTimestep = 1.0f / 60.0f;
+	int m_MaxSubsteps = 8;
+	float m_MaxSpeed = 0.0f;				// Of the last substep
+	float m_MaxAcceleration = 0.0f;
+	TimestepStats m_TimestepStats;
+	double m_Time = 0.0;					// Simulated since the start
+	float m_AverageSubsteps = 0.0f;
+	uint32_t m_LimitedFrames = 0;
+
+	Vector m_BoundsSize;
 	float m_SmoothingRadius = 11.0f;
 	float m_TargetDensity = 20.0f;
 	float m_PressureMultiplier = 200.0f;
@@ -64,6 +375,18 @@ private:
 	float m_ViscosityStrength = 1.0f;
 	float m_InteractionStrength = 300.0f;
 	float m_InteractionRadius = 300.0f;
+	bool m_Multithreaded = true;
+
+#ifndef FLUID_HEADLESS
+	std::vector<Sten::CircleInstance> m_CircleInstances;
+#endif
+
+	SnapshotWriter m_Recorder;
+	char m_RecordingPath[256] = "recording.fsnap";
+	bool m_QuantiseRecording = false;
+
+	// Used for the density, pressure and viscosity, the constants follow m_SmoothingRadius at the start of every step
+	SmoothingKernel<KernelType::Spiky, Dimension> m_Kernel;
 
 	//float m_SmoothingRadius = 30.0f;
 	//float m_TargetDensity = 2.0f;
@@ -73,4 +396,7 @@ private:
 	//float m_ViscosityStrength = 1.0f;
 	//float m_InteractionStrength = 300.0f;
 	//float m_InteractionRadius = 300.0f;
-};
\ No newline at end of file
+};
+
+using ParticleFluid2D = ParticleFluid<2>;
+using ParticleFluid3D = ParticleFluid<3>;
@@ -0,0 +1,71 @@
+#include "PhaseTimings.h"
+
+#include <cstring>
+
+static std::vector<PhaseTimings::Phase> s_Phases;
+
+void PhaseTimings::Add(const char* name, double millis)
+{
+	// Only a handful of phases, in the order they were first hit
+	for (Phase& phase : s_Phases)
+	{
+		if (strcmp(phase.Name.c_str(), name) == 0)
+		{
+			phase.TotalMillis += millis;
+			phase.Calls++;
+			return;
+		}
+	}
+
+	s_Phases.push_back({ name, millis, 1 });
+}
+
+void PhaseTimings::Reset()
+{
+	// The phases are kept with zeroed totals, timing the same scopes again doesn't allocate
+	for (Phase& phase : s_Phases)
+	{
+		phase.TotalMillis = 0.0;
+		phase.Calls = 0;
+	}
+}
+
+const std::vector<PhaseTimings::Phase>& PhaseTimings::GetPhases()
+{
+	return s_Phases;
+}
+
+std::string PhaseTimings::GetFunctionName(const char* signature)
+{
+	const char* end = strchr(signature, '(');
+	if (!end)
+		return signature;
+
+	// The name is the last word before the parameters, a return type can only have spaces inside its template arguments
+	const char* begin = end;
+	int depth = 0;
+	while (begin > signature)
+	{
+		char c = begin[-1];
+		if (c == '>')
+			depth++;
+		else if (c == '<')
+			depth--;
+		else if (c == ' ' && depth == 0)
+			break;
+		begin--;
+	}
+
+	std::string name;
+	depth = 0;
+	for (const char* c = begin; c < end; c++)
+	{
+		if (*c == '<')
+			depth++;
+		else if (*c == '>')
+			depth--;
+		else if (depth == 0)
+			name += *c;
+	}
+	return name;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Total time spent in every named profile scope. Headless builds route the ST_PROFILE macros here
+// instead of the engine's instrumentor, so benchmarks get a per phase breakdown of the solvers.
+// Scopes must only be opened on the thread that steps the simulation.
+class PhaseTimings
+{
+public:
+	struct Phase
+	{
+		std::string Name;
+		double TotalMillis = 0.0;
+		uint64_t Calls = 0;
+	};
+
+	static void Add(const char* name, double millis);
+	static void Reset();
+	// Phases that weren't hit since the last reset have zero calls
+	static const std::vector<Phase>& GetPhases();
+
+	// Class::Method out of a __PRETTY_FUNCTION__ or __FUNCSIG__, without the template arguments, return type and
+	// parameters. Those differ between compilers, this is the same everywhere
+	static std::string GetFunctionName(const char* signature);
+};
+
+class PhaseTimer
+{
+public:
+	PhaseTimer(const char* name)
+		: m_Name(name), m_Start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~PhaseTimer()
+	{
+		auto end = std::chrono::steady_clock::now();
+		PhaseTimings::Add(m_Name, std::chrono::duration<double, std::milli>(end - m_Start).count());
+	}
+private:
+	const char* m_Name;
+	std::chrono::steady_clock::time_point m_Start;
+};
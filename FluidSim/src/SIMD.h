@@ -0,0 +1,109 @@
+#pragma once
+
+#include <immintrin.h>
+
+// Thin wrapper around the x86 vector intrinsics used by the simulation kernels.
+// Uses 8 wide AVX2 registers when the compiler targets AVX2 and falls back to 4 wide SSE2 otherwise,
+// so the same kernel code runs on every x86_64 cpu.
+namespace SIMD
+{
+#if defined(__AVX2__)
+	constexpr int Width = 8;
+
+	using Float = __m256;
+	using Mask = __m256;
+	using Index = __m256i;
+
+	inline Float Set(float value) { return _mm256_set1_ps(value); }
+	inline Float Zero() { return _mm256_setzero_ps(); }
+	inline Float Load(const float* ptr) { return _mm256_loadu_ps(ptr); }
+	inline void Store(float* ptr, Float value) { _mm256_storeu_ps(ptr, value); }
+	inline Float Gather(const float* base, const int* indices) { return _mm256_i32gather_ps(base, _mm256_loadu_si256((const __m256i*)indices), 4); }
+	inline Float Gather(const float* base, Index indices) { return _mm256_i32gather_ps(base, indices, 4); }
+	// Rounds towards zero
+	inline Index ToIndex(Float value) { return _mm256_cvttps_epi32(value); }
+	inline Float ToFloat(Index value) { return _mm256_cvtepi32_ps(value); }
+
+	inline Float Add(Float a, Float b) { return _mm256_add_ps(a, b); }
+	inline Float Sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+	inline Float Mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+	inline Float Div(Float a, Float b) { return _mm256_div_ps(a, b); }
+	inline Float Min(Float a, Float b) { return _mm256_min_ps(a, b); }
+	inline Float Max(Float a, Float b) { return _mm256_max_ps(a, b); }
+	inline Float Sqrt(Float a) { return _mm256_sqrt_ps(a); }
+
+	inline Mask LessEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	inline Mask Less(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	inline Mask Equal(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	inline Mask EqualIndex(const int* indices, int value) { return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)indices), _mm256_set1_epi32(value))); }
+	inline Mask GreaterIndex(const int* indices, int value) { return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)indices), _mm256_set1_epi32(value))); }
+	inline Mask And(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+	inline Mask AndNot(Mask a, Mask b) { return _mm256_andnot_ps(a, b); } // ~a & b
+	// Lanes where the mask is set take a, the others take b
+	inline Float Select(Mask mask, Float a, Float b) { return _mm256_blendv_ps(b, a, mask); }
+	// Lanes where the mask is not set become zero
+	inline Float Keep(Mask mask, Float a) { return _mm256_and_ps(mask, a); }
+	inline bool Any(Mask mask) { return _mm256_movemask_ps(mask) != 0; }
+	// Mask with the first count lanes set
+	inline Mask FirstLanes(int count) { return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))); }
+
+	inline float ReduceAdd(Float value)
+	{
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+	}
+#else
+	constexpr int Width = 4;
+
+	using Float = __m128;
+	using Mask = __m128;
+	using Index = __m128i;
+
+	inline Float Set(float value) { return _mm_set1_ps(value); }
+	inline Float Zero() { return _mm_setzero_ps(); }
+	inline Float Load(const float* ptr) { return _mm_loadu_ps(ptr); }
+	inline void Store(float* ptr, Float value) { _mm_storeu_ps(ptr, value); }
+	inline Float Gather(const float* base, const int* indices) { return _mm_setr_ps(base[indices[0]], base[indices[1]], base[indices[2]], base[indices[3]]); }
+	inline Float Gather(const float* base, Index indices)
+	{
+		alignas(16) int lanes[4];
+		_mm_store_si128((__m128i*)lanes, indices);
+		return Gather(base, lanes);
+	}
+	// Rounds towards zero
+	inline Index ToIndex(Float value) { return _mm_cvttps_epi32(value); }
+	inline Float ToFloat(Index value) { return _mm_cvtepi32_ps(value); }
+
+	inline Float Add(Float a, Float b) { return _mm_add_ps(a, b); }
+	inline Float Sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+	inline Float Mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+	inline Float Div(Float a, Float b) { return _mm_div_ps(a, b); }
+	inline Float Min(Float a, Float b) { return _mm_min_ps(a, b); }
+	inline Float Max(Float a, Float b) { return _mm_max_ps(a, b); }
+	inline Float Sqrt(Float a) { return _mm_sqrt_ps(a); }
+
+	inline Mask LessEqual(Float a, Float b) { return _mm_cmple_ps(a, b); }
+	inline Mask Less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+	inline Mask Equal(Float a, Float b) { return _mm_cmpeq_ps(a, b); }
+	inline Mask EqualIndex(const int* indices, int value) { return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)indices), _mm_set1_epi32(value))); }
+	inline Mask GreaterIndex(const int* indices, int value) { return _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)indices), _mm_set1_epi32(value))); }
+	inline Mask And(Mask a, Mask b) { return _mm_and_ps(a, b); }
+	inline Mask AndNot(Mask a, Mask b) { return _mm_andnot_ps(a, b); } // ~a & b
+	// Lanes where the mask is set take a, the others take b
+	inline Float Select(Mask mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+	// Lanes where the mask is not set become zero
+	inline Float Keep(Mask mask, Float a) { return _mm_and_ps(mask, a); }
+	inline bool Any(Mask mask) { return _mm_movemask_ps(mask) != 0; }
+	// Mask with the first count lanes set
+	inline Mask FirstLanes(int count) { return _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(count), _mm_setr_epi32(0, 1, 2, 3))); }
+
+	inline float ReduceAdd(Float value)
+	{
+		__m128 sum = _mm_add_ps(value, _mm_movehl_ps(value, value));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+	}
+#endif
+}
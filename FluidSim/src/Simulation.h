@@ -0,0 +1,27 @@
+#pragma once
+
+// Common include of the simulations. Defining FLUID_HEADLESS builds them without the engine
+// (no window, renderer or ImGui), which is how FluidBench runs them. Input is passed in as a
+// Sten::InputState, which is plain data, and the profile scopes feed PhaseTimings instead of the instrumentor.
+#ifdef FLUID_HEADLESS
+	#include "PhaseTimings.h"
+	#include "Stengine/Core/InputState.h"
+
+	#include <glm/glm.hpp>
+	#include <algorithm>
+	#include <cmath>
+	#include <cstring>
+
+	#define ST_PROFILE_SCOPE(name) ::PhaseTimer timer##__LINE__(name)
+	// Functions are timed as Class::Method, which stays the same across compilers and parameter lists
+	#if defined(_MSC_VER)
+		#define ST_PROFILE_FUNCTION_NAME __FUNCSIG__
+	#else
+		#define ST_PROFILE_FUNCTION_NAME __PRETTY_FUNCTION__
+	#endif
+	#define ST_PROFILE_FUNCTION() static const std::string phaseName = ::PhaseTimings::GetFunctionName(ST_PROFILE_FUNCTION_NAME); \
+		ST_PROFILE_SCOPE(phaseName.c_str())
+#else
+	#include "stpch.h"
+	#include <Stengine.h>
+#endif
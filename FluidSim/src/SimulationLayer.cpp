@@ -50,21 +50,23 @@ namespace Sten
 				m_NavierStokesFluid.Resize(m_ViewportSize.x / m_NavierStokesFluid.GetScale(), m_ViewportSize.y / m_NavierStokesFluid.GetScale());
 		}
 
-		if (Input::IsMouseButtonPressed(Mouse::ButtonRight))
+		const InputState& input = Application::Get().GetInputState();
+
+		if (input.IsMouseButtonPressed(Mouse::ButtonRight))
 		{
 			if (m_ActiveFluid == NavierStokes)
 			{
-				glm::vec2 pos = (Input::GetMousePosition() - m_ViewportOffset - m_ViewportSize / 2.0f) / (float)m_NavierStokesFluid.GetScale() + glm::vec2{ m_NavierStokesFluid.GetWidth() / 2.0f, m_NavierStokesFluid.GetHeight() / 2.0f };
+				glm::vec2 pos = (input.MousePosition - m_ViewportOffset - m_ViewportSize / 2.0f) / (float)m_NavierStokesFluid.GetScale() + glm::vec2{ m_NavierStokesFluid.GetWidth() / 2.0f, m_NavierStokesFluid.GetHeight() / 2.0f };
 				m_NavierStokesFluid.AddDensity(pos.x, m_NavierStokesFluid.GetHeight() - pos.y, 5, 5.0f);
 			}
 		}
 
-		if (Input::IsMouseButtonPressed(Mouse::ButtonLeft))
+		if (input.IsMouseButtonPressed(Mouse::ButtonLeft))
 		{
 			if (m_ActiveFluid == NavierStokes)
 			{
 				static glm::vec2 prev = { 0, 0 };
-				glm::vec2 pos = (Input::GetMousePosition() - m_ViewportOffset - m_ViewportSize / 2.0f) / (float)m_NavierStokesFluid.GetScale() + glm::vec2{ m_NavierStokesFluid.GetWidth() / 2.0f, m_NavierStokesFluid.GetHeight() / 2.0f };
+				glm::vec2 pos = (input.MousePosition - m_ViewportOffset - m_ViewportSize / 2.0f) / (float)m_NavierStokesFluid.GetScale() + glm::vec2{ m_NavierStokesFluid.GetWidth() / 2.0f, m_NavierStokesFluid.GetHeight() / 2.0f };
 				glm::vec2 amount = (pos - prev);
 				m_NavierStokesFluid.AddVelocity(pos.x, m_NavierStokesFluid.GetHeight() - pos.y, 10, amount.x, -amount.y);
 				prev = pos;
@@ -74,9 +76,9 @@ namespace Sten
 		if (m_ActiveFluid == NavierStokes)
 			m_NavierStokesFluid.Step(ts);
 		else if (m_ActiveFluid == Particle)
-			m_ParticleFluid.Step(m_ViewportOffset, m_ViewportSize, ts);
+			m_ParticleFluid.Step(input, m_ViewportOffset, m_ViewportSize, ts);
 		else if (m_ActiveFluid == Verlet)
-			m_VerletIntegration.Step(m_ViewportOffset, m_ViewportSize, ts);
+			m_VerletIntegration.Step(input, m_ViewportOffset, m_ViewportSize, ts);
 
 		Renderer2D::ResetStats();
 		m_Framebuffer->Bind();
@@ -192,9 +194,27 @@ namespace Sten
 		{
 		case Key::N:
 			m_ActiveFluid = NavierStokes;
+			m_NavierStokesFluid.SetPressureSolver(PressureSolver::GaussSeidel);
+			break;
+		case Key::M:
+			m_ActiveFluid = NavierStokes;
+			m_NavierStokesFluid.SetPressureSolver(PressureSolver::Multigrid);
+			break;
+		case Key::C:
+			m_ActiveFluid = NavierStokes;
+			m_NavierStokesFluid.SetPressureSolver(PressureSolver::ConjugateGradient);
 			break;
 		case Key::P:
 			m_ActiveFluid = Particle;
+			m_ParticleFluid.SetSolver(ParticleSolver::SPH);
+			break;
+		case Key::B:
+			m_ActiveFluid = Particle;
+			m_ParticleFluid.SetSolver(ParticleSolver::PBF);
+			break;
+		case Key::D:
+			m_ActiveFluid = Particle;
+			m_ParticleFluid.SetSolver(ParticleSolver::DFSPH);
 			break;
 		case Key::V:
 			m_ActiveFluid = Verlet;
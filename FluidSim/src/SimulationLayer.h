@@ -28,7 +28,7 @@ namespace Sten
 		Ref<Framebuffer> m_Framebuffer;
 		Ref<OrthographicCamera> m_Camera;
 		NavierStokesFluid m_NavierStokesFluid;
-		ParticleFluid m_ParticleFluid;
+		ParticleFluid2D m_ParticleFluid;
 		VerletIntegration m_VerletIntegration;
 
 		enum
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "SIMD.h"
+
+#include <algorithm>
+
+enum class KernelType
+{
+	Spiky,		// (h - r)^2, keeps a steep slope at close range so the pressure still pushes overlapping particles apart
+	Poly6,		// (h^2 - r^2)^3, smooth everywhere and cheap since it only needs the squared distance
+	Viscosity	// Only used through its laplacian, which is proportional to h - r and so positive everywhere
+};
+
+// Smoothing kernel with its normalisation constants precomputed. They only depend on the radius and the
+// dimension, so they are recomputed when the radius changes instead of on every neighbour. The kernel type
+// is a template parameter, so the evaluations inline into the neighbour loops without any branches.
+template<KernelType Type, int Dimension>
+class SmoothingKernel
+{
+public:
+	static_assert(Dimension == 2 || Dimension == 3, "Kernels are normalised for 2D and 3D only");
+
+	void SetRadius(float radius)
+	{
+		if (radius == m_Radius)
+			return;
+
+		constexpr float pi = 3.14159265358979f;
+		float sqrRadius = radius * radius;
+		m_Radius = radius;
+		m_SqrRadius = sqrRadius;
+
+		// Integrals of the kernels over the circle or sphere of the radius, so that they sum up to one
+		if constexpr (Type == KernelType::Spiky && Dimension == 2)
+		{
+			float volume = pi * sqrRadius * sqrRadius;
+			m_ValueScale = 6.0f / volume;
+			m_DerivativeScale = 12.0f / volume;
+		}
+		else if constexpr (Type == KernelType::Spiky)
+		{
+			float volume = pi * sqrRadius * sqrRadius * radius;
+			m_ValueScale = 7.5f / volume;
+			m_DerivativeScale = 15.0f / volume;
+		}
+		else if constexpr (Type == KernelType::Poly6 && Dimension == 2)
+		{
+			float volume = pi * sqrRadius * sqrRadius * sqrRadius * sqrRadius;
+			m_ValueScale = 4.0f / volume;
+			m_DerivativeScale = 24.0f / volume;
+		}
+		else if constexpr (Type == KernelType::Poly6)
+		{
+			float volume = pi * sqrRadius * sqrRadius * sqrRadius * sqrRadius * radius;
+			m_ValueScale = 315.0f / (64.0f * volume);
+			m_DerivativeScale = 945.0f / (32.0f * volume);
+		}
+		else if constexpr (Dimension == 2)
+		{
+			m_LaplacianScale = 40.0f / (pi * sqrRadius * sqrRadius * radius);
+		}
+		else
+		{
+			m_LaplacianScale = 45.0f / (pi * sqrRadius * sqrRadius * sqrRadius);
+		}
+	}
+
+	float GetRadius() const { return m_Radius; }
+
+	float Value(float dst) const
+	{
+		static_assert(Type != KernelType::Viscosity, "The viscosity kernel is only used through its laplacian");
+		if constexpr (Type == KernelType::Spiky)
+		{
+			float value = std::max(m_Radius - dst, 0.0f);
+			return value * value * m_ValueScale;
+		}
+		else
+		{
+			float value = std::max(m_SqrRadius - dst * dst, 0.0f);
+			return value * value * value * m_ValueScale;
+		}
+	}
+
+	// Slope along the distance, negative inside the radius
+	float Derivative(float dst) const
+	{
+		static_assert(Type != KernelType::Viscosity, "The viscosity kernel is only used through its laplacian");
+		if constexpr (Type == KernelType::Spiky)
+		{
+			return std::min(dst - m_Radius, 0.0f) * m_DerivativeScale;
+		}
+		else
+		{
+			float value = std::max(m_SqrRadius - dst * dst, 0.0f);
+			return -dst * value * value * m_DerivativeScale;
+		}
+	}
+
+	float Laplacian(float dst) const
+	{
+		static_assert(Type == KernelType::Viscosity, "Only the viscosity kernel has a laplacian");
+		return std::max(m_Radius - dst, 0.0f) * m_LaplacianScale;
+	}
+
+	// SIMD::Width distances at once, lanes outside the radius are zero like the scalar versions
+
+	SIMD::Float Value(SIMD::Float dst) const
+	{
+		static_assert(Type != KernelType::Viscosity, "The viscosity kernel is only used through its laplacian");
+		if constexpr (Type == KernelType::Spiky)
+		{
+			SIMD::Float value = SIMD::Max(SIMD::Sub(SIMD::Set(m_Radius), dst), SIMD::Zero());
+			return SIMD::Mul(SIMD::Mul(value, value), SIMD::Set(m_ValueScale));
+		}
+		else
+		{
+			SIMD::Float value = SIMD::Max(SIMD::Sub(SIMD::Set(m_SqrRadius), SIMD::Mul(dst, dst)), SIMD::Zero());
+			return SIMD::Mul(SIMD::Mul(SIMD::Mul(value, value), value), SIMD::Set(m_ValueScale));
+		}
+	}
+
+	SIMD::Float Derivative(SIMD::Float dst) const
+	{
+		static_assert(Type != KernelType::Viscosity, "The viscosity kernel is only used through its laplacian");
+		if constexpr (Type == KernelType::Spiky)
+		{
+			SIMD::Float value = SIMD::Min(SIMD::Sub(dst, SIMD::Set(m_Radius)), SIMD::Zero());
+			return SIMD::Mul(value, SIMD::Set(m_DerivativeScale));
+		}
+		else
+		{
+			SIMD::Float value = SIMD::Max(SIMD::Sub(SIMD::Set(m_SqrRadius), SIMD::Mul(dst, dst)), SIMD::Zero());
+			return SIMD::Mul(SIMD::Mul(SIMD::Mul(value, value), dst), SIMD::Set(-m_DerivativeScale));
+		}
+	}
+
+	SIMD::Float Laplacian(SIMD::Float dst) const
+	{
+		static_assert(Type == KernelType::Viscosity, "Only the viscosity kernel has a laplacian");
+		SIMD::Float value = SIMD::Max(SIMD::Sub(SIMD::Set(m_Radius), dst), SIMD::Zero());
+		return SIMD::Mul(value, SIMD::Set(m_LaplacianScale));
+	}
+private:
+	float m_Radius = -1.0f;
+	float m_SqrRadius = 0.0f;
+	float m_ValueScale = 0.0f;
+	float m_DerivativeScale = 0.0f;
+	float m_LaplacianScale = 0.0f;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+
+// Layout of the particle snapshot files, in little endian. A file starts with a SnapshotFileHeader and is followed
+// by chunks, each starting with a SnapshotChunkHeader that holds its type and size, so readers can skip the types
+// they don't know. The header and every chunk are padded to SnapshotAlignment.
+// A frame chunk holds a SnapshotFrameHeader followed by one block for every stream of the file, in the order of
+// the stream bits. A block holds the values of all particles, as floats or, in quantised files, as 16 bit steps
+// between the frame's min and max of that stream, and is padded to the alignment so floats can be read in place.
+// Closing the file appends an index chunk with the offset of every frame and a footer pointing at it.
+
+static constexpr char SnapshotMagic[8] = { 'F', 'L', 'U', 'I', 'D', 'S', 'N', 'P' };
+static constexpr uint32_t SnapshotVersion = 1;
+static constexpr uint32_t SnapshotAlignment = 64;
+
+enum class SnapshotStream : uint32_t
+{
+	PositionX, PositionY, PositionZ,
+	VelocityX, VelocityY, VelocityZ,
+	Density,
+	Count
+};
+
+static constexpr int SnapshotStreamCount = (int)SnapshotStream::Count;
+
+constexpr uint32_t GetStreamBit(SnapshotStream stream) { return 1u << (uint32_t)stream; }
+
+enum SnapshotFlags : uint32_t
+{
+	SnapshotQuantised = 1 << 0
+};
+
+enum class SnapshotChunkType : uint32_t
+{
+	Frame = 1,
+	Index = 2
+};
+
+struct SnapshotFileHeader
+{
+	char Magic[8];
+	uint32_t Version;
+	uint32_t Dimension;
+	uint32_t Streams;	// Bits of the streams every frame holds
+	uint32_t Flags;
+};
+
+struct SnapshotChunkHeader
+{
+	uint32_t Type;
+	uint32_t Reserved;
+	uint64_t Size;		// Bytes after the chunk header, including the padding
+};
+
+struct SnapshotFrameHeader
+{
+	uint32_t FrameIndex;	// Counts the dropped frames too, so gaps show where the writer fell behind
+	uint32_t ParticleCount;
+	double Time;			// Simulated seconds
+	float Min[SnapshotStreamCount];		// Quantised value q decodes to Min + q * Scale
+	float Scale[SnapshotStreamCount];
+};
+
+// The index chunk holds the frame count followed by the file offset of every frame chunk
+struct SnapshotIndexHeader
+{
+	uint64_t FrameCount;
+};
+
+struct SnapshotFooter
+{
+	uint64_t IndexOffset;
+	char Magic[8];
+};
+
+constexpr uint64_t AlignSnapshotSize(uint64_t size) { return (size + SnapshotAlignment - 1) / SnapshotAlignment * SnapshotAlignment; }
+
+// Offset of the first chunk, and of the first block from the start of its frame chunk
+static constexpr uint64_t SnapshotFileHeaderSize = AlignSnapshotSize(sizeof(SnapshotFileHeader));
+static constexpr uint64_t SnapshotFrameHeaderSize = AlignSnapshotSize(sizeof(SnapshotChunkHeader) + sizeof(SnapshotFrameHeader));
+
+// Bytes of one stream block of a frame, with the padding
+constexpr uint64_t GetSnapshotBlockSize(uint32_t particleCount, uint32_t flags)
+{
+	return AlignSnapshotSize((uint64_t)particleCount * ((flags & SnapshotQuantised) ? sizeof(uint16_t) : sizeof(float)));
+}
+
+static_assert(sizeof(SnapshotFileHeader) == 24 && sizeof(SnapshotChunkHeader) == 16 && sizeof(SnapshotFrameHeader) == 72,
+	"The snapshot headers are written as they are laid out in memory");
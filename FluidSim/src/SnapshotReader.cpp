@@ -0,0 +1,230 @@
+#include "SnapshotReader.h"
+
+#include <cstring>
+
+#ifdef ST_PLATFORM_WINDOWS
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SnapshotReader::~SnapshotReader()
+{
+	Close();
+}
+
+bool SnapshotReader::Open(const std::string& path)
+{
+	Close();
+
+#ifdef ST_PLATFORM_WINDOWS
+	// Shared for writing, so a recording can be read while it is still going
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	m_FileHandle = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+
+	m_MappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m_MappingHandle)
+	{
+		Close();
+		return false;
+	}
+
+	m_Data = (const uint8_t*)MapViewOfFile(m_MappingHandle, FILE_MAP_READ, 0, 0, 0);
+	m_Size = (uint64_t)size.QuadPart;
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+
+	// The mapping keeps its own reference to the file
+	struct stat status;
+	void* data = MAP_FAILED;
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+		data = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+
+	if (data != MAP_FAILED)
+	{
+		m_Data = (const uint8_t*)data;
+		m_Size = (uint64_t)status.st_size;
+	}
+#endif
+
+	if (!m_Data || m_Size < SnapshotFileHeaderSize)
+	{
+		Close();
+		return false;
+	}
+
+	std::memcpy(&m_Header, m_Data, sizeof(m_Header));
+	bool valid = std::memcmp(m_Header.Magic, SnapshotMagic, sizeof(SnapshotMagic)) == 0 &&
+		m_Header.Version >= 1 && m_Header.Version <= SnapshotVersion &&
+		(m_Header.Dimension == 2 || m_Header.Dimension == 3);
+
+	if (!valid || !FindFrames())
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void SnapshotReader::Close()
+{
+#ifdef ST_PLATFORM_WINDOWS
+	if (m_Data)
+		UnmapViewOfFile(m_Data);
+	if (m_MappingHandle)
+		CloseHandle(m_MappingHandle);
+	if (m_FileHandle)
+		CloseHandle(m_FileHandle);
+	m_FileHandle = m_MappingHandle = nullptr;
+#else
+	if (m_Data)
+		munmap((void*)m_Data, (size_t)m_Size);
+#endif
+
+	m_Data = nullptr;
+	m_Size = 0;
+	m_Header = {};
+	m_Frames.clear();
+}
+
+const SnapshotFrameHeader& SnapshotReader::GetFrameHeader(int frame) const
+{
+	return *(const SnapshotFrameHeader*)(m_Data + m_Frames[frame] + sizeof(SnapshotChunkHeader));
+}
+
+const float* SnapshotReader::GetStream(int frame, SnapshotStream stream) const
+{
+	if (IsQuantised())
+		return nullptr;
+	return (const float*)GetBlock(frame, stream);
+}
+
+bool SnapshotReader::ReadStream(int frame, SnapshotStream stream, std::vector<float>& values) const
+{
+	const uint8_t* block = GetBlock(frame, stream);
+	if (!block)
+		return false;
+
+	const SnapshotFrameHeader& header = GetFrameHeader(frame);
+	uint32_t count = header.ParticleCount;
+	values.resize(count);
+
+	if (!IsQuantised())
+	{
+		std::memcpy(values.data(), block, count * sizeof(float));
+		return true;
+	}
+
+	const uint16_t* quantised = (const uint16_t*)block;
+	float min = header.Min[(int)stream];
+	float scale = header.Scale[(int)stream];
+	for (uint32_t i = 0; i < count; i++)
+		values[i] = min + quantised[i] * scale;
+	return true;
+}
+
+bool SnapshotReader::FindFrames()
+{
+	// The index of a closed file, as long as everything it points to holds up
+	if (m_Size >= SnapshotFileHeaderSize + sizeof(SnapshotFooter))
+	{
+		SnapshotFooter footer;
+		std::memcpy(&footer, m_Data + m_Size - sizeof(footer), sizeof(footer));
+
+		uint64_t indexStart = footer.IndexOffset + sizeof(SnapshotChunkHeader);
+		if (std::memcmp(footer.Magic, SnapshotMagic, sizeof(SnapshotMagic)) == 0 && footer.IndexOffset < m_Size &&
+			indexStart + sizeof(SnapshotIndexHeader) <= m_Size)
+		{
+			SnapshotChunkHeader chunk;
+			SnapshotIndexHeader index;
+			std::memcpy(&chunk, m_Data + footer.IndexOffset, sizeof(chunk));
+			std::memcpy(&index, m_Data + indexStart, sizeof(index));
+
+			uint64_t offsetsStart = indexStart + sizeof(index);
+			bool valid = chunk.Type == (uint32_t)SnapshotChunkType::Index &&
+				index.FrameCount <= (m_Size - offsetsStart) / sizeof(uint64_t);
+
+			if (valid)
+			{
+				m_Frames.resize(index.FrameCount);
+				std::memcpy(m_Frames.data(), m_Data + offsetsStart, index.FrameCount * sizeof(uint64_t));
+				for (uint64_t offset : m_Frames)
+					valid &= IsFrameChunk(offset);
+
+				if (valid)
+					return true;
+			}
+		}
+	}
+
+	// Otherwise every complete frame chunk up to the end, or up to where the writer stopped
+	m_Frames.clear();
+	uint64_t offset = SnapshotFileHeaderSize;
+	while (offset + sizeof(SnapshotChunkHeader) <= m_Size)
+	{
+		SnapshotChunkHeader chunk;
+		std::memcpy(&chunk, m_Data + offset, sizeof(chunk));
+		if (chunk.Size > m_Size - offset - sizeof(SnapshotChunkHeader))
+			break;
+
+		if (chunk.Type == (uint32_t)SnapshotChunkType::Frame)
+		{
+			if (!IsFrameChunk(offset))
+				break;
+			m_Frames.push_back(offset);
+		}
+		offset += sizeof(SnapshotChunkHeader) + chunk.Size;
+	}
+	return true;
+}
+
+bool SnapshotReader::IsFrameChunk(uint64_t offset) const
+{
+	if (offset % SnapshotAlignment != 0 || offset > m_Size || m_Size - offset < SnapshotFrameHeaderSize)
+		return false;
+
+	SnapshotChunkHeader chunk;
+	SnapshotFrameHeader frame;
+	std::memcpy(&chunk, m_Data + offset, sizeof(chunk));
+	std::memcpy(&frame, m_Data + offset + sizeof(chunk), sizeof(frame));
+
+	int streamCount = 0;
+	for (int stream = 0; stream < SnapshotStreamCount; stream++)
+		streamCount += (m_Header.Streams >> stream) & 1;
+
+	uint64_t size = SnapshotFrameHeaderSize - sizeof(SnapshotChunkHeader) + streamCount * GetSnapshotBlockSize(frame.ParticleCount, m_Header.Flags);
+	return chunk.Type == (uint32_t)SnapshotChunkType::Frame && chunk.Size >= size &&
+		chunk.Size <= m_Size - offset - sizeof(SnapshotChunkHeader);
+}
+
+const uint8_t* SnapshotReader::GetBlock(int frame, SnapshotStream stream) const
+{
+	if (!HasStream(stream))
+		return nullptr;
+
+	// Blocks are stored in the order of the stream bits
+	int blockIndex = 0;
+	for (int previous = 0; previous < (int)stream; previous++)
+		blockIndex += (m_Header.Streams >> previous) & 1;
+
+	uint64_t blockSize = GetSnapshotBlockSize(GetFrameHeader(frame).ParticleCount, m_Header.Flags);
+	return m_Data + m_Frames[frame] + SnapshotFrameHeaderSize + blockIndex * blockSize;
+}
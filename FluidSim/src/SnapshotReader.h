@@ -0,0 +1,51 @@
+#pragma once
+
+#include "SnapshotFormat.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Memory maps a snapshot file (see SnapshotFormat.h) for random access to its frames. The frames are found through
+// the index, or, in files that were never closed, by walking the chunks up to the last complete one.
+class SnapshotReader
+{
+public:
+	SnapshotReader() = default;
+	~SnapshotReader();
+
+	SnapshotReader(const SnapshotReader&) = delete;
+	SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+	// Returns false when the file can't be mapped or isn't a snapshot of a supported version
+	bool Open(const std::string& path);
+	void Close();
+	bool IsOpen() const { return m_Data != nullptr; }
+
+	int GetDimension() const { return (int)m_Header.Dimension; }
+	bool HasStream(SnapshotStream stream) const { return m_Header.Streams & GetStreamBit(stream); }
+	bool IsQuantised() const { return m_Header.Flags & SnapshotQuantised; }
+
+	int GetFrameCount() const { return (int)m_Frames.size(); }
+	const SnapshotFrameHeader& GetFrameHeader(int frame) const;
+
+	// Points into the mapping, so only works for files that aren't quantised. Null when the file doesn't hold the stream
+	const float* GetStream(int frame, SnapshotStream stream) const;
+	// Decodes quantised values, returns false when the file doesn't hold the stream
+	bool ReadStream(int frame, SnapshotStream stream, std::vector<float>& values) const;
+private:
+	bool FindFrames();
+	bool IsFrameChunk(uint64_t offset) const;
+	const uint8_t* GetBlock(int frame, SnapshotStream stream) const;
+private:
+	const uint8_t* m_Data = nullptr;
+	uint64_t m_Size = 0;
+#ifdef ST_PLATFORM_WINDOWS
+	void* m_FileHandle = nullptr;
+	void* m_MappingHandle = nullptr;
+#endif
+
+	SnapshotFileHeader m_Header = {};
+	std::vector<uint64_t> m_Frames;		// Offset of every frame chunk
+};
@@ -0,0 +1,249 @@
+#include "SnapshotWriter.h"
+
+#include <algorithm>
+#include <cstring>
+
+static int CountStreams(uint32_t streams)
+{
+	int count = 0;
+	for (int stream = 0; stream < SnapshotStreamCount; stream++)
+		count += (streams >> stream) & 1;
+	return count;
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	Close();
+}
+
+bool SnapshotWriter::Open(const std::string& path, int dimension, uint32_t streams, bool quantised, int bufferFrames)
+{
+	Close();
+
+	m_File = std::fopen(path.c_str(), "wb");
+	if (!m_File)
+		return false;
+
+	m_Streams = streams;
+	m_Flags = quantised ? (uint32_t)SnapshotQuantised : 0u;
+	m_Offset = 0;
+	m_Slots = std::vector<Slot>(std::max(bufferFrames, 1));
+	m_Head = m_Tail = m_Queued = 0;
+	m_FrameOffsets.clear();
+	m_FrameOffsets.reserve(1024);
+	m_SubmittedFrames = 0;
+	m_DroppedFrames = 0;
+	m_WrittenFrames = 0;
+	m_WrittenBytes = 0;
+	m_Failed = false;
+
+	uint8_t header[SnapshotFileHeaderSize] = {};
+	SnapshotFileHeader fileHeader;
+	std::memcpy(fileHeader.Magic, SnapshotMagic, sizeof(SnapshotMagic));
+	fileHeader.Version = SnapshotVersion;
+	fileHeader.Dimension = (uint32_t)dimension;
+	fileHeader.Streams = streams;
+	fileHeader.Flags = m_Flags;
+	std::memcpy(header, &fileHeader, sizeof(fileHeader));
+	Write(header, sizeof(header));
+
+	m_Running = true;
+	m_Thread = std::thread(&SnapshotWriter::WriterLoop, this);
+	return true;
+}
+
+void SnapshotWriter::Close()
+{
+	if (!m_File)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Running = false;
+	}
+	m_Condition.notify_one();
+	m_Thread.join();
+
+	// Without the index a reader has to walk the chunks, so it is only left out when the file is broken anyway
+	if (!HasFailed())
+	{
+		uint64_t indexOffset = m_Offset;
+		uint64_t indexSize = sizeof(SnapshotIndexHeader) + m_FrameOffsets.size() * sizeof(uint64_t);
+		uint64_t paddedSize = AlignSnapshotSize(sizeof(SnapshotChunkHeader) + indexSize) - sizeof(SnapshotChunkHeader);
+
+		SnapshotChunkHeader chunkHeader = { (uint32_t)SnapshotChunkType::Index, 0, paddedSize };
+		SnapshotIndexHeader indexHeader = { m_FrameOffsets.size() };
+		const uint8_t padding[SnapshotAlignment] = {};
+		SnapshotFooter footer;
+		footer.IndexOffset = indexOffset;
+		std::memcpy(footer.Magic, SnapshotMagic, sizeof(SnapshotMagic));
+
+		Write(&chunkHeader, sizeof(chunkHeader));
+		Write(&indexHeader, sizeof(indexHeader));
+		Write(m_FrameOffsets.data(), m_FrameOffsets.size() * sizeof(uint64_t));
+		Write(padding, paddedSize - indexSize);
+		Write(&footer, sizeof(footer));
+	}
+
+	std::fclose(m_File);
+	m_File = nullptr;
+}
+
+bool SnapshotWriter::SubmitFrame(int particleCount, double time, const float* const (&streams)[SnapshotStreamCount])
+{
+	if (!m_File)
+		return false;
+
+	uint32_t frameIndex = m_SubmittedFrames++;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (m_Queued == (int)m_Slots.size())
+		{
+			m_DroppedFrames++;
+			return false;
+		}
+	}
+
+	// The thread doesn't touch the head slot until it is queued
+	Slot& slot = m_Slots[m_Head];
+	slot.FrameIndex = frameIndex;
+	slot.ParticleCount = (uint32_t)particleCount;
+	slot.Time = time;
+	slot.Values.resize((size_t)CountStreams(m_Streams) * particleCount);
+
+	float* values = slot.Values.data();
+	for (int stream = 0; stream < SnapshotStreamCount; stream++)
+	{
+		if (m_Streams & GetStreamBit((SnapshotStream)stream))
+		{
+			std::copy(streams[stream], streams[stream] + particleCount, values);
+			values += particleCount;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Queued++;
+	}
+	m_Condition.notify_one();
+	m_Head = (m_Head + 1) % (int)m_Slots.size();
+	return true;
+}
+
+void SnapshotWriter::WriterLoop()
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Condition.wait(lock, [this]() { return m_Queued > 0 || !m_Running; });
+
+			// Close only stops the thread once everything that was submitted is written
+			if (m_Queued == 0)
+				return;
+		}
+
+		WriteFrame(m_Slots[m_Tail]);
+		m_Tail = (m_Tail + 1) % (int)m_Slots.size();
+
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Queued--;
+	}
+}
+
+void SnapshotWriter::WriteFrame(const Slot& slot)
+{
+	if (HasFailed())
+		return;
+
+	int streamCount = CountStreams(m_Streams);
+	uint32_t count = slot.ParticleCount;
+	uint64_t blockSize = GetSnapshotBlockSize(count, m_Flags);
+	bool quantised = m_Flags & SnapshotQuantised;
+
+	SnapshotFrameHeader frameHeader = {};
+	frameHeader.FrameIndex = slot.FrameIndex;
+	frameHeader.ParticleCount = count;
+	frameHeader.Time = slot.Time;
+
+	// Quantised values are spread over the range of their stream in this frame
+	if (quantised)
+	{
+		const float* values = slot.Values.data();
+		for (int stream = 0; stream < SnapshotStreamCount; stream++)
+		{
+			if (!(m_Streams & GetStreamBit((SnapshotStream)stream)))
+				continue;
+
+			float min = 0.0f, max = 0.0f;
+			if (count > 0)
+			{
+				auto range = std::minmax_element(values, values + count);
+				min = *range.first;
+				max = *range.second;
+			}
+			frameHeader.Min[stream] = min;
+			frameHeader.Scale[stream] = (max - min) / 65535.0f;
+			values += count;
+		}
+	}
+
+	SnapshotChunkHeader chunkHeader = { (uint32_t)SnapshotChunkType::Frame, 0,
+		SnapshotFrameHeaderSize - sizeof(SnapshotChunkHeader) + streamCount * blockSize };
+
+	uint8_t header[SnapshotFrameHeaderSize] = {};
+	std::memcpy(header, &chunkHeader, sizeof(chunkHeader));
+	std::memcpy(header + sizeof(chunkHeader), &frameHeader, sizeof(frameHeader));
+
+	uint64_t offset = m_Offset;
+	if (!Write(header, sizeof(header)))
+		return;
+
+	const uint8_t padding[SnapshotAlignment] = {};
+	const float* values = slot.Values.data();
+	for (int stream = 0; stream < SnapshotStreamCount; stream++)
+	{
+		if (!(m_Streams & GetStreamBit((SnapshotStream)stream)))
+			continue;
+
+		uint64_t size = (uint64_t)count * sizeof(float);
+		if (!quantised)
+		{
+			if (!Write(values, size))
+				return;
+		}
+		else
+		{
+			float min = frameHeader.Min[stream];
+			float inverseScale = frameHeader.Scale[stream] > 0.0f ? 1.0f / frameHeader.Scale[stream] : 0.0f;
+
+			m_Quantised.resize(count);
+			for (uint32_t i = 0; i < count; i++)
+				m_Quantised[i] = (uint16_t)std::min((values[i] - min) * inverseScale + 0.5f, 65535.0f);
+
+			size = (uint64_t)count * sizeof(uint16_t);
+			if (!Write(m_Quantised.data(), size))
+				return;
+		}
+
+		if (!Write(padding, blockSize - size))
+			return;
+		values += count;
+	}
+
+	m_FrameOffsets.push_back(offset);
+	m_WrittenFrames.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool SnapshotWriter::Write(const void* data, uint64_t size)
+{
+	if (size > 0 && std::fwrite(data, 1, (size_t)size, m_File) != size)
+	{
+		m_Failed = true;
+		return false;
+	}
+
+	m_Offset += size;
+	m_WrittenBytes.fetch_add(size, std::memory_order_relaxed);
+	return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "SnapshotFormat.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Streams frames into a snapshot file (see SnapshotFormat.h) from a background thread. SubmitFrame only copies
+// the particle arrays into a slot of a fixed ring buffer, the thread quantises and writes them, so the simulation
+// never waits for the disk. Once every slot is still waiting to be written, new frames are dropped instead.
+class SnapshotWriter
+{
+public:
+	SnapshotWriter() = default;
+	~SnapshotWriter();
+
+	SnapshotWriter(const SnapshotWriter&) = delete;
+	SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+	// Creates the file and starts the thread, streams is a mask of the stream bits every frame holds.
+	// Returns false when the file can't be created
+	bool Open(const std::string& path, int dimension, uint32_t streams, bool quantised, int bufferFrames = 4);
+	// Writes the frames that are still queued, then the index, and closes the file
+	void Close();
+	bool IsOpen() const { return m_File != nullptr; }
+
+	// Copies the streams of the file from their arrays of particleCount values, the others are ignored.
+	// Returns false when the frame was dropped
+	bool SubmitFrame(int particleCount, double time, const float* const (&streams)[SnapshotStreamCount]);
+
+	uint32_t GetWrittenFrames() const { return m_WrittenFrames.load(std::memory_order_relaxed); }
+	uint32_t GetDroppedFrames() const { return m_DroppedFrames; }
+	uint64_t GetWrittenBytes() const { return m_WrittenBytes.load(std::memory_order_relaxed); }
+	// A write failed, nothing after it made it into the file
+	bool HasFailed() const { return m_Failed.load(std::memory_order_relaxed); }
+private:
+	struct Slot
+	{
+		std::vector<float> Values;	// The streams of the file one after the other, particleCount values each
+		uint32_t FrameIndex = 0;
+		uint32_t ParticleCount = 0;
+		double Time = 0.0;
+	};
+
+	void WriterLoop();
+	void WriteFrame(const Slot& slot);
+	bool Write(const void* data, uint64_t size);
+private:
+	std::FILE* m_File = nullptr;
+	uint32_t m_Streams = 0;
+	uint32_t m_Flags = 0;
+	uint64_t m_Offset = 0;
+
+	// The producer fills m_Slots[m_Head], the thread writes m_Slots[m_Tail], m_Queued of them are waiting
+	std::vector<Slot> m_Slots;
+	int m_Head = 0;
+	int m_Tail = 0;
+	int m_Queued = 0;
+	bool m_Running = false;
+	std::mutex m_Mutex;
+	std::condition_variable m_Condition;
+	std::thread m_Thread;
+
+	// Only used by the thread
+	std::vector<uint64_t> m_FrameOffsets;
+	std::vector<uint16_t> m_Quantised;
+
+	uint32_t m_SubmittedFrames = 0;
+	uint32_t m_DroppedFrames = 0;
+	std::atomic<uint32_t> m_WrittenFrames = 0;
+	std::atomic<uint64_t> m_WrittenBytes = 0;
+	std::atomic<bool> m_Failed = false;
+};
@@ -0,0 +1,291 @@
+#include "SpatialLookup.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstdint>
+
+template<int Dimension>
+void SpatialLookup<Dimension>::Build(const AxisArrays<Dimension>& positions, int count, float cellSize, SpatialSortMethod method, ThreadPool* threadPool)
+{
+	m_CellSize = cellSize;
+	if (m_IndexMode == SpatialIndexMode::DenseGrid)
+	{
+		m_GridSize = glm::max(Cell(glm::ceil((m_BoundsMax - m_BoundsMin) / cellSize)), Cell(1));
+		m_TableSize = 1;
+		for (int axis = 0; axis < Dimension; axis++)
+			m_TableSize *= (unsigned int)m_GridSize[axis];
+	}
+	else
+	{
+		m_TableSize = (unsigned int)count;
+	}
+
+	m_Entries.resize(count);
+	m_Keys.resize(count);
+	m_Cells.resize(count);
+	m_CellOffsets.assign(m_TableSize + 2, 0);
+	m_Stats = {};
+
+	if (count == 0)
+		return;
+
+	ComputeKeys(positions, count, threadPool);
+
+	switch (method)
+	{
+	case SpatialSortMethod::CountingSort:
+		CountingSort();
+		break;
+	case SpatialSortMethod::StdSort:
+		StdSort();
+		break;
+	}
+
+	// The dense grid has one key per cell, so it can't collide
+	if (m_IndexMode == SpatialIndexMode::Hashed)
+		ComputeStats();
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::Reserve(int particleCount)
+{
+	m_Entries.reserve(particleCount);
+	m_Keys.reserve(particleCount);
+	m_Cells.reserve(particleCount);
+	m_Scratch.reserve(particleCount);
+	m_MortonCodes.reserve(particleCount);
+
+	// The hashed table has one slot per particle, the dense grid only depends on the bounds
+	m_CellOffsets.reserve(std::max((size_t)particleCount + 2, m_CellOffsets.capacity()));
+}
+
+template<int Dimension>
+typename SpatialLookup<Dimension>::Cell SpatialLookup<Dimension>::PositionToCellCoord(Vector point) const
+{
+	if (m_IndexMode == SpatialIndexMode::DenseGrid)
+	{
+		Cell cell = Cell(glm::floor((point - m_BoundsMin) / m_CellSize));
+		return glm::clamp(cell, Cell(0), m_GridSize - 1);
+	}
+
+	// Truncated towards zero, like the original lookup
+	return Cell(point / m_CellSize);
+}
+
+template<int Dimension>
+unsigned int SpatialLookup<Dimension>::HashCell(Cell cell) const
+{
+	const unsigned int primes[] = { 15823, 9737333, 440817757 };
+
+	unsigned int hash = 0;
+	for (int axis = 0; axis < Dimension; axis++)
+		hash += (unsigned int)cell[axis] * primes[axis];
+	return hash;
+}
+
+template<int Dimension>
+unsigned int SpatialLookup<Dimension>::GetKeyFromHash(unsigned int hash) const
+{
+	return hash % m_TableSize;
+}
+
+template<int Dimension>
+unsigned int SpatialLookup<Dimension>::GetCellKey(Cell cell) const
+{
+	if (m_IndexMode == SpatialIndexMode::Hashed)
+		return GetKeyFromHash(HashCell(cell));
+
+	// Cells outside of the grid map to the empty slot, x is the fastest changing axis
+	unsigned int key = 0;
+	for (int axis = Dimension - 1; axis >= 0; axis--)
+	{
+		if (cell[axis] < 0 || cell[axis] >= m_GridSize[axis])
+			return m_TableSize;
+		key = key * (unsigned int)m_GridSize[axis] + (unsigned int)cell[axis];
+	}
+	return key;
+}
+
+template<int Dimension>
+int SpatialLookup<Dimension>::GetNeighbourhoodKeys(Cell cell, unsigned int (&keys)[NeighbourhoodSize]) const
+{
+	int keyCount = 0;
+	for (int neighbour = 0; neighbour < NeighbourhoodSize; neighbour++)
+	{
+		// Offsets of -1, 0 and 1 along every axis, the last axis changes fastest
+		Cell offset;
+		int digits = neighbour;
+		for (int axis = Dimension - 1; axis >= 0; axis--)
+		{
+			offset[axis] = digits % 3 - 1;
+			digits /= 3;
+		}
+
+		// Two of the cells can hash to the same key, their particles must only be visited once
+		unsigned int key = GetCellKey(cell + offset);
+		bool visited = false;
+		for (int i = 0; i < keyCount; i++)
+			visited |= keys[i] == key;
+		if (!visited)
+			keys[keyCount++] = key;
+	}
+	return keyCount;
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::GetCellKeyOrder(std::vector<int>& order) const
+{
+	order.resize(m_Entries.size());
+	for (int i = 0; i < m_Entries.size(); i++)
+		order[i] = m_Entries[i].index;
+}
+
+// Spreads the lower 16 bits out over the even bits
+static uint32_t SpreadBits(uint32_t value)
+{
+	value &= 0x0000ffff;
+	value = (value | (value << 8)) & 0x00ff00ff;
+	value = (value | (value << 4)) & 0x0f0f0f0f;
+	value = (value | (value << 2)) & 0x33333333;
+	value = (value | (value << 1)) & 0x55555555;
+	return value;
+}
+
+// Spreads the lower 10 bits out over every third bit
+static uint32_t SpreadBits3(uint32_t value)
+{
+	value &= 0x000003ff;
+	value = (value | (value << 16)) & 0x030000ff;
+	value = (value | (value << 8)) & 0x0300f00f;
+	value = (value | (value << 4)) & 0x030c30c3;
+	value = (value | (value << 2)) & 0x09249249;
+	return value;
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::GetMortonOrder(const AxisArrays<Dimension>& positions, int count, std::vector<int>& order) const
+{
+	std::vector<std::pair<uint32_t, int>>& codes = m_MortonCodes;
+	codes.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		// Offset the cells so that the origin sits in the middle of the bit range of every axis
+		Cell cell = PositionToCellCoord(LoadPosition<Dimension>(positions, i));
+		if constexpr (Dimension == 2)
+		{
+			cell += 32768;
+			codes[i] = { SpreadBits(cell.x) | (SpreadBits(cell.y) << 1), i };
+		}
+		else
+		{
+			cell += 512;
+			codes[i] = { SpreadBits3(cell.x) | (SpreadBits3(cell.y) << 1) | (SpreadBits3(cell.z) << 2), i };
+		}
+	}
+
+	std::sort(codes.begin(), codes.end());
+
+	order.resize(count);
+	for (int i = 0; i < count; i++)
+		order[i] = codes[i].second;
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::RemapIndices(const std::vector<int>& order)
+{
+	// order maps new indices to old ones, the entries need the inverse
+	m_Scratch.resize(order.size());
+	for (int i = 0; i < order.size(); i++)
+		m_Scratch[order[i]] = i;
+
+	for (Entry& entry : m_Entries)
+		entry.index = m_Scratch[entry.index];
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::ComputeKeys(const AxisArrays<Dimension>& positions, int count, ThreadPool* threadPool)
+{
+	auto computeKeys = [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			m_Cells[i] = PositionToCellCoord(LoadPosition<Dimension>(positions, i));
+			m_Keys[i] = GetCellKey(m_Cells[i]);
+		}
+	};
+
+	if (threadPool)
+		threadPool->ParallelFor(count, computeKeys, 4096);
+	else
+		computeKeys(0, count);
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::CountingSort()
+{
+	int count = (int)m_Keys.size();
+
+	// Histogram of the keys, turned into the start offset of every key
+	for (int i = 0; i < count; i++)
+		m_CellOffsets[m_Keys[i]]++;
+
+	int offset = 0;
+	for (unsigned int key = 0; key <= m_TableSize; key++)
+	{
+		int keyCount = m_CellOffsets[key];
+		m_CellOffsets[key] = offset;
+		offset += keyCount;
+	}
+
+	// Scatter the entries into place, this advances every offset to the end of its key
+	for (int i = 0; i < count; i++)
+		m_Entries[m_CellOffsets[m_Keys[i]]++] = { i, m_Keys[i] };
+
+	// Which is the start of the next key, so shift everything back by one
+	for (unsigned int key = m_TableSize + 1; key > 0; key--)
+		m_CellOffsets[key] = m_CellOffsets[key - 1];
+	m_CellOffsets[0] = 0;
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::StdSort()
+{
+	int count = (int)m_Keys.size();
+
+	for (int i = 0; i < count; i++)
+	{
+		m_Entries[i] = { i, m_Keys[i] };
+		m_CellOffsets[m_Keys[i] + 1]++;
+	}
+
+	std::sort(m_Entries.begin(), m_Entries.end(), [](const Entry& entry1, const Entry& entry2) { return entry1.key < entry2.key; });
+
+	for (unsigned int key = 0; key <= m_TableSize; key++)
+		m_CellOffsets[key + 1] += m_CellOffsets[key];
+}
+
+template<int Dimension>
+void SpatialLookup<Dimension>::ComputeStats()
+{
+	int count = (int)m_Entries.size();
+	for (int start = 0; start < count;)
+	{
+		int end = GetCellEnd(m_Entries[start].key);
+		Cell cell = m_Cells[m_Entries[start].index];
+
+		int foreign = 0;
+		for (int i = start + 1; i < end; i++)
+			foreign += m_Cells[m_Entries[i].index] != cell;
+
+		m_Stats.OccupiedKeys++;
+		if (foreign > 0)
+		{
+			m_Stats.CollidingKeys++;
+			m_Stats.CollidingParticles += foreign;
+		}
+		start = end;
+	}
+}
+
+template class SpatialLookup<2>;
+template class SpatialLookup<3>;
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class ThreadPool;
+
+struct Entry
+{
+	int index;
+	unsigned int key;
+};
+
+typedef glm::vec<2, int> int2;
+typedef glm::vec<3, int> int3;
+
+// The particle positions are stored as one array per axis, these point at them
+template<int Dimension>
+using AxisArrays = std::array<const float*, Dimension>;
+
+template<int Dimension>
+inline glm::vec<Dimension, float> LoadPosition(const AxisArrays<Dimension>& positions, int index)
+{
+	glm::vec<Dimension, float> position;
+	for (int axis = 0; axis < Dimension; axis++)
+		position[axis] = positions[axis][index];
+	return position;
+}
+
+enum class SpatialSortMethod
+{
+	CountingSort,	// Two linear passes, the keys are bounded by the table size
+	StdSort			// Comparison sort on the keys, kept for reference and benchmarking
+};
+
+enum class SpatialIndexMode
+{
+	Hashed,		// Cells are hashed into a table with one slot per particle, works for any domain
+	DenseGrid	// One slot per cell of the grid bounds, exact cell ranges without any collisions
+};
+
+// Per build statistics of how well the keys separate the cells
+struct SpatialLookupStats
+{
+	int OccupiedKeys = 0;
+	int CollidingKeys = 0;		// Keys that hold particles of more than one cell
+	int CollidingParticles = 0;	// Particles stored under a key together with particles of another cell
+};
+
+// Groups particles by the cell they are in, either through a spatial hash or a dense grid over fixed bounds.
+// After Build the entries are sorted by key and every key maps to the range of entries [start, end) that share it.
+// Instantiated for 2D and 3D, the cells are squares or cubes.
+template<int Dimension>
+class SpatialLookup
+{
+public:
+	using Vector = glm::vec<Dimension, float>;
+	using Cell = glm::vec<Dimension, int>;
+
+	// Number of cells in the neighbourhood of a cell, including itself
+	static constexpr int NeighbourhoodSize = Dimension == 2 ? 9 : 27;
+
+	void Build(const AxisArrays<Dimension>& positions, int count, float cellSize,
+		SpatialSortMethod method = SpatialSortMethod::CountingSort, ThreadPool* threadPool = nullptr);
+	// Allocates the per particle arrays up front, builds of up to particleCount particles don't allocate anymore
+	void Reserve(int particleCount);
+
+	// Particles outside of the grid bounds are stored in the closest border cell
+	void SetIndexMode(SpatialIndexMode mode) { m_IndexMode = mode; }
+	void SetGridBounds(Vector boundsMin, Vector boundsMax) { m_BoundsMin = boundsMin; m_BoundsMax = boundsMax; }
+	SpatialIndexMode GetIndexMode() const { return m_IndexMode; }
+
+	Cell PositionToCellCoord(Vector point) const;
+	unsigned int HashCell(Cell cell) const;
+	unsigned int GetKeyFromHash(unsigned int hash) const;
+	unsigned int GetCellKey(Cell cell) const;
+
+	// Keys of the cells around cell, with the ones that appear more than once removed. Returns the number of keys
+	int GetNeighbourhoodKeys(Cell cell, unsigned int (&keys)[NeighbourhoodSize]) const;
+
+	// Range of entries that share the key, empty when no particle hashed to it
+	int GetCellStart(unsigned int key) const { return m_CellOffsets[key]; }
+	int GetCellEnd(unsigned int key) const { return m_CellOffsets[key + 1]; }
+
+	const std::vector<Entry>& GetEntries() const { return m_Entries; }
+	int GetSize() const { return (int)m_Entries.size(); }
+	const SpatialLookupStats& GetStats() const { return m_Stats; }
+
+	// Particle orders that place particles of the same or nearby cells next to each other in memory,
+	// order[i] is the current index of the particle that should be stored at index i
+	void GetCellKeyOrder(std::vector<int>& order) const;
+	void GetMortonOrder(const AxisArrays<Dimension>& positions, int count, std::vector<int>& order) const;
+
+	// Updates the entries after the particle arrays have been permuted with order
+	void RemapIndices(const std::vector<int>& order);
+private:
+	void ComputeKeys(const AxisArrays<Dimension>& positions, int count, ThreadPool* threadPool);
+	void CountingSort();
+	void StdSort();
+	void ComputeStats();
+private:
+	float m_CellSize = 1.0f;
+	SpatialIndexMode m_IndexMode = SpatialIndexMode::Hashed;
+	Vector m_BoundsMin = Vector(0.0f);
+	Vector m_BoundsMax = Vector(0.0f);
+	Cell m_GridSize = Cell(0);
+	unsigned int m_TableSize = 0;	// Number of valid keys, key m_TableSize is an always empty slot
+
+	std::vector<Entry> m_Entries;
+	std::vector<unsigned int> m_Keys;
+	std::vector<Cell> m_Cells;
+	std::vector<int> m_CellOffsets;	// Table size + 2 prefix sums of the entries per key
+	std::vector<int> m_Scratch;
+	mutable std::vector<std::pair<uint32_t, int>> m_MortonCodes;	// Scratch of GetMortonOrder
+	SpatialLookupStats m_Stats;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <algorithm>
+#include <array>
+
+// Colour ramp of the particles, from blue when at rest through cyan, teal, yellow and orange to red at the max speed.
+// It is sampled into a table once, so colouring a particle while rendering only costs a lookup.
+class SpeedColorMap
+{
+public:
+	static constexpr int Size = 256;
+
+	// Speeds past maxSpeed get the colour of maxSpeed
+	glm::vec4 Map(float speed, float maxSpeed) const { return m_Colors[GetIndex(speed, maxSpeed)]; }
+	// As RGBA8, for Renderer2D::DrawCircles
+	uint32_t MapPacked(float speed, float maxSpeed) const { return m_PackedColors[GetIndex(speed, maxSpeed)]; }
+
+	// Shared by all simulations
+	static const SpeedColorMap& Get()
+	{
+		static SpeedColorMap s_Instance;
+		return s_Instance;
+	}
+private:
+	SpeedColorMap()
+	{
+		const glm::vec3 colors[] = {
+			{ 0.0f, 0.0f, 1.0f },	// Blue
+			{ 0.0f, 1.0f, 1.0f },	// Cyan
+			{ 0.0f, 0.5f, 1.0f },	// Teal
+			{ 1.0f, 1.0f, 0.0f },	// Yellow
+			{ 1.0f, 0.5f, 0.0f },	// Orange
+			{ 1.0f, 0.0f, 0.0f }	// Red
+		};
+
+		// Evenly spaced stops, linearly interpolated in between
+		const int segments = (int)std::size(colors) - 1;
+		for (int i = 0; i < Size; i++)
+		{
+			float position = (float)i / (Size - 1) * segments;
+			int segment = std::min((int)position, segments - 1);
+			m_Colors[i] = { glm::mix(colors[segment], colors[segment + 1], position - segment), 1.0f };
+			m_PackedColors[i] = glm::packUnorm4x8(m_Colors[i]);
+		}
+	}
+
+	static int GetIndex(float speed, float maxSpeed)
+	{
+		int index = (int)std::min(speed / maxSpeed * (Size - 1) + 0.5f, (float)(Size - 1));
+		return std::max(index, 0);
+	}
+private:
+	std::array<glm::vec4, Size> m_Colors;
+	std::array<uint32_t, Size> m_PackedColors;
+};
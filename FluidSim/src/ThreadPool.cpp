@@ -0,0 +1,100 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+{
+	// The calling thread always takes part in the work, so it counts as one of the threads
+	uint32_t workerCount = std::max(threadCount, 1u) - 1;
+	m_Workers.reserve(workerCount);
+	for (uint32_t i = 0; i < workerCount; i++)
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Running = false;
+	}
+	m_WorkCondition.notify_all();
+
+	for (std::thread& worker : m_Workers)
+		worker.join();
+}
+
+void ThreadPool::ParallelFor(int count, RangeFunction func, int grainSize)
+{
+	if (count <= 0)
+		return;
+
+	// A few chunks per thread so that uneven ranges (dense regions of fluid) still balance out
+	int chunkCount = std::min((count + grainSize - 1) / std::max(grainSize, 1), (int)GetThreadCount() * 4);
+	if (m_Workers.empty() || chunkCount <= 1)
+	{
+		func(0, count);
+		return;
+	}
+
+	std::lock_guard<std::mutex> dispatchLock(m_DispatchMutex);
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Job = &func;
+		m_JobSize = count;
+		m_ChunkCount = chunkCount;
+		m_NextChunk = 0;
+		m_ActiveWorkers = (uint32_t)m_Workers.size();
+		m_Generation++;
+	}
+	m_WorkCondition.notify_all();
+
+	RunChunks();
+
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_DoneCondition.wait(lock, [this]() { return m_ActiveWorkers == 0; });
+	m_Job = nullptr;
+}
+
+ThreadPool& ThreadPool::Get()
+{
+	static ThreadPool s_Instance;
+	return s_Instance;
+}
+
+void ThreadPool::WorkerLoop()
+{
+	uint64_t generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_WorkCondition.wait(lock, [&]() { return !m_Running || m_Generation != generation; });
+			if (!m_Running)
+				return;
+
+			generation = m_Generation;
+		}
+
+		RunChunks();
+
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			if (--m_ActiveWorkers == 0)
+				m_DoneCondition.notify_one();
+		}
+	}
+}
+
+void ThreadPool::RunChunks()
+{
+	while (true)
+	{
+		int chunk = m_NextChunk.fetch_add(1);
+		if (chunk >= m_ChunkCount)
+			break;
+
+		int begin = (int)((int64_t)m_JobSize * chunk / m_ChunkCount);
+		int end = (int)((int64_t)m_JobSize * (chunk + 1) / m_ChunkCount);
+		(*m_Job)(begin, end);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Non-owning reference to a callable taking (begin, end). Unlike std::function it never allocates,
+// the callable only has to outlive the call it is passed to, which a lambda argument always does.
+class RangeFunction
+{
+public:
+	template<typename Func, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Func>, RangeFunction>>>
+	RangeFunction(Func&& func)
+		: m_Object((void*)&func), m_Call([](void* object, int begin, int end) { (*(std::remove_reference_t<Func>*)object)(begin, end); })
+	{
+	}
+
+	void operator()(int begin, int end) const { m_Call(m_Object, begin, end); }
+private:
+	void* m_Object;
+	void (*m_Call)(void* object, int begin, int end);
+};
+
+// A fixed set of worker threads that the simulations use to split their per-element passes.
+// ParallelFor blocks until the whole range has been processed, so consecutive calls act as a
+// barrier between passes. It must not be called recursively from inside a job.
+class ThreadPool
+{
+public:
+	ThreadPool(uint32_t threadCount = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Calls func(begin, end) on contiguous sub ranges of [0, count) spread over all threads,
+	// ranges are never smaller than grainSize (except for the last one).
+	void ParallelFor(int count, RangeFunction func, int grainSize = 256);
+
+	uint32_t GetThreadCount() const { return (uint32_t)m_Workers.size() + 1; }
+
+	static ThreadPool& Get();
+private:
+	void WorkerLoop();
+	void RunChunks();
+private:
+	std::vector<std::thread> m_Workers;
+
+	std::mutex m_DispatchMutex;
+	std::mutex m_Mutex;
+	std::condition_variable m_WorkCondition;
+	std::condition_variable m_DoneCondition;
+
+	const RangeFunction* m_Job = nullptr;
+	int m_JobSize = 0;
+	int m_ChunkCount = 0;
+	std::atomic<int> m_NextChunk = 0;
+	uint32_t m_ActiveWorkers = 0;
+	uint64_t m_Generation = 0;
+	bool m_Running = true;
+};
@@ -1,6 +1,5 @@
 #include "VerletIntegration.h"
-
-glm::vec4 MapSpeedToColor(const glm::vec2& velocity, float maxSpeed);
+#include "SpeedColorMap.h"
 
 VerletIntegration::VerletIntegration()
 {
@@ -16,8 +15,10 @@ VerletIntegration::VerletIntegration()
 	}
 }
 
-void VerletIntegration::Step(glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt)
+void VerletIntegration::Step(const Sten::InputState& input, glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt)
 {
+	ApplyInput(input, viewportOffset, viewportSize);
+
 	m_FrameDt = 1.0f/165.0f;
 	m_Time += m_FrameDt;
 
@@ -30,37 +31,47 @@ void VerletIntegration::Step(glm::vec2 viewportOffset, glm::vec2 viewportSize, f
 	}
 }
 
+#ifndef FLUID_HEADLESS
 void VerletIntegration::Render(glm::vec2 viewportOffset, glm::vec2 viewportSize)
 {
-	if (Sten::Input::IsMouseButtonPressed(Sten::Mouse::ButtonLeft))
+	if (m_InputActive)
 	{
-		glm::vec2 pos = Sten::Input::GetMousePosition() - viewportOffset - viewportSize / 2.0f;
-		glm::mat4 transform = glm::translate(glm::mat4(1.0f), { pos.x, -pos.y, 0.0f })
+		glm::mat4 transform = glm::translate(glm::mat4(1.0f), { m_InputPosition.x, -m_InputPosition.y, 0.0f })
 			* glm::scale(glm::mat4(1.0f), { 10, 10, 1.0f });
 		Sten::Renderer2D::DrawCircle({ transform });
-
-		for (VerletObject& obj : m_Objects)
-		{
-			glm::vec2 diff = pos - obj.Position;
-			float dist2 = diff.x * diff.x + diff.y * diff.y;
-			if (dist2 < 10000)
-			{
-				obj.addVelocity(diff / 5.0f, 1.0f/165.0f);
-			}
-		}
 	}
 
-	for (VerletObject& obj : m_Objects)
+	const SpeedColorMap& colorMap = SpeedColorMap::Get();
+	m_CircleInstances.resize(m_Objects.size());
+	for (size_t i = 0; i < m_Objects.size(); i++)
 	{
-		glm::mat4 transform = glm::translate(glm::mat4(1.0f), { obj.Position.x, -obj.Position.y, 0.0f })
-			* glm::scale(glm::mat4(1.0f), { obj.Radius * 2.0f, obj.Radius * 2.0f, 1.0f });
-		glm::vec4 color = MapSpeedToColor(obj.getVelocity(m_FrameDt), 50.0f);
-		Sten::Renderer2D::DrawCircle({ transform, color });
+		const VerletObject& obj = m_Objects[i];
+		m_CircleInstances[i] = { { obj.Position.x, -obj.Position.y, 0.0f }, obj.Radius, colorMap.MapPacked(glm::length(obj.getVelocity(m_FrameDt)), 50.0f) };
 	}
+	Sten::Renderer2D::DrawCircles(m_CircleInstances.data(), (uint32_t)m_CircleInstances.size());
 	glm::mat4 transform = glm::translate(glm::mat4(1.0f), { m_ConstraintCenter.x, -m_ConstraintCenter.y, 0.0f }) *
 		glm::scale(glm::mat4(1.0f), { m_ConstraintRadius * 2.0f, m_ConstraintRadius * 2.0f, 1.0f });
 	Sten::Renderer2D::DrawCircle({ transform, {.3f, .3f, .3f, 1} });
 }
+#endif
+
+void VerletIntegration::ApplyInput(const Sten::InputState& input, glm::vec2 viewportOffset, glm::vec2 viewportSize)
+{
+	m_InputActive = input.IsMouseButtonPressed(Sten::Mouse::ButtonLeft);
+	if (!m_InputActive)
+		return;
+
+	m_InputPosition = input.MousePosition - viewportOffset - viewportSize / 2.0f;
+	for (VerletObject& obj : m_Objects)
+	{
+		glm::vec2 diff = m_InputPosition - obj.Position;
+		float dist2 = diff.x * diff.x + diff.y * diff.y;
+		if (dist2 < 10000)
+		{
+			obj.addVelocity(diff / 5.0f, 1.0f/165.0f);
+		}
+	}
+}
 
 void VerletIntegration::ApplyGravity()
 {
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <Stengine.h>
+#include "Simulation.h"
 
 #include <glm/glm.hpp>
 #include <vector>
@@ -11,7 +11,6 @@ struct VerletObject
     glm::vec2 PositionLast;
     glm::vec2 Acceleration;
     float     Radius = 10.0f;
-    glm::vec4 Color = { 1, 1, 1, 1 };
 
     VerletObject() = default;
     VerletObject(glm::vec2 position, float radius)
@@ -61,13 +60,16 @@ public:
 		return m_Objects.emplace_back(position, radius);
 	}
 
-	void Step(glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt);
+	void Step(const Sten::InputState& input, glm::vec2 viewportOffset, glm::vec2 viewportSize, float dt);
+#ifndef FLUID_HEADLESS
 	void Render(glm::vec2 viewportOffset, glm::vec2 viewportSize);
+#endif
 private:
     void ApplyGravity();
     void CheckCollisions(float dt);
     void ApplyConstraint();
     void UpdateObjects(float dt);
+    void ApplyInput(const Sten::InputState& input, glm::vec2 viewportOffset, glm::vec2 viewportSize);
 private:
     uint32_t m_SubSteps = 1;
 	glm::vec2 m_Gravity = { 0.0f, 1000.0f };
@@ -76,4 +78,12 @@ private:
 	std::vector<VerletObject> m_Objects;
     float m_Time = 0.0f;
     float m_FrameDt = 0.0f;
+
+    // Position the objects are pulled towards while the left mouse button is held
+    glm::vec2 m_InputPosition = { 0.0f, 0.0f };
+    bool m_InputActive = false;
+
+#ifndef FLUID_HEADLESS
+    std::vector<Sten::CircleInstance> m_CircleInstances;
+#endif
 };
@@ -70,6 +70,7 @@ namespace Sten
 					element.Normalized ? GL_TRUE : GL_FALSE,
 					layout.GetStride(),
 					(const void*)element.Offset);
+				glVertexAttribDivisor(m_VertexBufferIndex, layout.IsPerInstance() ? 1 : 0);
 				m_VertexBufferIndex++;
 				break;
 			}
@@ -85,6 +86,7 @@ namespace Sten
 					ShaderDataTypeToOpenGLBaseType(element.Type),
 					layout.GetStride(),
 					(const void*)element.Offset);
+				glVertexAttribDivisor(m_VertexBufferIndex, layout.IsPerInstance() ? 1 : 0);
 				m_VertexBufferIndex++;
 				break;
 			}
@@ -41,6 +41,44 @@ namespace Sten
 		return GetMousePosition().y;
 	}
 
+	InputState Input::GetState()
+	{
+		// Ranges of the key codes that glfw defines, asking for any other one is an error
+		static const KeyCode s_KeyRanges[][2] = {
+			{ Key::Space, Key::Space },
+			{ Key::Apostrophe, Key::Apostrophe },
+			{ Key::Comma, Key::D9 },
+			{ Key::Semicolon, Key::Semicolon },
+			{ Key::Equal, Key::Equal },
+			{ Key::A, Key::RightBracket },
+			{ Key::GraveAccent, Key::GraveAccent },
+			{ Key::World1, Key::World2 },
+			{ Key::Escape, Key::End },
+			{ Key::CapsLock, Key::Pause },
+			{ Key::F1, Key::F25 },
+			{ Key::KP0, Key::KPEqual },
+			{ Key::LeftShift, Key::Menu }
+		};
+
+		auto* window = static_cast<GLFWwindow*>(Application::Get().GetWindow().GetNativeWindow());
+		InputState state;
+		state.MousePosition = GetMousePosition();
+
+		for (MouseCode button = 0; button <= Mouse::ButtonLast; button++)
+			state.MouseButtons[button] = glfwGetMouseButton(window, static_cast<int32_t>(button)) == GLFW_PRESS;
+
+		for (const auto& range : s_KeyRanges)
+		{
+			for (KeyCode key = range[0]; key <= range[1]; key++)
+			{
+				auto keyState = glfwGetKey(window, static_cast<int32_t>(key));
+				state.Keys[key] = keyState == GLFW_PRESS || keyState == GLFW_REPEAT;
+			}
+		}
+
+		return state;
+	}
+
 }
 
 #endif
\ No newline at end of file
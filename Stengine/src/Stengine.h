@@ -10,6 +10,7 @@
 
 // IO
 #include "Stengine/Core/Input.h"
+#include "Stengine/Core/InputState.h"
 #include "Stengine/Core/KeyCodes.h"
 #include "Stengine/Core/MouseCodes.h"
 // ----------------------------------------
@@ -1,5 +1,6 @@
 #include "stpch.h"
 #include "Stengine/Core/Application.h"
+#include "Stengine/Core/Input.h"
 
 #include "Stengine/Renderer/Renderer.h"
 
@@ -98,6 +99,8 @@ namespace Sten
 			Timestep timestep = time - m_LastFrameTime;
 			m_LastFrameTime = time;
 
+			m_InputState = Input::GetState();
+
 			if (!m_Minimized)
 			{
 				ST_PROFILE_SCOPE("LayerStack OnUpdate");
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Stengine/Core/InputState.h"
 #include "Stengine/Core/Timestep.h"
 
 #include "Stengine/Event/ApplicationEvent.h"
@@ -42,6 +43,8 @@ namespace Sten
 
 		inline Window& GetWindow() { return *m_Window; }
 		inline ImGuiLayer* GetImGuiLayer() const { return m_ImGuiLayer; }
+		// Input of the current frame, captured before the layers are updated
+		inline const InputState& GetInputState() const { return m_InputState; }
 
 		ApplicationCommandLineArgs GetCommandLineArgs() const { return m_CommandLineArgs; }
 
@@ -54,6 +57,7 @@ namespace Sten
 		ApplicationCommandLineArgs m_CommandLineArgs;
 		LayerStack m_LayerStack;
 		ImGuiLayer* m_ImGuiLayer;
+		InputState m_InputState;
 
 		bool m_Running = false;
 		bool m_Minimized = false;
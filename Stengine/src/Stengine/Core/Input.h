@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Stengine/Core/InputState.h"
 #include "Stengine/Core/KeyCodes.h"
 #include "Stengine/Core/MouseCodes.h"
 
@@ -16,5 +17,8 @@ namespace Sten
 		static glm::vec2 GetMousePosition();
 		static float GetMouseX();
 		static float GetMouseY();
+
+		// Polls the whole keyboard and mouse at once
+		static InputState GetState();
 	};
 }
\ No newline at end of file
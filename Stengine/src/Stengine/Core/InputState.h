@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Stengine/Core/KeyCodes.h"
+#include "Stengine/Core/MouseCodes.h"
+
+#include <glm/glm.hpp>
+#include <bitset>
+
+namespace Sten
+{
+	// Keyboard and mouse state, captured once per frame by the Application.
+	// It is plain data, so it can be handed to code that should not call into the platform
+	// layer, like simulation passes running on worker threads or in headless builds.
+	struct InputState
+	{
+		glm::vec2 MousePosition = { 0.0f, 0.0f };
+		std::bitset<Mouse::ButtonLast + 1> MouseButtons;
+		std::bitset<Key::Menu + 1> Keys;
+
+		bool IsKeyPressed(KeyCode key) const { return key < Keys.size() && Keys[key]; }
+		bool IsMouseButtonPressed(MouseCode button) const { return button < MouseButtons.size() && MouseButtons[button]; }
+	};
+}
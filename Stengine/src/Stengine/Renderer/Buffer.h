@@ -72,13 +72,15 @@ namespace Sten
 	public:
 		BufferLayout() = default;
 
-		BufferLayout(std::initializer_list<BufferElement> elements)
-			: m_Elements(elements)
+		// A per instance layout advances once per instance of an instanced draw, instead of once per vertex
+		BufferLayout(std::initializer_list<BufferElement> elements, bool perInstance = false)
+			: m_Elements(elements), m_PerInstance(perInstance)
 		{
 			CalculateOffsetsAndStride();
 		}
 
 		inline uint32_t GetStride() const { return m_Stride; }
+		inline bool IsPerInstance() const { return m_PerInstance; }
 		inline const std::vector<BufferElement>& GetElements() const { return m_Elements; }
 
 		std::vector<BufferElement>::iterator begin() { return m_Elements.begin(); }
@@ -99,6 +101,7 @@ namespace Sten
 	private:
 		std::vector<BufferElement> m_Elements;
 		uint32_t m_Stride = 0;
+		bool m_PerInstance = false;
 	};
 
 	class VertexBuffer
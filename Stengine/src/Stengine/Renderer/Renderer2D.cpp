@@ -43,6 +43,7 @@ namespace Sten
 		static const uint32_t MaxVertices = MaxQuads * 4;
 		static const uint32_t MaxIndices = MaxQuads * 6;
 		static const uint32_t MaxTextureSlots = 32;
+		static const uint32_t MaxCircleInstances = MaxQuads;
 
 		// Quad
 		Ref<VertexArray> QuadVertexArray;
@@ -65,6 +66,14 @@ namespace Sten
 		CircleVertex* CircleVertexBufferBase = nullptr;
 		CircleVertex* CircleVertexBufferPtr = nullptr;
 
+		// Instanced circles, a quad of corners that every instance offsets and scales
+		Ref<VertexArray> CircleInstanceVertexArray;
+		Ref<VertexBuffer> CircleInstanceBuffer;
+		Ref<Shader> CircleInstanceShader;
+
+		uint32_t CircleInstanceCount = 0;
+		CircleInstance* CircleInstanceBufferBase = nullptr;
+
 		std::array<Ref<Texture2D>, MaxTextureSlots> TextureSlots;
 		uint32_t TextureSlotIndex = 1; // 0 = white texture
 
@@ -131,6 +140,25 @@ namespace Sten
 		s_Data.CircleVertexArray->SetIndexBuffer(quadIB); // Use quad IB
 		s_Data.CircleVertexBufferBase = new CircleVertex[s_Data.MaxVertices];
 
+		// Instanced circles, the corners are -1 to 1 like the local positions of the circle vertices
+		float circleCorners[] = { -1.0f, -1.0f, 1.0f, -1.0f, 1.0f, 1.0f, -1.0f, 1.0f };
+		Ref<VertexBuffer> circleCornerBuffer = VertexBuffer::Create(circleCorners, sizeof(circleCorners));
+		circleCornerBuffer->SetLayout({
+			{ ShaderDataType::Float2,	"a_Corner"		}
+			});
+
+		s_Data.CircleInstanceVertexArray = VertexArray::Create();
+		s_Data.CircleInstanceBuffer = VertexBuffer::Create(s_Data.MaxCircleInstances * sizeof(CircleInstance));
+		s_Data.CircleInstanceBuffer->SetLayout(BufferLayout({
+			{ ShaderDataType::Float3,	"a_Position"	},
+			{ ShaderDataType::Float,	"a_Radius"		},
+			{ ShaderDataType::Int,		"a_Color"		}
+			}, true));
+		s_Data.CircleInstanceVertexArray->AddVertexBuffer(circleCornerBuffer);
+		s_Data.CircleInstanceVertexArray->AddVertexBuffer(s_Data.CircleInstanceBuffer);
+		s_Data.CircleInstanceVertexArray->SetIndexBuffer(quadIB); // The first quad of the quad IB
+		s_Data.CircleInstanceBufferBase = new CircleInstance[s_Data.MaxCircleInstances];
+
 		s_Data.WhiteTexture = Sten::Texture2D::Create(1, 1);
 		uint32_t whiteTextureData = 0xffffffff;
 		s_Data.WhiteTexture->SetData(&whiteTextureData);
@@ -141,6 +169,7 @@ namespace Sten
 
 		s_Data.QuadShader = Shader::Create("Renderer2D_Quad", "assets/shaders/Renderer2D_Quad.vert", "assets/shaders/Renderer2D_Quad.frag");
 		s_Data.CircleShader = Shader::Create("Renderer2D_Circle", "assets/shaders/Renderer2D_Circle.vert", "assets/shaders/Renderer2D_Circle.frag");
+		s_Data.CircleInstanceShader = Shader::Create("Renderer2D_CircleInstanced", "assets/shaders/Renderer2D_CircleInstanced.vert", "assets/shaders/Renderer2D_Circle.frag");
 
 		s_Data.TextureSlots[0] = s_Data.WhiteTexture;
 
@@ -157,6 +186,7 @@ namespace Sten
 		ST_PROFILE_FUNCTION();
 
 		delete[] s_Data.QuadVertexBufferBase;
+		delete[] s_Data.CircleInstanceBufferBase;
 	}
 
 	void Renderer2D::BeginScene(const glm::mat4& projection, const glm::mat4& transform)
@@ -205,6 +235,8 @@ namespace Sten
 		s_Data.CircleIndexCount = 0;
 		s_Data.CircleVertexBufferPtr = s_Data.CircleVertexBufferBase;
 
+		s_Data.CircleInstanceCount = 0;
+
 		s_Data.TextureSlotIndex = 1;
 	}
 
@@ -234,6 +266,15 @@ namespace Sten
 			RenderCommand::DrawIndexed(s_Data.CircleVertexArray, s_Data.CircleIndexCount);
 			s_Data.Stats.DrawCalls++;
 		}
+
+		if (s_Data.CircleInstanceCount)
+		{
+			s_Data.CircleInstanceBuffer->SetData(s_Data.CircleInstanceBufferBase, s_Data.CircleInstanceCount * sizeof(CircleInstance));
+
+			s_Data.CircleInstanceShader->Bind();
+			RenderCommand::DrawIndexedInstanced(s_Data.CircleInstanceVertexArray, 6, s_Data.CircleInstanceCount);
+			s_Data.Stats.DrawCalls++;
+		}
 	}
 
 	void Renderer2D::NextBatch()
@@ -399,6 +440,25 @@ namespace Sten
 		s_Data.Stats.QuadCount++;
 	}
 
+	void Renderer2D::DrawCircles(const CircleInstance* circles, uint32_t count)
+	{
+		ST_PROFILE_FUNCTION();
+
+		while (count > 0)
+		{
+			if (s_Data.CircleInstanceCount == Renderer2DData::MaxCircleInstances)
+				NextBatch();
+
+			uint32_t batchCount = std::min(count, Renderer2DData::MaxCircleInstances - s_Data.CircleInstanceCount);
+			memcpy(s_Data.CircleInstanceBufferBase + s_Data.CircleInstanceCount, circles, batchCount * sizeof(CircleInstance));
+
+			s_Data.CircleInstanceCount += batchCount;
+			s_Data.Stats.QuadCount += batchCount;
+			circles += batchCount;
+			count -= batchCount;
+		}
+	}
+
 	void Renderer2D::ResetStats()
 	{
 		memset(&s_Data.Stats, 0, sizeof(Renderer2D::Statistics));
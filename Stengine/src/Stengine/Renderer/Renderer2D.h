@@ -32,6 +32,14 @@ namespace Sten
 		int EntityID = -1;
 	};
 
+	// Filled circle drawn through instancing, a fraction of the data a Circle needs
+	struct CircleInstance
+	{
+		glm::vec3 Position;
+		float Radius;
+		uint32_t Color;		// RGBA8, as packed by glm::packUnorm4x8
+	};
+
 	class Renderer2D
 	{
 	public:
@@ -68,6 +76,9 @@ namespace Sten
 		static void DrawQuad(const Quad& quad);
 
 		static void DrawCircle(const Circle& circle);
+		// Meant for large numbers of circles, like particles. Every circle is a single instance record
+		// instead of four vertices, and they are all drawn with one instanced draw call per batch
+		static void DrawCircles(const CircleInstance* circles, uint32_t count);
 
 		struct Statistics
 		{
@@ -14,6 +14,12 @@ workspace "FluidSim"
 		"MultiProcessorCompile"
 	}
 
+newoption
+{
+	trigger = "avx2",
+	description = "Build the simulation kernels with 8 wide AVX2 instead of SSE2, needs a Haswell or newer cpu"
+}
+
 -- The output directory based on the configurations
 outputdir = "%{cfg.buildcfg}-%{cfg.system}-%{cfg.architecture}"
 
@@ -47,3 +53,4 @@ group "" -- End the solution folder here
 -- Include the premake5.lua files inside these project folders so that they get added to the build system
 include "Stengine"
 include "FluidSim"
+include "FluidBench"